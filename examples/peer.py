@@ -0,0 +1,37 @@
+#!/usr/bin/env python
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+# This example shows a direct (peer to peer) connection between a client and
+# a server, without a message bus. Run it without arguments to start the
+# server, and with the printed address as its argument to call it.
+
+import sys
+from tdbus import *
+
+IFACE_EXAMPLE = 'com.example'
+
+
+class ExampleHandler(DBusHandler):
+
+    @method(interface=IFACE_EXAMPLE)
+    def Hello(self, message):
+        name = message.get_args()[0]
+        self.set_response('s', ('Hello, %s!' % name,))
+
+
+if len(sys.argv) == 1:
+    server = SimpleDBusServer('unix:tmpdir=/tmp')
+    server.add_handler(ExampleHandler())
+    print 'Listening on %s' % server.get_address()
+    print 'Press CTRL-C to exit'
+    server.dispatch()
+else:
+    conn = SimpleDBusConnection(sys.argv[1], register=False)
+    reply = conn.call_method('/', 'Hello', IFACE_EXAMPLE, 's', ('world',))
+    print reply.get_args()[0]
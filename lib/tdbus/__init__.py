@@ -6,12 +6,18 @@
 # Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
 # complete list.
 
-from tdbus._tdbus import DBUS_BUS_SESSION, DBUS_BUS_SYSTEM
-from tdbus.connection import DBusConnection, DBusError
-from tdbus.handler import DBusHandler, method, signal_handler
-from tdbus.select import SimpleDBusConnection
+from tdbus._tdbus import DBUS_BUS_SESSION, DBUS_BUS_SYSTEM, UnixFd
+from tdbus.connection import DBusConnection, DBusError, WouldBlock
+from tdbus.server import DBusServer
+from tdbus.handler import DBusHandler, method, signal_handler, dbus_property
+from tdbus.select import SimpleDBusConnection, SimpleDBusServer
+from tdbus.pool import ConnectionPool
+from tdbus.worker import WorkerPool
+from tdbus.proxy import Proxy, SignatureCache
+from tdbus.properties import PropertyCache
+from tdbus.objectmanager import ObjectManager
 
 try:
-    from tdbus.gevent import GEventDBusConnection
+    from tdbus.gevent import GEventDBusConnection, GEventDBusServer
 except ImportError:
     pass
@@ -15,6 +15,10 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <time.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 #include <dbus/dbus.h>
 
@@ -58,11 +62,122 @@
 
 
 static PyObject *tdbus_Error = NULL;
+static PyObject *tdbus_WouldBlock = NULL;
 static int tdbus_app_slot = -1;
+static int tdbus_pending_slot = -1;
+
+/*
+ * Threads. Callbacks from libdbus run in whatever thread called into libdbus,
+ * and libdbus may hold a connection lock while it calls them. Callbacks
+ * therefore acquire the GIL themselves, and calls into libdbus that may take
+ * a connection or server lock are made with the GIL released. A thread must
+ * never wait for a libdbus lock while it holds the GIL, because the thread
+ * that holds the lock may be waiting for the GIL in a callback.
+ *
+ * All other mutable state of the objects in this module is only accessed
+ * with the GIL held, and is protected by it.
+ */
+
+#define WITHOUT_GIL(stmt) \
+    do { Py_BEGIN_ALLOW_THREADS stmt; Py_END_ALLOW_THREADS } while (0)
 
 void _tdbus_decref(void *data)
 {
+    PyGILState_STATE gstate;
+
+    gstate = PyGILState_Ensure();
     Py_DECREF((PyObject *) data);
+    PyGILState_Release(gstate);
+}
+
+
+/*
+ * Tracing
+ *
+ * Trace points are placed where messages are sent, where they enter the
+ * filter callback, where method returns are delivered to a pending call,
+ * and around the handling of watches (this is where the socket is read and
+ * written). Message events carry the serial, the member and the wire size
+ * of the message. Watch events carry the file descriptor and the flags.
+ *
+ * When sys/sdt.h is available the trace points are also USDT probes in the
+ * "tdbus" provider. Each probe has a semaphore, so that the arguments are
+ * only computed when a tracer is attached. When neither a tracer nor a
+ * Python hook is installed, a trace point costs a single branch.
+ */
+
+static PyObject *tdbus_trace_hook = NULL;
+
+#ifdef HAVE_SYS_SDT_H
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TRACE_SEMAPHORE(probe) \
+    volatile unsigned short tdbus_##probe##_semaphore \
+            __attribute__((unused)) __attribute__((section(".probes")))
+
+TRACE_SEMAPHORE(send);
+TRACE_SEMAPHORE(filter);
+TRACE_SEMAPHORE(reply);
+TRACE_SEMAPHORE(watch_handle);
+TRACE_SEMAPHORE(watch_handled);
+
+#define TRACE_ENABLED(probe) \
+    __builtin_expect((tdbus_trace_hook != NULL) | tdbus_##probe##_semaphore, 0)
+#define TRACE_PROBE2(probe, a1, a2) DTRACE_PROBE2(tdbus, probe, a1, a2)
+#define TRACE_PROBE3(probe, a1, a2, a3) DTRACE_PROBE3(tdbus, probe, a1, a2, a3)
+
+#else
+
+#define TRACE_ENABLED(probe) __builtin_expect(tdbus_trace_hook != NULL, 0)
+#define TRACE_PROBE2(probe, a1, a2) do { } while (0)
+#define TRACE_PROBE3(probe, a1, a2, a3) do { } while (0)
+
+#endif
+
+#define TRACE_MESSAGE(probe, serial, message) \
+    do { if (TRACE_ENABLED(probe)) { \
+        const char *_member = dbus_message_get_member(message); \
+        long _size = _tdbus_message_get_size(message); \
+        TRACE_PROBE3(probe, serial, _member, _size); \
+        _tdbus_trace_call("(skzl)", #probe, (unsigned long) (serial), \
+                          _member, _size); \
+    } } while (0)
+
+#define TRACE_WATCH(probe, fd, flags) \
+    do { if (TRACE_ENABLED(probe)) { \
+        TRACE_PROBE2(probe, fd, flags); \
+        _tdbus_trace_call("(sii)", #probe, fd, flags); \
+    } } while (0)
+
+/* Call the Python trace hook. Errors raised by the hook are ignored, and an
+ * exception that is already set is preserved. */
+
+static void
+_tdbus_trace_call(const char *format, ...)
+{
+    va_list ap;
+    PyObject *Phook, *Pargs, *Presult = NULL;
+    PyObject *Ptype, *Pvalue, *Ptraceback;
+
+    if ((Phook = tdbus_trace_hook) == NULL)
+        return;
+    Py_INCREF(Phook);
+    PyErr_Fetch(&Ptype, &Pvalue, &Ptraceback);
+    va_start(ap, format);
+    Pargs = Py_VaBuildValue(format, ap);
+    va_end(ap);
+    if (Pargs != NULL) {
+        Presult = PyObject_Call(Phook, Pargs, NULL);
+        Py_DECREF(Pargs);
+    }
+    if (Presult != NULL)
+        Py_DECREF(Presult);
+    else
+        PyErr_Clear();
+    PyErr_Restore(Ptype, Pvalue, Ptraceback);
+    Py_DECREF(Phook);
 }
 
 
@@ -95,14 +210,11 @@ tdbus_watch_dealloc(PyTDBusWatchObject *self)
 }
 
 static PyObject *
-tdbus_watch_get_fd(PyTDBusWatchObject *self, PyObject *args)
+tdbus_watch_get_fd(PyTDBusWatchObject *self, PyObject *noargs)
 {
     long fd;
     PyObject *Pfd;
 
-    if (!PyArg_ParseTuple(args, ":get_fd"))
-        return NULL;
-
     fd = dbus_watch_get_unix_fd(self->watch);
     if (fd == -1)
         fd = dbus_watch_get_socket(self->watch);
@@ -115,14 +227,11 @@ error:
 }
 
 static PyObject *
-tdbus_watch_get_flags(PyTDBusWatchObject *self, PyObject *args)
+tdbus_watch_get_flags(PyTDBusWatchObject *self, PyObject *noargs)
 {
     int flags;
     PyObject *Pflags;
 
-    if (!PyArg_ParseTuple(args, ":get_flags"))
-        return NULL;
-
     flags = dbus_watch_get_flags(self->watch);
     Pflags = PyInt_FromLong(flags);
     CHECK_PYTHON_ERROR(Pflags == NULL);
@@ -133,14 +242,11 @@ error:
 }
 
 static PyObject *
-tdbus_watch_get_enabled(PyTDBusWatchObject *self, PyObject *args)
+tdbus_watch_get_enabled(PyTDBusWatchObject *self, PyObject *noargs)
 {
     int enabled;
     PyObject *Penabled;
 
-    if (!PyArg_ParseTuple(args, ":get_enabled"))
-        return NULL;
-
     enabled = dbus_watch_get_enabled(self->watch);
     Penabled = PyBool_FromLong(enabled);
     CHECK_PYTHON_ERROR(Penabled == NULL);
@@ -151,11 +257,8 @@ error:
 }
 
 static PyObject *
-tdbus_watch_get_data(PyTDBusWatchObject *self, PyObject *args)
+tdbus_watch_get_data(PyTDBusWatchObject *self, PyObject *noargs)
 {
-    if (!PyArg_ParseTuple(args, ":get_data"))
-        return NULL;
-
     if (self->data == NULL) {
         Py_INCREF(Py_None);
         return Py_None;
@@ -164,13 +267,8 @@ tdbus_watch_get_data(PyTDBusWatchObject *self, PyObject *args)
 }
 
 static PyObject *
-tdbus_watch_set_data(PyTDBusWatchObject *self, PyObject *args)
+tdbus_watch_set_data(PyTDBusWatchObject *self, PyObject *data)
 {
-    PyObject *data;
-
-    if (!PyArg_ParseTuple(args, "O:set_data", &data))
-        return NULL;
-
     if (self->data != NULL)
         Py_DECREF(self->data);
     if (data == Py_None) {
@@ -185,14 +283,19 @@ tdbus_watch_set_data(PyTDBusWatchObject *self, PyObject *args)
 }
 
 static PyObject *
-tdbus_watch_handle(PyTDBusWatchObject *self, PyObject *args)
+tdbus_watch_handle(PyTDBusWatchObject *self, PyObject *Parg)
 {
-    int flags, ret;
+    int flags, ret, fd;
 
-    if (!PyArg_ParseTuple(args, "i:handle", &flags))
+    if (!PyArg_Parse(Parg, "i:handle", &flags))
         return NULL;
 
-    ret = dbus_watch_handle(self->watch, flags);
+    /* Handling the watch can remove and free it, so it is not used after
+     * dbus_watch_handle(). */
+    fd = dbus_watch_get_unix_fd(self->watch);
+    TRACE_WATCH(watch_handle, fd, flags);
+    WITHOUT_GIL(ret = dbus_watch_handle(self->watch, flags));
+    TRACE_WATCH(watch_handled, fd, flags);
     CHECK_MEMORY_ERROR(ret == FALSE);
     Py_INCREF(Py_None);
     return Py_None;
@@ -203,12 +306,12 @@ error:
 
 static PyMethodDef tdbus_watch_methods[] = \
 {
-    { "get_fd", (PyCFunction) tdbus_watch_get_fd, METH_VARARGS },
-    { "get_flags", (PyCFunction) tdbus_watch_get_flags, METH_VARARGS },
-    { "get_enabled", (PyCFunction) tdbus_watch_get_enabled, METH_VARARGS },
-    { "get_data", (PyCFunction) tdbus_watch_get_data, METH_VARARGS },
-    { "set_data", (PyCFunction) tdbus_watch_set_data, METH_VARARGS },
-    { "handle", (PyCFunction) tdbus_watch_handle, METH_VARARGS },
+    { "get_fd", (PyCFunction) tdbus_watch_get_fd, METH_NOARGS },
+    { "get_flags", (PyCFunction) tdbus_watch_get_flags, METH_NOARGS },
+    { "get_enabled", (PyCFunction) tdbus_watch_get_enabled, METH_NOARGS },
+    { "get_data", (PyCFunction) tdbus_watch_get_data, METH_NOARGS },
+    { "set_data", (PyCFunction) tdbus_watch_set_data, METH_O },
+    { "handle", (PyCFunction) tdbus_watch_handle, METH_O },
     { NULL }
 };
 
@@ -242,14 +345,11 @@ tdbus_timeout_dealloc(PyTDBusTimeoutObject *self)
 }
 
 static PyObject *
-tdbus_timeout_get_interval(PyTDBusTimeoutObject *self, PyObject *args)
+tdbus_timeout_get_interval(PyTDBusTimeoutObject *self, PyObject *noargs)
 {
     int timeout;
     PyObject *Ptimeout;
 
-    if (!PyArg_ParseTuple(args, ":get_interval"))
-        return NULL;
-
     timeout = dbus_timeout_get_interval(self->timeout);
     Ptimeout = PyInt_FromLong(timeout);
     CHECK_PYTHON_ERROR(Ptimeout == NULL);
@@ -260,14 +360,11 @@ error:
 }
 
 static PyObject *
-tdbus_timeout_get_enabled(PyTDBusTimeoutObject *self, PyObject *args)
+tdbus_timeout_get_enabled(PyTDBusTimeoutObject *self, PyObject *noargs)
 {
     int enabled;
     PyObject *Penabled;
 
-    if (!PyArg_ParseTuple(args, ":get_enabled"))
-        return NULL;
-
     enabled = dbus_timeout_get_enabled(self->timeout);
     Penabled = PyBool_FromLong(enabled);
     CHECK_PYTHON_ERROR(Penabled == NULL);
@@ -278,11 +375,8 @@ error:
 }
 
 static PyObject *
-tdbus_timeout_get_data(PyTDBusTimeoutObject *self, PyObject *args)
+tdbus_timeout_get_data(PyTDBusTimeoutObject *self, PyObject *noargs)
 {
-    if (!PyArg_ParseTuple(args, ":get_data"))
-        return NULL;
-
     if (self->data == NULL) {
         Py_INCREF(Py_None);
         return Py_None;
@@ -291,13 +385,8 @@ tdbus_timeout_get_data(PyTDBusTimeoutObject *self, PyObject *args)
 }
 
 static PyObject *
-tdbus_timeout_set_data(PyTDBusTimeoutObject *self, PyObject *args)
+tdbus_timeout_set_data(PyTDBusTimeoutObject *self, PyObject *data)
 {
-    PyObject *data;
-
-    if (!PyArg_ParseTuple(args, "O:set_data", &data))
-        return NULL;
-
     if (self->data != NULL)
         Py_DECREF(self->data);
     if (data == Py_None) {
@@ -312,14 +401,11 @@ tdbus_timeout_set_data(PyTDBusTimeoutObject *self, PyObject *args)
 }
 
 static PyObject *
-tdbus_timeout_handle(PyTDBusTimeoutObject *self, PyObject *args)
+tdbus_timeout_handle(PyTDBusTimeoutObject *self, PyObject *noargs)
 {
     int ret;
 
-    if (!PyArg_ParseTuple(args, ":handle"))
-        return NULL;
-
-    ret = dbus_timeout_handle(self->timeout);
+    WITHOUT_GIL(ret = dbus_timeout_handle(self->timeout));
     CHECK_MEMORY_ERROR(ret == FALSE);
     Py_INCREF(Py_None);
     return Py_None;
@@ -330,11 +416,361 @@ error:
 
 PyMethodDef tdbus_timeout_methods[] = \
 {
-    { "get_interval", (PyCFunction) tdbus_timeout_get_interval, METH_VARARGS },
-    { "get_enabled", (PyCFunction) tdbus_timeout_get_enabled, METH_VARARGS },
-    { "get_data", (PyCFunction) tdbus_timeout_get_data, METH_VARARGS },
-    { "set_data", (PyCFunction) tdbus_timeout_set_data, METH_VARARGS },
-    { "handle", (PyCFunction) tdbus_timeout_handle, METH_VARARGS },
+    { "get_interval", (PyCFunction) tdbus_timeout_get_interval, METH_NOARGS },
+    { "get_enabled", (PyCFunction) tdbus_timeout_get_enabled, METH_NOARGS },
+    { "get_data", (PyCFunction) tdbus_timeout_get_data, METH_NOARGS },
+    { "set_data", (PyCFunction) tdbus_timeout_set_data, METH_O },
+    { "handle", (PyCFunction) tdbus_timeout_handle, METH_NOARGS },
+    { NULL }
+};
+
+
+/*
+ * Histogram object: latency distributions
+ *
+ * The buckets are log-linear, like HDR histograms: every power of two is
+ * split into HISTOGRAM_SUB_COUNT linear sub-buckets, which gives a
+ * relative precision of 12.5%. A bucket holds the values above the upper
+ * bound of the previous bucket up to and including its own upper bound,
+ * like a Prometheus bucket, so that powers of two are bucket bounds.
+ * Values are in microseconds, and values above 2^HISTOGRAM_MAX_BITS go
+ * into the last bucket. Updates use atomic operations and never take a
+ * lock.
+ */
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+#define ATOMIC_ADD(var, value) __atomic_fetch_add(&(var), value, __ATOMIC_RELAXED)
+#define ATOMIC_LOAD(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#define ATOMIC_EXCHANGE(var, value) __atomic_exchange_n(&(var), value, __ATOMIC_RELAXED)
+
+typedef struct
+{
+    PyObject_HEAD
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} PyTDBusHistogramObject;
+
+static PyTypeObject PyTDBusHistogramType =
+{
+    PyObject_HEAD_INIT(NULL) 0,
+    "_tdbus.Histogram",
+    sizeof(PyTDBusHistogramObject)
+};
+
+static uint64_t
+_tdbus_monotonic_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+_tdbus_histogram_index(uint64_t value)
+{
+    int exp;
+
+    /* Upper bounds are inclusive: look up value - 1 in buckets with
+     * exclusive upper bounds. Both 0 and 1 go into the first bucket. */
+    if (value > 0)
+        value--;
+    if (value < HISTOGRAM_SUB_COUNT)
+        return (int) value;
+    exp = 63 - __builtin_clzll(value);
+    if (exp >= HISTOGRAM_MAX_BITS)
+        return HISTOGRAM_BUCKETS - 1;
+    return (exp - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT +
+            (int) ((value >> (exp - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_COUNT);
+}
+
+static uint64_t
+_tdbus_histogram_upper_bound(int index)
+{
+    int exp, sub;
+
+    if (index < HISTOGRAM_SUB_COUNT)
+        return index + 1;
+    exp = index / HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_BITS - 1;
+    sub = index % HISTOGRAM_SUB_COUNT;
+    return (uint64_t) (HISTOGRAM_SUB_COUNT + sub + 1) << (exp - HISTOGRAM_SUB_BITS);
+}
+
+static void
+_tdbus_histogram_record(PyTDBusHistogramObject *self, uint64_t value)
+{
+    ATOMIC_ADD(self->buckets[_tdbus_histogram_index(value)], 1);
+    ATOMIC_ADD(self->sum, value);
+    ATOMIC_ADD(self->count, 1);
+}
+
+static PyTDBusHistogramObject *
+_tdbus_histogram_new(void)
+{
+    PyTDBusHistogramObject *Phistogram;
+
+    Phistogram = PyObject_New(PyTDBusHistogramObject, &PyTDBusHistogramType);
+    if (Phistogram == NULL)
+        return NULL;
+    Phistogram->count = Phistogram->sum = 0;
+    memset(Phistogram->buckets, 0, sizeof(Phistogram->buckets));
+    return Phistogram;
+}
+
+static void
+tdbus_histogram_dealloc(PyTDBusHistogramObject *self)
+{
+    PyObject_Del(self);
+}
+
+static PyObject *
+tdbus_histogram_record(PyTDBusHistogramObject *self, PyObject *Parg)
+{
+    unsigned long long value;
+
+    if (!PyArg_Parse(Parg, "K:record", &value))
+        return NULL;
+
+    _tdbus_histogram_record(self, value);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *
+tdbus_histogram_get_count(PyTDBusHistogramObject *self, PyObject *noargs)
+{
+    return PyLong_FromUnsignedLongLong(ATOMIC_LOAD(self->count));
+}
+
+static PyObject *
+tdbus_histogram_snapshot(PyTDBusHistogramObject *self, PyObject *args)
+{
+    int i, reset = 0;
+    uint64_t count, sum, value;
+    PyObject *Pbuckets = NULL, *Pbucket = NULL, *Psnapshot = NULL;
+
+    if (!PyArg_ParseTuple(args, "|i:snapshot", &reset))
+        return NULL;
+
+    /* Without a lock, a snapshot is not an exact point in time: counts
+     * can be added while we read. When resetting, every recorded value
+     * ends up in exactly one snapshot. */
+    Pbuckets = PyList_New(0);
+    CHECK_PYTHON_ERROR(Pbuckets == NULL);
+    if (reset) {
+        count = ATOMIC_EXCHANGE(self->count, 0);
+        sum = ATOMIC_EXCHANGE(self->sum, 0);
+    } else {
+        count = ATOMIC_LOAD(self->count);
+        sum = ATOMIC_LOAD(self->sum);
+    }
+    for (i=0; i<HISTOGRAM_BUCKETS; i++) {
+        if (reset)
+            value = ATOMIC_EXCHANGE(self->buckets[i], 0);
+        else
+            value = ATOMIC_LOAD(self->buckets[i]);
+        if (value == 0)
+            continue;
+        Pbucket = Py_BuildValue("(KK)", (unsigned long long) _tdbus_histogram_upper_bound(i),
+                                (unsigned long long) value);
+        CHECK_PYTHON_ERROR(Pbucket == NULL);
+        CHECK_PYTHON_ERROR(PyList_Append(Pbuckets, Pbucket) < 0);
+        Py_DECREF(Pbucket); Pbucket = NULL;
+    }
+    Psnapshot = Py_BuildValue("{sKsKsO}", "count", (unsigned long long) count,
+                              "sum", (unsigned long long) sum, "buckets", Pbuckets);
+    CHECK_PYTHON_ERROR(Psnapshot == NULL);
+    Py_DECREF(Pbuckets);
+    return Psnapshot;
+
+error:
+    if (Pbuckets != NULL) Py_DECREF(Pbuckets);
+    if (Pbucket != NULL) Py_DECREF(Pbucket);
+    return NULL;
+}
+
+static PyObject *
+tdbus_histogram_reset(PyTDBusHistogramObject *self, PyObject *noargs)
+{
+    int i;
+
+    for (i=0; i<HISTOGRAM_BUCKETS; i++)
+        ATOMIC_EXCHANGE(self->buckets[i], 0);
+    ATOMIC_EXCHANGE(self->sum, 0);
+    ATOMIC_EXCHANGE(self->count, 0);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static int
+tdbus_histogram_init(PyTDBusHistogramObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = { NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "", kwlist))
+        return -1;
+    return 0;
+}
+
+static PyMethodDef tdbus_histogram_methods[] = \
+{
+    { "record", (PyCFunction) tdbus_histogram_record, METH_O },
+    { "get_count", (PyCFunction) tdbus_histogram_get_count, METH_NOARGS },
+    { "snapshot", (PyCFunction) tdbus_histogram_snapshot, METH_VARARGS },
+    { "reset", (PyCFunction) tdbus_histogram_reset, METH_NOARGS },
+    { NULL }
+};
+
+
+/*
+ * UnixFd object: a file descriptor that is passed in a message
+ *
+ * The object owns its file descriptor and closes it when it is garbage
+ * collected, unless ownership is taken away with take().
+ */
+
+typedef struct
+{
+    PyObject_HEAD
+    int fd;
+} PyTDBusUnixFdObject;
+
+static PyTypeObject PyTDBusUnixFdType =
+{
+    PyObject_HEAD_INIT(NULL) 0,
+    "_tdbus.UnixFd",
+    sizeof(PyTDBusUnixFdObject)
+};
+
+/* Return the file descriptor of `obj`, which can be a UnixFd, an integer
+ * or an object with a fileno() method. The caller does not own it. */
+
+static int
+_tdbus_get_fd(PyObject *obj)
+{
+    int fd;
+    PyObject *Pfd = NULL;
+
+    if (PyObject_TypeCheck(obj, &PyTDBusUnixFdType)) {
+        fd = ((PyTDBusUnixFdObject *) obj)->fd;
+        if (fd == -1)
+            RETURN_ERROR("file descriptor is closed");
+        return fd;
+    }
+    if (PyInt_Check(obj) || PyLong_Check(obj)) {
+        Py_INCREF(obj);
+        Pfd = obj;
+    } else if (PyObject_HasAttrString(obj, "fileno")) {
+        Pfd = PyObject_CallMethod(obj, "fileno", NULL);
+        CHECK_PYTHON_ERROR(Pfd == NULL);
+    } else
+        RETURN_ERROR("expecting an int or an object with a fileno() method");
+    fd = PyInt_AsLong(Pfd);
+    Py_DECREF(Pfd);
+    if (fd == -1 && PyErr_Occurred())
+        RETURN_ERROR(NULL);
+    if (fd < 0)
+        RETURN_ERROR("illegal file descriptor: %d", fd);
+    return fd;
+
+error:
+    return -1;
+}
+
+static PyTDBusUnixFdObject *
+_tdbus_unix_fd_new(int fd)
+{
+    PyTDBusUnixFdObject *Pfd;
+
+    if ((Pfd = PyObject_New(PyTDBusUnixFdObject, &PyTDBusUnixFdType)) == NULL)
+        return NULL;
+    Pfd->fd = fd;
+    return Pfd;
+}
+
+static int
+tdbus_unix_fd_init(PyTDBusUnixFdObject *self, PyObject *args, PyObject *kwargs)
+{
+    int fd;
+    PyObject *Pfd;
+    static char *kwlist[] = { "fd", NULL };
+
+    /* The object is zeroed by tp_new, but 0 is a valid descriptor. */
+    self->fd = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", kwlist, &Pfd))
+        return -1;
+
+    if ((fd = _tdbus_get_fd(Pfd)) == -1)
+        return -1;
+    if ((self->fd = dup(fd)) == -1) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+tdbus_unix_fd_dealloc(PyTDBusUnixFdObject *self)
+{
+    if (self->fd != -1) {
+        close(self->fd);
+        self->fd = -1;
+    }
+    PyObject_Del(self);
+}
+
+static PyObject *
+tdbus_unix_fd_fileno(PyTDBusUnixFdObject *self, PyObject *noargs)
+{
+    if (self->fd == -1)
+        RETURN_ERROR("file descriptor is closed");
+
+    return PyInt_FromLong(self->fd);
+
+error:
+    return NULL;
+}
+
+static PyObject *
+tdbus_unix_fd_take(PyTDBusUnixFdObject *self, PyObject *noargs)
+{
+    int fd;
+
+    if (self->fd == -1)
+        RETURN_ERROR("file descriptor is closed");
+
+    fd = self->fd;
+    self->fd = -1;
+    return PyInt_FromLong(fd);
+
+error:
+    return NULL;
+}
+
+static PyObject *
+tdbus_unix_fd_close(PyTDBusUnixFdObject *self, PyObject *noargs)
+{
+    if (self->fd != -1) {
+        close(self->fd);
+        self->fd = -1;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyMethodDef tdbus_unix_fd_methods[] = \
+{
+    { "fileno", (PyCFunction) tdbus_unix_fd_fileno, METH_NOARGS },
+    { "take", (PyCFunction) tdbus_unix_fd_take, METH_NOARGS },
+    { "close", (PyCFunction) tdbus_unix_fd_close, METH_NOARGS },
     { NULL }
 };
 
@@ -347,6 +783,7 @@ typedef struct
 {
     PyObject_HEAD
     DBusMessage *message;
+    uint64_t timestamp;
 } PyTDBusMessageObject;
 
 PyTypeObject PyTDBusMessageType =
@@ -430,7 +867,7 @@ tdbus_message_init(PyTDBusMessageObject *self, PyObject *args, PyObject *kwargs)
     static char *kwlist[] = { "type", "no_reply", "auto_start", "path",
             "interface", "member", "error_name", "reply_serial", "destination", NULL };
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|iissssIs", kwlist, &type, &no_reply,
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|iissssIz", kwlist, &type, &no_reply,
                 &auto_start, &path, &interface, &member, &error_name, &reply_serial, &destination))
         return -1;
 
@@ -480,8 +917,10 @@ error:
 static void
 tdbus_message_dealloc(PyTDBusMessageObject *self)
 {
+    /* Releasing a received message updates the size counters of its
+     * connection, which takes the connection lock. */
     if (self->message) {
-        dbus_message_unref(self->message);
+        WITHOUT_GIL(dbus_message_unref(self->message));
         self->message = NULL;
     }
     PyObject_Del(self);
@@ -499,15 +938,84 @@ typedef union
     uint64_t u64;
     char *str;
     double dbl;
+    int fd;
 } _tdbus_basic_value;
 
+/* Intern cache for short, repeated strings: header fields, variant
+ * signatures and dict keys. This is a direct mapped table keyed by the C
+ * string, so that a hit does not allocate, and a collision simply replaces
+ * the old entry. Equal strings that come from the cache are the same
+ * object. Only used with the GIL held. */
+
+#define INTERN_CACHE_SIZE 512
+#define INTERN_MAX_LENGTH 64
+
+typedef struct
+{
+    char key[INTERN_MAX_LENGTH+1];
+    PyObject *value;
+} _tdbus_intern_entry;
+
+static _tdbus_intern_entry _tdbus_intern_str[INTERN_CACHE_SIZE];
+static _tdbus_intern_entry _tdbus_intern_unicode[INTERN_CACHE_SIZE];
+
+static PyObject *
+_tdbus_intern(_tdbus_intern_entry *cache, const char *str, int unicode)
+{
+    size_t len;
+    unsigned int hash = 2166136261U;
+    const char *ptr;
+    _tdbus_intern_entry *entry;
+    PyObject *Pvalue;
+
+    for (ptr = str; *ptr && ptr - str <= INTERN_MAX_LENGTH; ptr++)
+        hash = (hash ^ (unsigned char) *ptr) * 16777619U;
+    len = ptr - str;
+    if (len > INTERN_MAX_LENGTH)
+        entry = NULL;
+    else {
+        entry = &cache[hash % INTERN_CACHE_SIZE];
+        if (entry->value != NULL && !strcmp(entry->key, str)) {
+            Py_INCREF(entry->value);
+            return entry->value;
+        }
+    }
+    if (unicode) {
+        if (entry == NULL)
+            len = strlen(str);
+        Pvalue = PyUnicode_DecodeUTF8(str, len, NULL);
+    } else {
+        Pvalue = PyString_FromString(str);
+        if (Pvalue != NULL && entry != NULL)
+            PyString_InternInPlace(&Pvalue);
+    }
+    if (Pvalue == NULL || entry == NULL)
+        return Pvalue;
+    Py_XDECREF(entry->value);
+    memcpy(entry->key, str, len+1);
+    Py_INCREF(Pvalue);
+    entry->value = Pvalue;
+    return Pvalue;
+}
+
+static PyObject *
+_tdbus_intern_string(const char *str)
+{
+    return _tdbus_intern(_tdbus_intern_str, str, 0);
+}
+
+static PyObject *
+_tdbus_intern_unicode_string(const char *str)
+{
+    return _tdbus_intern(_tdbus_intern_unicode, str, 1);
+}
+
 #define DEFINE_MESSAGE_GETTER(name, ctype, py_convert, none_value) \
     static PyObject *tdbus_message_get_ ## name(PyTDBusMessageObject *self, \
-                                               PyObject *args) \
+                                               PyObject *noargs) \
     { \
         ctype value; PyObject *Pvalue; \
         if (self->message == NULL) RETURN_ERROR("uninitialized object"); \
-        if (!PyArg_ParseTuple(args, ":get_" #name)) return NULL; \
         value = dbus_message_get_ ## name(self->message); \
         if (value == none_value) { Py_INCREF(Py_None); return Py_None; } \
         if ((Pvalue = py_convert(value)) == NULL) RETURN_ERROR(NULL); \
@@ -517,11 +1025,11 @@ typedef union
 
 #define DEFINE_MESSAGE_SETTER(name, ctype, cformat) \
     static PyObject *tdbus_message_set_ ## name(PyTDBusMessageObject *self, \
-                                                PyObject *args) \
+                                                PyObject *Parg) \
     { \
         ctype value; \
         if (self->message == NULL) RETURN_ERROR("uninitialized object"); \
-        if (!PyArg_ParseTuple(args, cformat ":set_" #name, &value)) \
+        if (!PyArg_Parse(Parg, cformat ":set_" #name, &value)) \
             return NULL; \
         dbus_message_set_ ## name(self->message, value); \
         Py_INCREF(Py_None); return Py_None; \
@@ -529,11 +1037,11 @@ typedef union
     }
 
 #define DEFINE_MESSAGE_SETTER_CHECK(name, ctype, cformat, check) \
-    static PyObject *tdbus_message_set_ ## name(PyTDBusMessageObject *self, PyObject *args) \
+    static PyObject *tdbus_message_set_ ## name(PyTDBusMessageObject *self, PyObject *Parg) \
     { \
         ctype value; \
         if (self->message == NULL) RETURN_ERROR("uninitialized object"); \
-        if (!PyArg_ParseTuple(args, cformat ":set_" #name, &value)) return NULL; \
+        if (!PyArg_Parse(Parg, cformat ":set_" #name, &value)) return NULL; \
         if (!check(value)) RETURN_ERROR("illegal value for " #name ": %s", value); \
         if (!dbus_message_set_ ## name(self->message, value)) RETURN_MEMORY_ERROR(); \
         Py_INCREF(Py_None); return Py_None; \
@@ -546,39 +1054,75 @@ DEFINE_MESSAGE_SETTER(no_reply, int, "i")
 DEFINE_MESSAGE_GETTER(auto_start, int, PyBool_FromLong, -1)
 DEFINE_MESSAGE_SETTER(auto_start, int, "i")
 DEFINE_MESSAGE_GETTER(serial, long, PyInt_FromLong, -1)
-DEFINE_MESSAGE_GETTER(path, const char *, PyString_FromString, NULL)
+DEFINE_MESSAGE_GETTER(path, const char *, _tdbus_intern_string, NULL)
 DEFINE_MESSAGE_SETTER_CHECK(path, const char *, "s", _tdbus_check_path)
-DEFINE_MESSAGE_GETTER(interface, const char *, PyString_FromString, NULL)
+DEFINE_MESSAGE_GETTER(interface, const char *, _tdbus_intern_string, NULL)
 DEFINE_MESSAGE_SETTER_CHECK(interface, const char *, "s", _tdbus_check_interface)
-DEFINE_MESSAGE_GETTER(member, const char *, PyString_FromString, NULL)
+DEFINE_MESSAGE_GETTER(member, const char *, _tdbus_intern_string, NULL)
 DEFINE_MESSAGE_SETTER_CHECK(member, const char *, "s", _tdbus_check_member)
-DEFINE_MESSAGE_GETTER(error_name, const char *, PyString_FromString, NULL)
+DEFINE_MESSAGE_GETTER(error_name, const char *, _tdbus_intern_string, NULL)
 DEFINE_MESSAGE_SETTER_CHECK(error_name, const char *, "s", _tdbus_check_interface)
 DEFINE_MESSAGE_GETTER(reply_serial, unsigned long, PyLong_FromUnsignedLong, 0)
 DEFINE_MESSAGE_SETTER(reply_serial, unsigned long, "l");
-DEFINE_MESSAGE_GETTER(destination, const char *, PyString_FromString, NULL)
+DEFINE_MESSAGE_GETTER(destination, const char *, _tdbus_intern_string, NULL)
 DEFINE_MESSAGE_SETTER_CHECK(destination, const char *, "s", _tdbus_check_bus_name)
-DEFINE_MESSAGE_GETTER(sender, const char *, PyString_FromString, NULL)
-DEFINE_MESSAGE_GETTER(signature, const char *, PyString_FromString, NULL)
+DEFINE_MESSAGE_GETTER(sender, const char *, _tdbus_intern_string, NULL)
+DEFINE_MESSAGE_SETTER_CHECK(sender, const char *, "s", _tdbus_check_bus_name)
+DEFINE_MESSAGE_GETTER(signature, const char *, _tdbus_intern_string, NULL)
 
 
-static PyObject * _tdbus_message_read_args(DBusMessageIter *, int);
+static PyObject * _tdbus_message_read_arg(DBusMessageIter *, int, int);
+static PyObject * _tdbus_message_read_args(DBusMessageIter *, int, int);
 
-static PyObject *
-_tdbus_message_read_arg(DBusMessageIter *iter, int depth)
+/* Read a dict entry straight into `dict`, without an intermediate tuple.
+ * String keys come from the intern cache. */
+
+static int
+_tdbus_message_read_dict_entry(DBusMessageIter *iter, PyObject *dict,
+                               int depth, int unwrap)
 {
-    int type, subtype, ret, size;
-    char *sig = NULL, *ptr;
-    PyObject *Parg = NULL, *Pitem = NULL, *Pkey = NULL, *Pvalue = NULL;
+    int ret;
+    PyObject *Pkey = NULL, *Pvalue = NULL;
     _tdbus_basic_value value;
     DBusMessageIter subiter;
 
-    type = dbus_message_iter_get_arg_type(iter);
-    switch (type) {
-    case DBUS_TYPE_BYTE:
-        dbus_message_iter_get_basic(iter, &value);
-        Parg = PyInt_FromLong(value.u8);
-        CHECK_PYTHON_ERROR(Parg == NULL);
+    dbus_message_iter_recurse(iter, &subiter);
+    if (dbus_message_iter_get_arg_type(&subiter) == DBUS_TYPE_STRING) {
+        dbus_message_iter_get_basic(&subiter, &value);
+        Pkey = _tdbus_intern_unicode_string(value.str);
+        CHECK_PYTHON_ERROR(Pkey == NULL);
+    } else if ((Pkey = _tdbus_message_read_arg(&subiter, depth, unwrap)) == NULL)
+        RETURN_ERROR(NULL);
+    if (!dbus_message_iter_next(&subiter))
+        RETURN_ERROR("illegal dict_entry");
+    if ((Pvalue = _tdbus_message_read_arg(&subiter, depth, unwrap)) == NULL)
+        RETURN_ERROR(NULL);
+    ret = PyDict_SetItem(dict, Pkey, Pvalue);
+    CHECK_PYTHON_ERROR(ret < 0);
+    Py_DECREF(Pkey); Py_DECREF(Pvalue);
+    return 1;
+
+error:
+    if (Pkey != NULL) Py_DECREF(Pkey);
+    if (Pvalue != NULL) Py_DECREF(Pvalue);
+    return 0;
+}
+
+static PyObject *
+_tdbus_message_read_arg(DBusMessageIter *iter, int depth, int unwrap)
+{
+    int type, subtype, size;
+    char *sig = NULL, *ptr, basic[2];
+    PyObject *Parg = NULL, *Pitem = NULL, *Pkey = NULL, *Pvalue = NULL;
+    _tdbus_basic_value value;
+    DBusMessageIter subiter;
+
+    type = dbus_message_iter_get_arg_type(iter);
+    switch (type) {
+    case DBUS_TYPE_BYTE:
+        dbus_message_iter_get_basic(iter, &value);
+        Parg = PyInt_FromLong(value.u8);
+        CHECK_PYTHON_ERROR(Parg == NULL);
         break;
     case DBUS_TYPE_BOOLEAN:
         dbus_message_iter_get_basic(iter, &value);
@@ -640,9 +1184,19 @@ _tdbus_message_read_arg(DBusMessageIter *iter, int depth)
         Parg = PyString_FromString(value.str);
         CHECK_PYTHON_ERROR(Parg == NULL);
         break;
+    case DBUS_TYPE_UNIX_FD:
+        /* libdbus returns a duplicate that is owned by us. */
+        dbus_message_iter_get_basic(iter, &value);
+        if (value.fd == -1)
+            RETURN_ERROR("could not read file descriptor");
+        if ((Parg = (PyObject *) _tdbus_unix_fd_new(value.fd)) == NULL) {
+            close(value.fd);
+            RETURN_ERROR(NULL);
+        }
+        break;
     case DBUS_TYPE_STRUCT:
         dbus_message_iter_recurse(iter, &subiter);
-        Parg = _tdbus_message_read_args(&subiter, depth+1);
+        Parg = _tdbus_message_read_args(&subiter, depth+1, unwrap);
         CHECK_PYTHON_ERROR(Parg == NULL);
         break;
     case DBUS_TYPE_ARRAY:
@@ -652,54 +1206,52 @@ _tdbus_message_read_arg(DBusMessageIter *iter, int depth)
             dbus_message_iter_get_fixed_array(&subiter, &ptr, &size);
             Parg = PyString_FromStringAndSize(ptr, size);
             CHECK_PYTHON_ERROR(Parg == NULL);
+        } else if (subtype == DBUS_TYPE_DICT_ENTRY) {
+            Parg = PyDict_New();
+            CHECK_PYTHON_ERROR(Parg == NULL);
+            while (dbus_message_iter_get_arg_type(&subiter) != DBUS_TYPE_INVALID) {
+                if (!_tdbus_message_read_dict_entry(&subiter, Parg, depth+1, unwrap))
+                    RETURN_ERROR(NULL);
+                dbus_message_iter_next(&subiter);
+            }
         } else {
-            if (subtype == DBUS_TYPE_DICT_ENTRY)
-                Parg = PyDict_New();
-            else
-                Parg = PyList_New(0);
+            Parg = PyList_New(0);
             CHECK_PYTHON_ERROR(Parg == NULL);
             while (dbus_message_iter_get_arg_type(&subiter) != DBUS_TYPE_INVALID) {
-                if ((Pitem = _tdbus_message_read_arg(&subiter, depth+1)) == NULL)
+                if ((Pitem = _tdbus_message_read_arg(&subiter, depth+1, unwrap)) == NULL)
+                    RETURN_ERROR(NULL);
+                if (PyList_Append(Parg, Pitem) < 0)
                     RETURN_ERROR(NULL);
-                if (PyDict_Check(Parg)) {
-                    ASSERT(PyTuple_Check(Pitem));
-                    ASSERT(PyTuple_Size(Pitem) == 2);
-                    ret = PyDict_SetItem(Parg, PyTuple_GET_ITEM(Pitem, 0),
-                                         PyTuple_GET_ITEM(Pitem, 1));
-                    CHECK_PYTHON_ERROR(ret < 0);
-                } else
-                    PyList_Append(Parg, Pitem);
                 Py_DECREF(Pitem); Pitem = NULL;
                 dbus_message_iter_next(&subiter);
             }
         }
         break;
-    case DBUS_TYPE_DICT_ENTRY:
-        dbus_message_iter_recurse(iter, &subiter);
-        if ((Pkey = _tdbus_message_read_arg(&subiter, depth+1)) == NULL)
-            RETURN_ERROR(NULL);
-        if (!dbus_message_iter_next(&subiter))
-            RETURN_ERROR("illegal dict_entry");
-        if ((Pvalue = _tdbus_message_read_arg(&subiter, depth+1)) == NULL)
-            RETURN_ERROR(NULL);
-        Parg = PyTuple_New(2);
-        CHECK_PYTHON_ERROR(Parg == NULL);
-        PyTuple_SET_ITEM(Parg, 0, Pkey);
-        PyTuple_SET_ITEM(Parg, 1, Pvalue);
-        break;
     case DBUS_TYPE_VARIANT:
         dbus_message_iter_recurse(iter, &subiter);
-        if ((sig = dbus_message_iter_get_signature(&subiter)) == NULL)
-            RETURN_MEMORY_ERROR();
-        Pkey = PyString_FromString(sig);
-        CHECK_PYTHON_ERROR(Pkey == NULL);
-        if ((Pvalue = _tdbus_message_read_arg(&subiter, depth+1)) == NULL)
+        if ((Pvalue = _tdbus_message_read_arg(&subiter, depth+1, unwrap)) == NULL)
             RETURN_ERROR(NULL);
+        if (unwrap) {
+            Parg = Pvalue; Pvalue = NULL;
+            break;
+        }
+        /* The signature of a basic type is its type code. This saves an
+         * allocation for the common case. */
+        subtype = dbus_message_iter_get_arg_type(&subiter);
+        if (dbus_type_is_basic(subtype)) {
+            basic[0] = subtype; basic[1] = '\000';
+            Pkey = _tdbus_intern_string(basic);
+        } else {
+            if ((sig = dbus_message_iter_get_signature(&subiter)) == NULL)
+                RETURN_MEMORY_ERROR();
+            Pkey = _tdbus_intern_string(sig);
+            dbus_free(sig); sig = NULL;
+        }
+        CHECK_PYTHON_ERROR(Pkey == NULL);
         Parg = PyTuple_New(2);
         CHECK_PYTHON_ERROR(Parg == NULL);
         PyTuple_SET_ITEM(Parg, 0, Pkey);
         PyTuple_SET_ITEM(Parg, 1, Pvalue);
-        dbus_free(sig); sig = NULL;
         break;
     }
 
@@ -715,13 +1267,13 @@ error:
 }
 
 static PyObject *
-_tdbus_message_read_args(DBusMessageIter *iter, int depth)
+_tdbus_message_read_args(DBusMessageIter *iter, int depth, int unwrap)
 {
     PyObject *Plist = NULL, *Pargs = NULL, *Parg = NULL;
 
     Plist = PyList_New(0);
     while (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_INVALID) {
-        if ((Parg = _tdbus_message_read_arg(iter, depth)) == NULL)
+        if ((Parg = _tdbus_message_read_arg(iter, depth, unwrap)) == NULL)
             RETURN_ERROR(NULL);
         if (PyList_Append(Plist, Parg) < 0)
             RETURN_ERROR(NULL);
@@ -742,18 +1294,22 @@ error:
 }
 
 static PyObject *
-tdbus_message_get_args(PyTDBusMessageObject *self, PyObject *args)
+tdbus_message_get_args(PyTDBusMessageObject *self, PyObject *args,
+                       PyObject *kwargs)
 {
+    int unwrap = 0;
     PyObject *Pargs;
     DBusMessageIter iter;
+    static char *kwlist[] = { "unwrap", NULL };
     
-    if (!PyArg_ParseTuple(args, ":get_args"))
-        return NULL;
     if (self->message == NULL)
         RETURN_ERROR("uninitialized object");
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i:get_args", kwlist,
+                                     &unwrap))
+        return NULL;
 
     if (dbus_message_iter_init(self->message, &iter))
-        Pargs = _tdbus_message_read_args(&iter, 0);
+        Pargs = _tdbus_message_read_args(&iter, 0, unwrap);
     else
         Pargs = PyTuple_New(0);
     CHECK_PYTHON_ERROR(Pargs == NULL);
@@ -764,6 +1320,257 @@ error:
 }
 
 
+/*
+ * Message size. Libdbus does not expose the size of a message, and
+ * dbus_message_marshal() would copy it. Instead we compute the size from the
+ * header fields and the top level of the body. Arrays are not walked: their
+ * length in bytes is stored in the message. So the cost depends on the
+ * number of arguments and not on the size of the message, which matters
+ * because the transport statistics size every message that is sent or
+ * dispatched.
+ */
+
+#define ALIGN(pos, n) (((pos) + (n) - 1) & ~((long) (n) - 1))
+
+static int
+_tdbus_type_alignment(int type)
+{
+    switch (type) {
+    case DBUS_TYPE_BYTE:
+    case DBUS_TYPE_SIGNATURE:
+    case DBUS_TYPE_VARIANT:
+        return 1;
+    case DBUS_TYPE_INT16:
+    case DBUS_TYPE_UINT16:
+        return 2;
+    case DBUS_TYPE_INT64:
+    case DBUS_TYPE_UINT64:
+    case DBUS_TYPE_DOUBLE:
+    case DBUS_TYPE_STRUCT:
+    case DBUS_TYPE_DICT_ENTRY:
+        return 8;
+    default:
+        return 4;
+    }
+}
+
+/* Return the length in bytes of the contents of an array. `iter` must be an
+ * iterator into the array, from dbus_message_iter_recurse(). Libdbus
+ * deprecates this call because it is easily mistaken for the
+ * number of elements. */
+
+static int
+_tdbus_message_iter_get_array_len(DBusMessageIter *iter)
+{
+    int len;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+    len = dbus_message_iter_get_array_len(iter);
+#pragma GCC diagnostic pop
+    return len;
+}
+
+static long
+_tdbus_message_iter_get_size(DBusMessageIter *iter, long pos)
+{
+    int type, subtype;
+    char *sig;
+    _tdbus_basic_value value;
+    DBusMessageIter subiter;
+
+    while ((type = dbus_message_iter_get_arg_type(iter)) != DBUS_TYPE_INVALID) {
+        pos = ALIGN(pos, _tdbus_type_alignment(type));
+        switch (type) {
+        case DBUS_TYPE_STRING:
+        case DBUS_TYPE_OBJECT_PATH:
+            dbus_message_iter_get_basic(iter, &value);
+            pos += 4 + strlen(value.str) + 1;
+            break;
+        case DBUS_TYPE_SIGNATURE:
+            dbus_message_iter_get_basic(iter, &value);
+            pos += 1 + strlen(value.str) + 1;
+            break;
+        case DBUS_TYPE_ARRAY:
+            subtype = dbus_message_iter_get_element_type(iter);
+            pos = ALIGN(pos + 4, _tdbus_type_alignment(subtype));
+            dbus_message_iter_recurse(iter, &subiter);
+            pos += _tdbus_message_iter_get_array_len(&subiter);
+            break;
+        case DBUS_TYPE_STRUCT:
+        case DBUS_TYPE_DICT_ENTRY:
+            dbus_message_iter_recurse(iter, &subiter);
+            pos = _tdbus_message_iter_get_size(&subiter, pos);
+            break;
+        case DBUS_TYPE_VARIANT:
+            dbus_message_iter_recurse(iter, &subiter);
+            if ((sig = dbus_message_iter_get_signature(&subiter)) == NULL)
+                return -1;
+            pos += 1 + strlen(sig) + 1;
+            dbus_free(sig);
+            pos = _tdbus_message_iter_get_size(&subiter, pos);
+            break;
+        default:
+            /* Fixed size types: the size equals the alignment. */
+            pos += _tdbus_type_alignment(type);
+            break;
+        }
+        if (pos < 0)
+            return -1;
+        dbus_message_iter_next(iter);
+    }
+    return pos;
+}
+
+static long
+_tdbus_message_get_size(DBusMessage *message)
+{
+    int i;
+    long pos, body = 0;
+    const char *str, *strings[6];
+    DBusMessageIter iter;
+
+    /* Fixed header and the length of the header field array. Each header
+     * field is a (yv) struct and starts with 4 bytes for the field code and
+     * the variant signature. */
+    pos = 16;
+    strings[0] = dbus_message_get_path(message);
+    strings[1] = dbus_message_get_interface(message);
+    strings[2] = dbus_message_get_member(message);
+    strings[3] = dbus_message_get_error_name(message);
+    strings[4] = dbus_message_get_destination(message);
+    strings[5] = dbus_message_get_sender(message);
+    for (i=0; i<6; i++) {
+        if (strings[i] != NULL)
+            pos = ALIGN(pos, 8) + 4 + 4 + strlen(strings[i]) + 1;
+    }
+    str = dbus_message_get_signature(message);
+    if (str != NULL && *str != '\000')
+        pos = ALIGN(pos, 8) + 4 + 1 + strlen(str) + 1;
+    if (dbus_message_get_reply_serial(message) != 0)
+        pos = ALIGN(pos, 8) + 4 + 4;
+    if (dbus_message_contains_unix_fds(message))
+        pos = ALIGN(pos, 8) + 4 + 4;
+    pos = ALIGN(pos, 8);
+
+    if (dbus_message_iter_init(message, &iter))
+        body = _tdbus_message_iter_get_size(&iter, 0);
+    if (body < 0)
+        return -1;
+    return pos + body;
+}
+
+static PyObject *
+tdbus_message_get_size(PyTDBusMessageObject *self, PyObject *noargs)
+{
+    long size;
+    PyObject *Psize;
+
+    if (self->message == NULL)
+        RETURN_ERROR("uninitialized object");
+
+    size = _tdbus_message_get_size(self->message);
+    CHECK_MEMORY_ERROR(size < 0);
+    Psize = PyInt_FromLong(size);
+    CHECK_PYTHON_ERROR(Psize == NULL);
+    return Psize;
+
+error:
+    return NULL;
+}
+
+/*
+ * Marshalling. This is used to pass messages to another process over
+ * something that is not a D-BUS connection. Unix file descriptors cannot be
+ * passed this way.
+ */
+
+static PyObject *
+tdbus_message_marshal(PyTDBusMessageObject *self, PyObject *noargs)
+{
+    int len, ret;
+    char *data = NULL;
+    DBusMessage *message;
+    PyObject *Pdata;
+
+    if (self->message == NULL)
+        RETURN_ERROR("uninitialized object");
+    if (dbus_message_contains_unix_fds(self->message))
+        RETURN_ERROR("cannot marshal a message with unix file descriptors");
+
+    /* A message without a serial cannot be demarshalled. Marshal a copy
+     * with a placeholder serial instead. */
+    if (dbus_message_get_serial(self->message) == 0) {
+        CHECK_MEMORY_ERROR((message = dbus_message_copy(self->message)) == NULL);
+        dbus_message_set_serial(message, 1);
+    } else
+        message = dbus_message_ref(self->message);
+    ret = dbus_message_marshal(message, &data, &len);
+    dbus_message_unref(message);
+    CHECK_MEMORY_ERROR(!ret);
+    Pdata = PyString_FromStringAndSize(data, len);
+    dbus_free(data);
+    return Pdata;
+
+error:
+    return NULL;
+}
+
+/* Demarshal a message. The message keeps its serial, so that replies to a
+ * method call can be created in another process. A message that is to be
+ * sent must be copied with copy() first, which resets the serial. */
+
+static PyObject *
+tdbus_demarshal(PyObject *self, PyObject *Parg)
+{
+    int len;
+    const char *data;
+    DBusError error;
+    DBusMessage *message;
+    PyTDBusMessageObject *Pmessage;
+
+    if (!PyArg_Parse(Parg, "s#:demarshal", &data, &len))
+        return NULL;
+
+    if (dbus_message_demarshal_bytes_needed(data, len) != len)
+        RETURN_ERROR("incomplete message");
+    dbus_error_init(&error);
+    if ((message = dbus_message_demarshal(data, len, &error)) == NULL)
+        RETURN_DBUS_ERROR(error);
+    if ((Pmessage = PyObject_New(PyTDBusMessageObject, &PyTDBusMessageType)) == NULL) {
+        dbus_message_unref(message);
+        return NULL;
+    }
+    Pmessage->message = message;
+    Pmessage->timestamp = 0;
+    return (PyObject *) Pmessage;
+
+error:
+    return NULL;
+}
+
+static PyObject *
+tdbus_message_copy(PyTDBusMessageObject *self, PyObject *noargs)
+{
+    PyTDBusMessageObject *Pmessage;
+
+    if (self->message == NULL)
+        RETURN_ERROR("uninitialized object");
+
+    if ((Pmessage = PyObject_New(PyTDBusMessageObject, &PyTDBusMessageType)) == NULL)
+        return NULL;
+    Pmessage->timestamp = 0;
+    if ((Pmessage->message = dbus_message_copy(self->message)) == NULL) {
+        Py_DECREF(Pmessage);
+        return PyErr_NoMemory();
+    }
+    return (PyObject *) Pmessage;
+
+error:
+    return NULL;
+}
+
+
 static PyObject **_tdbus_check_number_cache = NULL;
 static char *_tdbus_check_numbers[11] = {
     "0", "0xff", "0xffff",
@@ -918,16 +1725,217 @@ _tdbus_check_signature(char *format, int arraydepth, int structdepth)
     return 1;
 }
 
+/*
+ * Signature inference. The signature for a value is derived from its type:
+ * bool, float, str/unicode and UnixFd map to the corresponding basic types.
+ * An int or a long maps to "i" if it fits in an int32, to "x" if it fits in
+ * an int64 and to "t" otherwise, so 5 and 5L are both "i". A tuple maps to
+ * a struct, a list to an array and a dict to an array of dict entries. The
+ * items of a list (and the values of a dict) must all have the same
+ * signature, with int32 items widened to int64 if needed. Otherwise the
+ * items are variants. Empty lists and dicts become "av" and "a{sv}". A
+ * variant is only inferred when its value is not a sequence of two items;
+ * those are (signature, value) pairs.
+ *
+ * The signature is written into a buffer of DBUS_MAXIMUM_SIGNATURE_LENGTH+1
+ * bytes. The functions return the new end position, or -1 on error.
+ */
+
+#define INFER_SIZE (DBUS_MAXIMUM_SIGNATURE_LENGTH+1)
+
+#define INFER_APPEND(buf, pos, str) \
+    do { int _len = strlen(str); \
+        if (pos + _len >= INFER_SIZE) RETURN_ERROR("inferred signature too long"); \
+        memcpy(buf + pos, str, _len+1); pos += _len; } while (0)
+
+static int _tdbus_infer_type(PyObject *, char *, int);
+
+/* Infer the signature of the items in `seq`, which must be a list. The
+ * items after the first are inferred into a scratch buffer, so that an
+ * item signature can use the full signature length. */
+
+static int
+_tdbus_infer_items(PyObject *seq, char *buf, int pos)
+{
+    int i, start = pos, end, len, itemlen;
+    char scratch[INFER_SIZE];
+    PyObject *Pfirst, *Pitem;
+
+    if (PyList_GET_SIZE(seq) == 0) {
+        INFER_APPEND(buf, pos, "v");
+        return pos;
+    }
+    Pfirst = PyList_GET_ITEM(seq, 0);
+    if ((end = _tdbus_infer_type(Pfirst, buf, start)) < 0)
+        return -1;
+    len = end - start;
+    for (i=1; i<PyList_GET_SIZE(seq); i++) {
+        Pitem = PyList_GET_ITEM(seq, i);
+        /* Types that always map to the same signature. */
+        if (Py_TYPE(Pitem) == Py_TYPE(Pfirst) && (PyString_Check(Pitem) ||
+                    PyUnicode_Check(Pitem) || PyFloat_Check(Pitem) ||
+                    PyBool_Check(Pitem)))
+            continue;
+        if ((itemlen = _tdbus_infer_type(Pitem, scratch, 0)) < 0)
+            return -1;
+        if (itemlen == len && !memcmp(buf + start, scratch, len))
+            continue;
+        if (len == 1 && itemlen == 1 && strchr("ix", buf[start]) &&
+                strchr("ix", scratch[0])) {
+            buf[start] = DBUS_TYPE_INT64;
+            continue;
+        }
+        buf[start] = DBUS_TYPE_VARIANT;
+        end = start + 1;
+        break;
+    }
+    buf[end] = '\000';
+    return end;
+
+error:
+    return -1;
+}
+
+static int
+_tdbus_infer_type(PyObject *arg, char *buf, int pos)
+{
+    int i, start, overflow;
+    long l;
+    PY_LONG_LONG ll;
+    PyObject *Pitems = NULL;
+
+    if (PyBool_Check(arg))
+        INFER_APPEND(buf, pos, "b");
+    else if (PyInt_Check(arg)) {
+        l = PyInt_AS_LONG(arg);
+        INFER_APPEND(buf, pos, (l >= INT32_MIN && l <= INT32_MAX) ? "i" : "x");
+    } else if (PyLong_Check(arg)) {
+        ll = PyLong_AsLongLongAndOverflow(arg, &overflow);
+        CHECK_PYTHON_ERROR(ll == -1 && PyErr_Occurred());
+        if (overflow > 0)
+            INFER_APPEND(buf, pos, "t");
+        else
+            INFER_APPEND(buf, pos, (overflow == 0 && ll >= INT32_MIN &&
+                                    ll <= INT32_MAX) ? "i" : "x");
+    } else if (PyFloat_Check(arg))
+        INFER_APPEND(buf, pos, "d");
+    else if (PyString_Check(arg) || PyUnicode_Check(arg))
+        INFER_APPEND(buf, pos, "s");
+    else if (PyObject_TypeCheck(arg, &PyTDBusUnixFdType))
+        INFER_APPEND(buf, pos, "h");
+    else if (PyTuple_Check(arg)) {
+        if (PyTuple_GET_SIZE(arg) == 0)
+            RETURN_ERROR("cannot infer signature for empty tuple");
+        INFER_APPEND(buf, pos, "(");
+        for (i=0; i<PyTuple_GET_SIZE(arg); i++) {
+            if ((pos = _tdbus_infer_type(PyTuple_GET_ITEM(arg, i), buf, pos)) < 0)
+                return -1;
+        }
+        INFER_APPEND(buf, pos, ")");
+    } else if (PyList_Check(arg)) {
+        INFER_APPEND(buf, pos, "a");
+        if ((pos = _tdbus_infer_items(arg, buf, pos)) < 0)
+            return -1;
+    } else if (PyDict_Check(arg)) {
+        if (PyDict_Size(arg) == 0) {
+            INFER_APPEND(buf, pos, "a{sv}");
+            return pos;
+        }
+        INFER_APPEND(buf, pos, "a{");
+        start = pos;
+        Pitems = PyDict_Keys(arg);
+        CHECK_PYTHON_ERROR(Pitems == NULL);
+        if ((pos = _tdbus_infer_items(Pitems, buf, pos)) < 0)
+            RETURN_ERROR(NULL);
+        if (pos - start != 1 || !dbus_type_is_basic(buf[start]))
+            RETURN_ERROR("dict keys must all be of the same basic type");
+        Py_DECREF(Pitems);
+        Pitems = PyDict_Values(arg);
+        CHECK_PYTHON_ERROR(Pitems == NULL);
+        if ((pos = _tdbus_infer_items(Pitems, buf, pos)) < 0)
+            RETURN_ERROR(NULL);
+        Py_DECREF(Pitems); Pitems = NULL;
+        INFER_APPEND(buf, pos, "}");
+    } else
+        RETURN_ERROR("cannot infer signature for `%s' object",
+                     Py_TYPE(arg)->tp_name);
+    return pos;
+
+error:
+    if (Pitems != NULL) Py_DECREF(Pitems);
+    return -1;
+}
+
+/* Infer the signature for a sequence of arguments. */
+
+static int
+_tdbus_infer_signature(PyObject *args, char *buf)
+{
+    int i, pos = 0;
+    PyObject *Pitem;
+
+    buf[0] = '\000';
+    if (!PySequence_Check(args))
+        RETURN_ERROR("expecting a sequence for the arguments");
+    for (i=0; i<PySequence_Size(args); i++) {
+        if ((Pitem = PySequence_GetItem(args, i)) == NULL)
+            RETURN_ERROR(NULL);
+        pos = _tdbus_infer_type(Pitem, buf, pos);
+        Py_DECREF(Pitem);
+        if (pos < 0)
+            RETURN_ERROR(NULL);
+    }
+    return pos;
+
+error:
+    return -1;
+}
+
+static int
+_tdbus_message_append_arg(DBusMessageIter *, char *, PyObject *, int);
 static int
 _tdbus_message_append_args(DBusMessageIter *, char *, PyObject *, int);
 
+/* Append a dict entry with format `format` (which starts at the opening
+ * brace) from a key and a value, without an intermediate tuple. */
+
+static int
+_tdbus_message_append_dict_entry(DBusMessageIter *iter, char *format,
+                                 PyObject *key, PyObject *value, int depth)
+{
+    char keytype[2], *end, store;
+    DBusMessageIter subiter;
+
+    if (!dbus_message_iter_open_container(iter, DBUS_TYPE_DICT_ENTRY,
+                NULL, &subiter))
+        RETURN_MEMORY_ERROR();
+    keytype[0] = format[1]; keytype[1] = '\000';
+    if (!_tdbus_message_append_arg(&subiter, keytype, key, depth))
+        RETURN_ERROR(NULL);
+    if ((end = _tdbus_get_one_full_type(format+2)) == NULL)
+        RETURN_ERROR(NULL);
+    store = *end; *end = '\000';
+    if (!_tdbus_message_append_arg(&subiter, format+2, value, depth)) {
+        *end = store;
+        RETURN_ERROR(NULL);
+    }
+    *end = store;
+    if (!dbus_message_iter_close_container(iter, &subiter))
+        RETURN_MEMORY_ERROR();
+    return 1;
+
+error:
+    return 0;
+}
+
 static int
 _tdbus_message_append_arg(DBusMessageIter *iter, char *format,
                           PyObject *arg, int depth)
 {
     int i, size; long l;
-    char *subtype = NULL, *end, *ptr;
-    PyObject *Parray, *Putf8, *Pitem = NULL, *Ptype = NULL, *Pvalue = NULL;
+    Py_ssize_t pos;
+    char *subtype = NULL, *end, *ptr, sigbuf[INFER_SIZE];
+    PyObject *Putf8, *Pitem = NULL, *Pkey, *Pvalue = NULL;
     _tdbus_basic_value value;
     DBusMessageIter subiter;
 
@@ -1034,10 +2042,20 @@ _tdbus_message_append_arg(DBusMessageIter *iter, char *format,
             Putf8 = arg;
         } else
             RETURN_ERROR("expecting str or unicode for '%c' format", *format);
-        value.str = PyString_AsString(Putf8);
-        if (!dbus_message_iter_append_basic(iter, *format, &value))
+        value.str = PyString_AS_STRING(Putf8);
+        l = dbus_message_iter_append_basic(iter, *format, &value);
+        if (Putf8 != arg)
+            Py_DECREF(Putf8);
+        if (!l)
             RETURN_MEMORY_ERROR();
         break;
+    case DBUS_TYPE_UNIX_FD:
+        /* libdbus duplicates the file descriptor. */
+        if ((value.fd = _tdbus_get_fd(arg)) == -1)
+            RETURN_ERROR(NULL);
+        if (!dbus_message_iter_append_basic(iter, *format, &value))
+            RETURN_ERROR("could not append file descriptor");
+        break;
     case DBUS_STRUCT_BEGIN_CHAR:
         if (!dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT,
                     NULL, &subiter))
@@ -1060,62 +2078,74 @@ _tdbus_message_append_arg(DBusMessageIter *iter, char *format,
             size = PyString_GET_SIZE(arg);
             if (!dbus_message_iter_append_fixed_array(&subiter, format[1], &ptr, size))
                 RETURN_MEMORY_ERROR();
-        } else {
-            if (format[1] == DBUS_DICT_ENTRY_BEGIN_CHAR) {
-                if (!PyDict_Check(arg))
-                    RETURN_ERROR("expecting dict argument for array of dict_entry");
-                Parray = PyDict_Items(arg);
-            } else {
-                if (!PySequence_Check(arg))
-                    RETURN_ERROR("expecting sequence argument for array format");
-                Parray = arg;
+        } else if (format[1] == DBUS_DICT_ENTRY_BEGIN_CHAR) {
+            if (!PyDict_Check(arg))
+                RETURN_ERROR("expecting dict argument for array of dict_entry");
+            pos = 0;
+            while (PyDict_Next(arg, &pos, &Pkey, &Pitem)) {
+                if (!_tdbus_message_append_dict_entry(&subiter, format+1,
+                            Pkey, Pitem, depth+1)) {
+                    Pitem = NULL;
+                    RETURN_ERROR(NULL);
+                }
             }
-            for (i=0; i<PySequence_Size(Parray); i++) {
-                Pitem = PySequence_GetItem(Parray, i);
+            Pitem = NULL;
+        } else {
+            if (!PySequence_Check(arg))
+                RETURN_ERROR("expecting sequence argument for array format");
+            for (i=0; i<PySequence_Size(arg); i++) {
+                Pitem = PySequence_GetItem(arg, i);
                 if (!_tdbus_message_append_arg(&subiter, format+1, Pitem, depth+1))
                     RETURN_ERROR(NULL);
                 Py_DECREF(Pitem); Pitem = NULL;
             }
-            if (Parray != arg)
-                Py_DECREF(Parray);
         }
         if (!dbus_message_iter_close_container(iter, &subiter))
             RETURN_MEMORY_ERROR();
         break;
-    case DBUS_DICT_ENTRY_BEGIN_CHAR:
-        if (!dbus_message_iter_open_container(iter, DBUS_TYPE_DICT_ENTRY,
-                    NULL, &subiter))
-            RETURN_MEMORY_ERROR();
-        if (!PySequence_Check(arg))
-            RETURN_ERROR("expecting sequence argument for dict_entry format");
-        if (!_tdbus_message_append_args(&subiter, format+1, arg, depth+1))
-            RETURN_ERROR(NULL);
-        if (!dbus_message_iter_close_container(iter, &subiter))
-            RETURN_MEMORY_ERROR();
-        break;
     case DBUS_TYPE_VARIANT:
-        if (!PySequence_Check(arg) || PySequence_Size(arg) != 2)
-            RETURN_ERROR("expecting a sequence argument of length 2 for variant");
-        Ptype = PySequence_GetItem(arg, 0);
-        Pvalue = PySequence_GetItem(arg, 1);
-        if (!PyString_Check(Ptype))
-            RETURN_ERROR("first item in sequence argument must be string");
-        subtype = strdup(PyString_AsString(Ptype));
-        CHECK_MEMORY_ERROR(subtype == NULL);
-        if (!_tdbus_check_signature(subtype, 0, 0))
-            RETURN_ERROR("invalid signature for variant");
-        end = _tdbus_get_one_full_type(subtype);
-        if (end == NULL || *end != '\000')
-            RETURN_ERROR("variant signature must be exactly one full type");
+        /* Any sequence of two items other than a string is a (signature,
+         * value) pair, as it always was. Other values have their signature
+         * inferred from their type. The signature is copied because the
+         * format functions modify it in place. */
+        if (PySequence_Check(arg) && !PyString_Check(arg) &&
+                !PyUnicode_Check(arg) && PySequence_Size(arg) == 2) {
+            Pitem = PySequence_GetItem(arg, 0);
+            CHECK_PYTHON_ERROR(Pitem == NULL);
+            if (!PyString_Check(Pitem))
+                RETURN_ERROR("first item in sequence argument must be string");
+            ptr = PyString_AS_STRING(Pitem);
+            if (PyString_GET_SIZE(Pitem) < sizeof(sigbuf))
+                subtype = strcpy(sigbuf, ptr);
+            else
+                subtype = strdup(ptr);
+            CHECK_MEMORY_ERROR(subtype == NULL);
+            Py_DECREF(Pitem); Pitem = NULL;
+            if (!_tdbus_check_signature(subtype, 0, 0))
+                RETURN_ERROR("invalid signature for variant");
+            end = _tdbus_get_one_full_type(subtype);
+            if (end == NULL || *end != '\000')
+                RETURN_ERROR("variant signature must be exactly one full type");
+            Pvalue = PySequence_GetItem(arg, 1);
+            CHECK_PYTHON_ERROR(Pvalue == NULL);
+        } else {
+            PyErr_Clear();
+            if (_tdbus_infer_type(arg, sigbuf, 0) < 0)
+                RETURN_ERROR(NULL);
+            subtype = sigbuf;
+            Pvalue = arg;
+            Py_INCREF(Pvalue);
+        }
         if (!dbus_message_iter_open_container(iter, *format, subtype, &subiter))
             RETURN_MEMORY_ERROR();
         if (!_tdbus_message_append_arg(&subiter, subtype, Pvalue, depth+1))
             RETURN_ERROR(NULL);
         if (!dbus_message_iter_close_container(iter, &subiter))
             RETURN_MEMORY_ERROR();
-        Py_DECREF(Ptype); Ptype = NULL;
         Py_DECREF(Pvalue); Pvalue = NULL;
-        free(subtype); subtype = NULL;
+        if (subtype != sigbuf)
+            free(subtype);
+        subtype = NULL;
         break;
     default:
         RETURN_ERROR("unknown format character `%c'", *format);
@@ -1124,9 +2154,8 @@ _tdbus_message_append_arg(DBusMessageIter *iter, char *format,
 
 error:
     if (Pitem != NULL) Py_DECREF(Pitem);
-    if (Ptype != NULL) Py_DECREF(Ptype);
     if (Pvalue != NULL) Py_DECREF(Pvalue);
-    if (subtype != NULL) free(subtype);
+    if (subtype != NULL && subtype != sigbuf) free(subtype);
     return 0;
 }
 
@@ -1164,18 +2193,25 @@ error:
 static PyObject *
 tdbus_message_set_args(PyTDBusMessageObject *self, PyObject *args)
 {
-    char *format, *ptr = NULL;
+    char *format, *ptr = NULL, inferred[INFER_SIZE];
     DBusMessageIter iter;
     PyObject *Pargs;
 
     if (self->message == NULL)
         RETURN_ERROR("uninitialized object");
-    if (!PyArg_ParseTuple(args, "sO:set_args", &format, &Pargs))
+    if (!PyArg_ParseTuple(args, "zO:set_args", &format, &Pargs))
         return NULL;
     if (!PySequence_Check(Pargs))
         RETURN_ERROR("expecting a sequence for the arguments");
-    ptr = strdup(format);
-    CHECK_MEMORY_ERROR(ptr == NULL);
+    if (format == NULL) {
+        /* Infer the signature from the arguments. */
+        if (_tdbus_infer_signature(Pargs, inferred) < 0)
+            RETURN_ERROR(NULL);
+        ptr = inferred;
+    } else {
+        ptr = strdup(format);
+        CHECK_MEMORY_ERROR(ptr == NULL);
+    }
     if (!_tdbus_check_signature(ptr, 0, 0))
         RETURN_ERROR("illegal signature");
 
@@ -1183,39 +2219,45 @@ tdbus_message_set_args(PyTDBusMessageObject *self, PyObject *args)
     if (!_tdbus_message_append_args(&iter, ptr, Pargs, 0))
         RETURN_ERROR(NULL);
 
-    free(ptr);
+    if (ptr != inferred)
+        free(ptr);
     Py_INCREF(Py_None);
     return Py_None;
 
 error:
-    if (ptr != NULL) free(ptr);
+    if (ptr != NULL && ptr != inferred) free(ptr);
     return NULL;
 }
 
 PyMethodDef tdbus_message_methods[] = \
 {
-    { "get_type", (PyCFunction) tdbus_message_get_type, METH_VARARGS },
-    { "get_no_reply", (PyCFunction) tdbus_message_get_no_reply, METH_VARARGS },
-    { "set_no_reply", (PyCFunction) tdbus_message_set_no_reply, METH_VARARGS },
-    { "get_auto_start", (PyCFunction) tdbus_message_get_auto_start, METH_VARARGS },
-    { "set_auto_start", (PyCFunction) tdbus_message_set_auto_start, METH_VARARGS },
-    { "get_serial", (PyCFunction) tdbus_message_get_serial, METH_VARARGS },
-    { "get_path", (PyCFunction) tdbus_message_get_path, METH_VARARGS },
-    { "set_path", (PyCFunction) tdbus_message_set_path, METH_VARARGS },
-    { "get_interface", (PyCFunction) tdbus_message_get_interface, METH_VARARGS },
-    { "set_interface", (PyCFunction) tdbus_message_set_interface, METH_VARARGS },
-    { "get_member", (PyCFunction) tdbus_message_get_member, METH_VARARGS },
-    { "set_member", (PyCFunction) tdbus_message_set_member, METH_VARARGS },
-    { "get_error_name", (PyCFunction) tdbus_message_get_error_name, METH_VARARGS },
-    { "set_error_name", (PyCFunction) tdbus_message_set_error_name, METH_VARARGS },
-    { "get_reply_serial", (PyCFunction) tdbus_message_get_reply_serial, METH_VARARGS },
-    { "set_reply_serial", (PyCFunction) tdbus_message_set_reply_serial, METH_VARARGS },
-    { "get_destination", (PyCFunction) tdbus_message_get_destination, METH_VARARGS },
-    { "set_destination", (PyCFunction) tdbus_message_set_destination, METH_VARARGS },
-    { "get_sender", (PyCFunction) tdbus_message_get_sender, METH_VARARGS },
-    { "get_signature", (PyCFunction) tdbus_message_get_signature, METH_VARARGS },
-    { "get_args", (PyCFunction ) tdbus_message_get_args, METH_VARARGS },
+    { "get_type", (PyCFunction) tdbus_message_get_type, METH_NOARGS },
+    { "get_no_reply", (PyCFunction) tdbus_message_get_no_reply, METH_NOARGS },
+    { "set_no_reply", (PyCFunction) tdbus_message_set_no_reply, METH_O },
+    { "get_auto_start", (PyCFunction) tdbus_message_get_auto_start, METH_NOARGS },
+    { "set_auto_start", (PyCFunction) tdbus_message_set_auto_start, METH_O },
+    { "get_serial", (PyCFunction) tdbus_message_get_serial, METH_NOARGS },
+    { "get_path", (PyCFunction) tdbus_message_get_path, METH_NOARGS },
+    { "set_path", (PyCFunction) tdbus_message_set_path, METH_O },
+    { "get_interface", (PyCFunction) tdbus_message_get_interface, METH_NOARGS },
+    { "set_interface", (PyCFunction) tdbus_message_set_interface, METH_O },
+    { "get_member", (PyCFunction) tdbus_message_get_member, METH_NOARGS },
+    { "set_member", (PyCFunction) tdbus_message_set_member, METH_O },
+    { "get_error_name", (PyCFunction) tdbus_message_get_error_name, METH_NOARGS },
+    { "set_error_name", (PyCFunction) tdbus_message_set_error_name, METH_O },
+    { "get_reply_serial", (PyCFunction) tdbus_message_get_reply_serial, METH_NOARGS },
+    { "set_reply_serial", (PyCFunction) tdbus_message_set_reply_serial, METH_O },
+    { "get_destination", (PyCFunction) tdbus_message_get_destination, METH_NOARGS },
+    { "set_destination", (PyCFunction) tdbus_message_set_destination, METH_O },
+    { "get_sender", (PyCFunction) tdbus_message_get_sender, METH_NOARGS },
+    { "set_sender", (PyCFunction) tdbus_message_set_sender, METH_O },
+    { "get_signature", (PyCFunction) tdbus_message_get_signature, METH_NOARGS },
+    { "get_args", (PyCFunction ) tdbus_message_get_args,
+            METH_VARARGS|METH_KEYWORDS },
+    { "get_size", (PyCFunction ) tdbus_message_get_size, METH_NOARGS },
     { "set_args", (PyCFunction ) tdbus_message_set_args, METH_VARARGS },
+    { "marshal", (PyCFunction ) tdbus_message_marshal, METH_NOARGS },
+    { "copy", (PyCFunction ) tdbus_message_copy, METH_NOARGS },
     { NULL }
 };
 
@@ -1241,40 +2283,83 @@ static void
 tdbus_pending_call_dealloc(PyTDBusPendingCallObject *self)
 {
     if (self->pending_call) {
-        dbus_pending_call_unref(self->pending_call);
+        WITHOUT_GIL(dbus_pending_call_unref(self->pending_call));
         self->pending_call = NULL;
     }
     PyObject_Del(self);
 }
 
+/* Data attached to each pending call in tdbus_pending_slot. */
+
+typedef struct
+{
+    PyObject *connection;
+    PyTDBusHistogramObject *histogram;
+    uint64_t start;
+    int completed;
+} _tdbus_pending_call_data;
+
+static void _tdbus_pending_call_completed(_tdbus_pending_call_data *);
+
 static void
 _tdbus_pending_call_notify_callback(DBusPendingCall *pending, void *data)
 {
+    uint64_t now;
+    DBusMessage *reply;
+    PyObject *Presult;
     PyTDBusMessageObject *Pmessage;
+    _tdbus_pending_call_data *pdata;
+    PyGILState_STATE gstate;
+
+    /* Both of these take the connection lock, so they must be called before
+     * the GIL is acquired. */
+    pdata = dbus_pending_call_get_data(pending, tdbus_pending_slot);
+    reply = dbus_pending_call_steal_reply(pending);
+    now = _tdbus_monotonic_usec();
+
+    gstate = PyGILState_Ensure();
+    _tdbus_pending_call_completed(pdata);
+    /* The reply has already been delivered. See set_notify(). */
+    if (reply == NULL)
+        goto error;
+    if (pdata != NULL && pdata->histogram != NULL)
+        _tdbus_histogram_record(pdata->histogram, now - pdata->start);
+    if ((Pmessage = PyObject_New(PyTDBusMessageObject, &PyTDBusMessageType)) == NULL) {
+        WITHOUT_GIL(dbus_message_unref(reply));
+        goto error;
+    }
+    Pmessage->timestamp = 0;
+    Pmessage->message = reply;
+    TRACE_MESSAGE(reply, dbus_message_get_reply_serial(Pmessage->message),
+                  Pmessage->message);
+    Presult = PyObject_CallFunctionObjArgs((PyObject *) data, (PyObject *) Pmessage, NULL);
+    Py_XDECREF(Presult);
+    Py_DECREF(Pmessage);
 
-    if ((Pmessage = PyObject_New(PyTDBusMessageObject, &PyTDBusMessageType)) == NULL)
-        return;
-    Pmessage->message = dbus_pending_call_steal_reply(pending);
-    if (Pmessage->message == NULL)
-        return;
-    PyObject_CallFunction((PyObject *) data, "O", Pmessage);
+error:
     if (PyErr_Occurred())
         PyErr_Clear();
-    Py_DECREF(Pmessage);
+    PyGILState_Release(gstate);
 }
 
 static PyObject *
-tdbus_pending_call_set_notify(PyTDBusPendingCallObject *self, PyObject *args)
+tdbus_pending_call_set_notify(PyTDBusPendingCallObject *self, PyObject *notify)
 {
-    PyObject *notify;
+    int ret;
 
-    if (!PyArg_ParseTuple(args, "O:set_notify", &notify))
-        return NULL;
     if (!PyCallable_Check(notify))
         RETURN_ERROR("expecing a Python callable");
     Py_INCREF(notify);
-    if (!dbus_pending_call_set_notify(self->pending_call,
-                _tdbus_pending_call_notify_callback, notify, _tdbus_decref))
+    /* If another thread dispatched the reply before the notify function was
+     * set, libdbus will not call it. Deliver the reply here instead. If both
+     * happen, only the first one gets the reply and calls `notify`. */
+    Py_BEGIN_ALLOW_THREADS
+    ret = dbus_pending_call_set_notify(self->pending_call,
+                _tdbus_pending_call_notify_callback, notify, _tdbus_decref);
+    if (ret && dbus_pending_call_get_completed(self->pending_call))
+        _tdbus_pending_call_notify_callback(self->pending_call, notify);
+    Py_END_ALLOW_THREADS
+    if (!ret)
         RETURN_ERROR("dbus_pending_call_set_notify() failed");
 
     Py_INCREF(Py_None);
@@ -1284,9 +2369,24 @@ error:
     return NULL;
 }
 
+static PyObject *
+tdbus_pending_call_block(PyTDBusPendingCallObject *self, PyObject *args)
+{
+    _tdbus_pending_call_data *pdata;
+
+    Py_BEGIN_ALLOW_THREADS
+    dbus_pending_call_block(self->pending_call);
+    pdata = dbus_pending_call_get_data(self->pending_call, tdbus_pending_slot);
+    Py_END_ALLOW_THREADS
+    _tdbus_pending_call_completed(pdata);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
 PyMethodDef tdbus_pending_call_methods[] = \
 {
-    { "set_notify", (PyCFunction) tdbus_pending_call_set_notify, METH_VARARGS },
+    { "set_notify", (PyCFunction) tdbus_pending_call_set_notify, METH_O },
+    { "block", (PyCFunction) tdbus_pending_call_block, METH_NOARGS },
     { NULL }
 };
 
@@ -1295,11 +2395,45 @@ PyMethodDef tdbus_pending_call_methods[] = \
  * Connection object
  */
 
+/* Transport statistics. These are updated inline and cost a few increments
+ * per message. They are only converted to Python objects by get_stats(). */
+
+typedef struct
+{
+    unsigned long messages_sent[DBUS_NUM_MESSAGE_TYPES];
+    unsigned long bytes_sent[DBUS_NUM_MESSAGE_TYPES];
+    unsigned long messages_received[DBUS_NUM_MESSAGE_TYPES];
+    unsigned long bytes_received[DBUS_NUM_MESSAGE_TYPES];
+    unsigned long filter_calls;
+    unsigned long dispatch_calls;
+    long pending_calls;
+    long peak_outgoing_size;
+    unsigned long would_block;
+} _tdbus_connection_stats;
+
+/* Outgoing flow control. Libdbus queues outgoing messages without a bound.
+ * When the queue reaches a high water mark (in bytes, or in file
+ * descriptors), method calls and signals are refused with WouldBlock until
+ * it drains to the low water mark. Replies are always queued, because they
+ * answer calls that have already been accepted. A high water mark of 0
+ * disables that limit. */
+
+typedef struct
+{
+    long high, low;
+    long high_fds, low_fds;
+    int blocked;
+    PyObject *callback;
+} _tdbus_connection_limits;
+
 typedef struct
 {
     PyObject_HEAD
     DBusConnection *connection;
     PyObject *loop;
+    _tdbus_connection_stats stats;
+    _tdbus_connection_limits limits;
+    PyObject *histograms;
 } PyTDBusConnectionObject;
 
 PyTypeObject PyTDBusConnectionType =
@@ -1309,8 +2443,140 @@ PyTypeObject PyTDBusConnectionType =
     sizeof(PyTDBusConnectionObject)
 };
 
+static void
+_tdbus_connection_count_message(unsigned long *messages, unsigned long *bytes,
+                                int type, long size)
+{
+    if (type < 0 || type >= DBUS_NUM_MESSAGE_TYPES)
+        return;
+    messages[type]++;
+    if (size > 0)
+        bytes[type] += size;
+}
+
+/* Update the peak of the outgoing queue. Libdbus may write a message out
+ * before dbus_connection_send() returns, so `size` is the size of the queue
+ * before the send plus that of the message, i.e. the size right after the
+ * message was queued. */
+
+static void
+_tdbus_connection_count_outgoing(PyTDBusConnectionObject *self, long size)
+{
+    if (size > self->stats.peak_outgoing_size)
+        self->stats.peak_outgoing_size = size;
+}
+
+/* Return whether a method call or signal of `msgsize` bytes and `msgfds`
+ * file descriptors must be refused, with `size` bytes and `fds` file
+ * descriptors already queued. A message is refused if it would take the
+ * queue past a high water mark, unless the queue is at its low water
+ * marks, so that a message larger than the difference still goes out.
+ * Once a message is refused, all are refused until check_writable() finds
+ * that the queue has drained to the low water marks. */
+
+static int
+_tdbus_connection_would_block(PyTDBusConnectionObject *self, long size,
+                              long fds, long msgsize, long msgfds)
+{
+    _tdbus_connection_limits *limits = &self->limits;
+
+    if (!limits->blocked)
+        limits->blocked = (limits->high > 0 && size > limits->low &&
+                                size + msgsize > limits->high) ||
+                    (limits->high_fds > 0 && fds > limits->low_fds &&
+                                fds + msgfds > limits->high_fds);
+    return limits->blocked;
+}
+
+/* Return whether `message` is subject to flow control on `connection`, and
+ * if so the size of the outgoing queue and of the message. A message with
+ * file descriptors counts as one, as libdbus does not say how many it
+ * holds. Must be called without the GIL. */
+
+static int
+_tdbus_connection_get_outgoing(PyTDBusConnectionObject *self,
+                               DBusConnection *connection, DBusMessage *message,
+                               long *size, long *fds, long *msgsize, long *msgfds)
+{
+    int type;
+
+    if (self->limits.high == 0 && self->limits.high_fds == 0)
+        return 0;
+    type = dbus_message_get_type(message);
+    if (type != DBUS_MESSAGE_TYPE_METHOD_CALL && type != DBUS_MESSAGE_TYPE_SIGNAL)
+        return 0;
+    *size = dbus_connection_get_outgoing_size(connection);
+    *fds = dbus_connection_get_outgoing_unix_fds(connection);
+    *msgsize = _tdbus_message_get_size(message);
+    *msgfds = dbus_message_contains_unix_fds(message) ? 1 : 0;
+    return 1;
+}
+
+/* Take a completed call off the pending_calls gauge of its connection. This
+ * happens when the reply is delivered, or when the pending call is freed
+ * without a reply. Must be called with the GIL held. */
+
+static void
+_tdbus_pending_call_completed(_tdbus_pending_call_data *pdata)
+{
+    if (pdata == NULL || pdata->completed)
+        return;
+    pdata->completed = 1;
+    ((PyTDBusConnectionObject *) pdata->connection)->stats.pending_calls--;
+}
+
+static void
+_tdbus_connection_pending_call_done(void *data)
+{
+    _tdbus_pending_call_data *pdata = (_tdbus_pending_call_data *) data;
+    PyGILState_STATE gstate;
+
+    gstate = PyGILState_Ensure();
+    _tdbus_pending_call_completed(pdata);
+    Py_DECREF(pdata->connection);
+    if (pdata->histogram != NULL)
+        Py_DECREF(pdata->histogram);
+    PyGILState_Release(gstate);
+    free(pdata);
+}
+
+/* Return a borrowed reference to the latency histogram for `side` and the
+ * interface and member of `message`, creating it if needed. */
+
+static PyTDBusHistogramObject *
+_tdbus_connection_get_histogram(PyTDBusConnectionObject *self,
+                                const char *side, DBusMessage *message)
+{
+    const char *interface;
+    PyObject *Pkey;
+    PyTDBusHistogramObject *Phistogram;
+
+    interface = dbus_message_get_interface(message);
+    Pkey = Py_BuildValue("(szz)", side, interface, dbus_message_get_member(message));
+    if (Pkey == NULL)
+        return NULL;
+    Phistogram = (PyTDBusHistogramObject *) PyDict_GetItem(self->histograms, Pkey);
+    if (Phistogram == NULL) {
+        if ((Phistogram = _tdbus_histogram_new()) == NULL) {
+            Py_DECREF(Pkey);
+            return NULL;
+        }
+        if (PyDict_SetItem(self->histograms, Pkey, (PyObject *) Phistogram) < 0)
+            Py_CLEAR(Phistogram);
+        else
+            Py_DECREF(Phistogram);
+    }
+    Py_DECREF(Pkey);
+    return Phistogram;
+}
+
+/* Open a connection to `address`. If `address` is not one of the well known
+ * buses, the connection is registered with the bus (by sending it the Hello
+ * message) only if `register_` is set. Otherwise it is a direct peer to peer
+ * connection, for example to a Server. */
+
 static DBusConnection *
-_tdbus_connection_open(const char *address)
+_tdbus_connection_open(const char *address, int register_)
 {
     int ret;
     DBusError error;
@@ -1335,40 +2601,53 @@ _tdbus_connection_open(const char *address)
         Py_END_ALLOW_THREADS
         if (connection == NULL)
             RETURN_DBUS_ERROR(error);
-        Py_BEGIN_ALLOW_THREADS
-        ret = dbus_bus_register(connection, &error);
-        Py_END_ALLOW_THREADS
-        if (ret == 0)
-            RETURN_DBUS_ERROR(error);
+        if (register_) {
+            Py_BEGIN_ALLOW_THREADS
+            ret = dbus_bus_register(connection, &error);
+            Py_END_ALLOW_THREADS
+            if (ret == 0)
+                RETURN_DBUS_ERROR(error);
+        }
     }
 
-    dbus_connection_set_exit_on_disconnect(connection, FALSE);
+    WITHOUT_GIL(dbus_connection_set_exit_on_disconnect(connection, FALSE));
 
     return connection;
 
 error:
-    if (connection != NULL) {
-        dbus_connection_close(connection);
-        dbus_connection_unref(connection);
-    }
+    if (connection != NULL)
+        WITHOUT_GIL(dbus_connection_close(connection); dbus_connection_unref(connection));
     return NULL;
 }
 
+static void
+_tdbus_connection_close(DBusConnection *connection)
+{
+    Py_BEGIN_ALLOW_THREADS
+    dbus_connection_close(connection);
+    dbus_connection_unref(connection);
+    Py_END_ALLOW_THREADS
+}
+
 static int
 tdbus_connection_init(PyTDBusConnectionObject *self, PyObject *args,
                       PyObject *kwargs)
 {
     char *address = NULL;
-    static char *kwlist[] = { "address", NULL };
+    int register_ = 1, ret;
+    static char *kwlist[] = { "address", "register", NULL };
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s", kwlist, &address))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|i", kwlist, &address,
+                                     &register_))
         return -1;
 
     if (address != NULL) {
-        self->connection = _tdbus_connection_open(address);
+        self->connection = _tdbus_connection_open(address, register_);
         if (self->connection == NULL)
             return -1;
-        if (!dbus_connection_set_data(self->connection, tdbus_app_slot, self, NULL))
+        WITHOUT_GIL(ret = dbus_connection_set_data(self->connection, tdbus_app_slot,
+                                                   self, NULL));
+        if (!ret)
             return -1;
     }
     return 0;
@@ -1378,14 +2657,21 @@ static void
 tdbus_connection_dealloc(PyTDBusConnectionObject *self)
 {
     if (self->connection) {
-        dbus_connection_close(self->connection);
-        dbus_connection_unref(self->connection);
+        _tdbus_connection_close(self->connection);
         self->connection = NULL;
     }
     if (self->loop) {
         Py_DECREF(self->loop);
         self->loop = NULL;
     }
+    if (self->histograms) {
+        Py_DECREF(self->histograms);
+        self->histograms = NULL;
+    }
+    if (self->limits.callback) {
+        Py_DECREF(self->limits.callback);
+        self->limits.callback = NULL;
+    }
     PyObject_Del(self);
 }
 
@@ -1393,14 +2679,17 @@ static PyObject *
 tdbus_connection_open(PyTDBusConnectionObject *self, PyObject *args)
 {
     const char *address;
+    int register_ = 1, ret;
 
-    if (!PyArg_ParseTuple(args, "s:open", &address))
+    if (!PyArg_ParseTuple(args, "s|i:open", &address, &register_))
         return NULL;
 
-    self->connection = _tdbus_connection_open(address);
+    self->connection = _tdbus_connection_open(address, register_);
     if (self->connection == NULL)
         RETURN_ERROR(NULL);
-    if (!dbus_connection_set_data(self->connection, tdbus_app_slot, self, NULL))
+    WITHOUT_GIL(ret = dbus_connection_set_data(self->connection, tdbus_app_slot,
+                                               self, NULL));
+    if (!ret)
         RETURN_ERROR("dbus_connection_set_data() failed");
 
     Py_INCREF(Py_None);
@@ -1411,14 +2700,10 @@ error:
 }
 
 static PyObject *
-tdbus_connection_close(PyTDBusConnectionObject *self, PyObject *args)
+tdbus_connection_close(PyTDBusConnectionObject *self, PyObject *noargs)
 {
-    if (!PyArg_ParseTuple(args, ":close"))
-        return NULL;
-
     if (self->connection != NULL) {
-        dbus_connection_close(self->connection);
-        dbus_connection_unref(self->connection);
+        _tdbus_connection_close(self->connection);
         self->connection = NULL;
     }
 
@@ -1427,10 +2712,8 @@ tdbus_connection_close(PyTDBusConnectionObject *self, PyObject *args)
 }
 
 static PyObject *
-tdbus_connection_get_loop(PyTDBusConnectionObject *self, PyObject *args)
+tdbus_connection_get_loop(PyTDBusConnectionObject *self, PyObject *noargs)
 {
-    if (!PyArg_ParseTuple(args, ":get_loop"))
-        return NULL;
     if (self->connection == NULL)
         RETURN_ERROR("not connected");
 
@@ -1449,104 +2732,130 @@ error:
 static dbus_bool_t
 _tdbus_add_watch_callback(DBusWatch *watch, void *data)
 {
+    PyObject *Presult;
     PyTDBusWatchObject *Pwatch;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     if ((Pwatch = dbus_watch_get_data(watch)) == NULL) {
-        if ((Pwatch = PyObject_New(PyTDBusWatchObject, &PyTDBusWatchType)) == NULL)
+        if ((Pwatch = PyObject_New(PyTDBusWatchObject, &PyTDBusWatchType)) == NULL) {
+            PyErr_Clear();
+            PyGILState_Release(gstate);
             return FALSE;
+        }
         Pwatch->watch = watch;
         Pwatch->data = NULL;
         Py_INCREF(Pwatch);
         dbus_watch_set_data(watch, Pwatch, _tdbus_decref);
     }
-    PyObject_CallMethod((PyObject *) data, "add_watch", "O", Pwatch);
+    Presult = PyObject_CallMethod((PyObject *) data, "add_watch", "O", Pwatch);
+    Py_XDECREF(Presult);
     if (PyErr_Occurred())
         PyErr_Clear();
+    PyGILState_Release(gstate);
     return TRUE;
 }
 
 static void
 _tdbus_remove_watch_callback(DBusWatch *watch, void *data)
 {
-    PyObject *Pwatch;
+    PyObject *Pwatch, *Presult;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     Pwatch = dbus_watch_get_data(watch);
     ASSERT(Pwatch != NULL);
-    PyObject_CallMethod((PyObject *) data, "remove_watch", "O", Pwatch);
+    Presult = PyObject_CallMethod((PyObject *) data, "remove_watch", "O", Pwatch);
+    Py_XDECREF(Presult);
+error:
     if (PyErr_Occurred())
         PyErr_Clear();
-error:
-    return;
+    PyGILState_Release(gstate);
 }
 
 static void
 _tdbus_watch_toggled_callback(DBusWatch *watch, void *data)
 {
-    PyObject *Pwatch;
+    PyObject *Pwatch, *Presult;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     Pwatch = dbus_watch_get_data(watch);
     ASSERT(Pwatch != NULL);
-    PyObject_CallMethod((PyObject *) data, "watch_toggled", "O", Pwatch);
+    Presult = PyObject_CallMethod((PyObject *) data, "watch_toggled", "O", Pwatch);
+    Py_XDECREF(Presult);
+error:
     if (PyErr_Occurred())
         PyErr_Clear();
-error:
-    return;
+    PyGILState_Release(gstate);
 }
 
 static dbus_bool_t
 _tdbus_add_timeout_callback(DBusTimeout *timeout, void *data)
 {
+    PyObject *Presult;
     PyTDBusTimeoutObject *Ptimeout;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     if ((Ptimeout = dbus_timeout_get_data(timeout)) == NULL) {
-        if ((Ptimeout = PyObject_New(PyTDBusTimeoutObject, &PyTDBusTimeoutType)) == NULL)
+        if ((Ptimeout = PyObject_New(PyTDBusTimeoutObject, &PyTDBusTimeoutType)) == NULL) {
+            PyErr_Clear();
+            PyGILState_Release(gstate);
             return FALSE;
+        }
         Ptimeout->timeout = timeout;
         Ptimeout->data = NULL;
         Py_INCREF(Ptimeout);
         dbus_timeout_set_data(timeout, Ptimeout, _tdbus_decref);
     }
-    PyObject_CallMethod((PyObject *) data, "add_timeout", "O", Ptimeout);
+    Presult = PyObject_CallMethod((PyObject *) data, "add_timeout", "O", Ptimeout);
+    Py_XDECREF(Presult);
     if (PyErr_Occurred())
         PyErr_Clear();
+    PyGILState_Release(gstate);
     return TRUE;
 }
 
 static void
 _tdbus_remove_timeout_callback(DBusTimeout *timeout, void *data)
 {
-    PyObject *Ptimeout;
+    PyObject *Ptimeout, *Presult;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     Ptimeout = dbus_timeout_get_data(timeout);
     ASSERT(Ptimeout != NULL);
-    PyObject_CallMethod((PyObject *) data, "remove_timeout", "O", Ptimeout);
+    Presult = PyObject_CallMethod((PyObject *) data, "remove_timeout", "O", Ptimeout);
+    Py_XDECREF(Presult);
+error:
     if (PyErr_Occurred())
         PyErr_Clear();
-error:
-    return;
+    PyGILState_Release(gstate);
 }
 
 static void
 _tdbus_timeout_toggled_callback(DBusTimeout *timeout, void *data)
 {
-    PyObject *Ptimeout;
+    PyObject *Ptimeout, *Presult;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     Ptimeout = dbus_timeout_get_data(timeout);
     ASSERT(Ptimeout != NULL);
-    PyObject_CallMethod((PyObject *) data, "timeout_toggled", "O", Ptimeout);
+    Presult = PyObject_CallMethod((PyObject *) data, "timeout_toggled", "O", Ptimeout);
+    Py_XDECREF(Presult);
+error:
     if (PyErr_Occurred())
         PyErr_Clear();
-error:
-    return;
+    PyGILState_Release(gstate);
 }
 
 static PyObject *
-tdbus_connection_set_loop(PyTDBusConnectionObject *self, PyObject *args)
+tdbus_connection_set_loop(PyTDBusConnectionObject *self, PyObject *loop)
 {
-    PyObject *loop;
-    
-    if (!PyArg_ParseTuple(args, "O:set_loop", &loop))
-        return NULL;
+    int ret;
+
     if (self->connection == NULL)
         RETURN_ERROR("not connected");
 
@@ -1562,15 +2871,17 @@ tdbus_connection_set_loop(PyTDBusConnectionObject *self, PyObject *args)
     self->loop = loop;
 
     Py_INCREF(loop);
-    if (!dbus_connection_set_watch_functions(self->connection,
+    WITHOUT_GIL(ret = dbus_connection_set_watch_functions(self->connection,
             _tdbus_add_watch_callback, _tdbus_remove_watch_callback,
-            _tdbus_watch_toggled_callback, loop, _tdbus_decref))
+            _tdbus_watch_toggled_callback, loop, _tdbus_decref));
+    if (!ret)
         RETURN_ERROR("dbus_connection_set_watch_functions() failed");
 
     Py_INCREF(loop);
-    if (!dbus_connection_set_timeout_functions(self->connection,
+    WITHOUT_GIL(ret = dbus_connection_set_timeout_functions(self->connection,
             _tdbus_add_timeout_callback, _tdbus_remove_timeout_callback,
-            _tdbus_timeout_toggled_callback, loop, _tdbus_decref))
+            _tdbus_timeout_toggled_callback, loop, _tdbus_decref));
+    if (!ret)
         RETURN_ERROR("dbus_connection_set_watch_functions() failed");
 
     Py_INCREF(Py_None);
@@ -1587,41 +2898,55 @@ _tdbus_connection_filter_callback(DBusConnection *connection,
     int ret;
     PyObject *Presult;
     PyTDBusMessageObject *Pmessage;
+    PyTDBusConnectionObject *Pconnection;
+    PyGILState_STATE gstate;
 
-    if ((Pmessage = PyObject_New(PyTDBusMessageObject, &PyTDBusMessageType)) == NULL)
+    Pconnection = dbus_connection_get_data(connection, tdbus_app_slot);
+    gstate = PyGILState_Ensure();
+    if (Pconnection != NULL)
+        Pconnection->stats.filter_calls++;
+    TRACE_MESSAGE(filter, dbus_message_get_serial(message), message);
+
+    if ((Pmessage = PyObject_New(PyTDBusMessageObject, &PyTDBusMessageType)) == NULL) {
+        PyErr_Clear();
+        PyGILState_Release(gstate);
         return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    }
     dbus_message_ref(message);
     Pmessage->message = message;
+    if (Pconnection != NULL && Pconnection->histograms != NULL)
+        Pmessage->timestamp = _tdbus_monotonic_usec();
+    else
+        Pmessage->timestamp = 0;
 
-    Presult = PyObject_CallFunction((PyObject *) data, "O", Pmessage);
+    Presult = PyObject_CallFunctionObjArgs((PyObject *) data, (PyObject *) Pmessage, NULL);
     Py_DECREF(Pmessage);
     if (Presult == NULL) {
         PyErr_Clear();
-        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-    }
-    if (PyObject_IsTrue(Presult))
+        ret = DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    } else if (PyObject_IsTrue(Presult))
         ret = DBUS_HANDLER_RESULT_HANDLED;
     else
         ret = DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-    Py_DECREF(Presult);
+    Py_XDECREF(Presult);
+    PyGILState_Release(gstate);
     return ret;
 }
 
 static PyObject *
-tdbus_connection_add_filter(PyTDBusConnectionObject *self, PyObject *args)
+tdbus_connection_add_filter(PyTDBusConnectionObject *self, PyObject *filter)
 {
-    PyObject *filter;
+    int ret;
 
-    if (!PyArg_ParseTuple(args, "O:add_filter", &filter))
-        return NULL;
     if (self->connection == NULL)
         RETURN_ERROR("not connected");
 
     if (!PyCallable_Check(filter))
         RETURN_ERROR("expecting a Python callable");
     Py_INCREF(filter);
-    if (!dbus_connection_add_filter(self->connection,
-                _tdbus_connection_filter_callback, filter, _tdbus_decref))
+    WITHOUT_GIL(ret = dbus_connection_add_filter(self->connection,
+                _tdbus_connection_filter_callback, filter, _tdbus_decref));
+    if (!ret)
         RETURN_ERROR("dbus_connection_add_filter() failed");
     Py_INCREF(Py_None);
     return Py_None;
@@ -1633,18 +2958,57 @@ error:
 static PyObject *
 tdbus_connection_send(PyTDBusConnectionObject *self, PyObject *args)
 {
+    int ret, limited;
+    long size, fds, msgsize, msgfds;
     dbus_uint32_t serial;
+    DBusConnection *connection;
     PyObject *Pserial;
-    PyTDBusMessageObject *message;
+    PyTDBusMessageObject *message, *request = NULL;
+    PyTDBusHistogramObject *Phistogram;
 
-    if (!PyArg_ParseTuple(args, "O!:send", &PyTDBusMessageType, &message))
+    if (!PyArg_ParseTuple(args, "O!|O!:send", &PyTDBusMessageType, &message,
+                          &PyTDBusMessageType, &request))
         return NULL;
     if (self->connection == NULL)
         RETURN_ERROR("not connected");
 
-    if (!dbus_connection_send(self->connection, message->message, &serial))
+    /* Keep a reference in case another thread closes the connection while
+     * the GIL is released. */
+    connection = dbus_connection_ref(self->connection);
+    WITHOUT_GIL(limited = _tdbus_connection_get_outgoing(self, connection,
+                                message->message, &size, &fds, &msgsize, &msgfds));
+    if (limited && _tdbus_connection_would_block(self, size, fds, msgsize, msgfds)) {
+        WITHOUT_GIL(dbus_connection_unref(connection));
+        self->stats.would_block++;
+        PyErr_SetString(tdbus_WouldBlock, "outgoing queue is full");
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    size = dbus_connection_get_outgoing_size(connection);
+    if (dbus_message_contains_unix_fds(message->message) &&
+                !dbus_connection_can_send_type(connection, DBUS_TYPE_UNIX_FD))
+        ret = -1;
+    else
+        ret = dbus_connection_send(connection, message->message, &serial);
+    dbus_connection_unref(connection);
+    Py_END_ALLOW_THREADS
+    if (ret == -1)
+        RETURN_ERROR("connection cannot pass file descriptors");
+    if (!ret)
         RETURN_ERROR("dbus_connection_send() failed");
-    
+    TRACE_MESSAGE(send, serial, message->message);
+    msgsize = _tdbus_message_get_size(message->message);
+    _tdbus_connection_count_message(self->stats.messages_sent, self->stats.bytes_sent,
+                                    dbus_message_get_type(message->message), msgsize);
+    _tdbus_connection_count_outgoing(self, size + msgsize);
+
+    /* If this is a reply to `request`, record the server side latency. */
+    if (request != NULL && request->timestamp != 0 && self->histograms != NULL) {
+        Phistogram = _tdbus_connection_get_histogram(self, "server", request->message);
+        CHECK_PYTHON_ERROR(Phistogram == NULL);
+        _tdbus_histogram_record(Phistogram, _tdbus_monotonic_usec() - request->timestamp);
+    }
+
     if (sizeof(long) == 8)
         Pserial = PyInt_FromLong(serial);
     else
@@ -1659,10 +3023,13 @@ error:
 static PyObject *
 tdbus_connection_send_with_reply(PyTDBusConnectionObject *self, PyObject *args)
 {
-    int timeout = -1;
+    int timeout = -1, ret, limited;
+    long size, fds, msgsize, msgfds;
+    DBusConnection *connection;
     PyTDBusPendingCallObject *Ppending;
     PyTDBusMessageObject *message;
     DBusPendingCall *pending = NULL;
+    _tdbus_pending_call_data *pdata = NULL;
 
     if (!PyArg_ParseTuple(args, "O!|i:send", &PyTDBusMessageType, &message,
                           &timeout))
@@ -1670,9 +3037,55 @@ tdbus_connection_send_with_reply(PyTDBusConnectionObject *self, PyObject *args)
     if (self->connection == NULL)
         RETURN_ERROR("not connected");
 
-    if (!dbus_connection_send_with_reply(self->connection, message->message,
-                &pending, timeout) || (pending == NULL))
+    connection = dbus_connection_ref(self->connection);
+    WITHOUT_GIL(limited = _tdbus_connection_get_outgoing(self, connection,
+                                message->message, &size, &fds, &msgsize, &msgfds));
+    if (limited && _tdbus_connection_would_block(self, size, fds, msgsize, msgfds)) {
+        WITHOUT_GIL(dbus_connection_unref(connection));
+        self->stats.would_block++;
+        PyErr_SetString(tdbus_WouldBlock, "outgoing queue is full");
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    size = dbus_connection_get_outgoing_size(connection);
+    if (dbus_message_contains_unix_fds(message->message) &&
+                !dbus_connection_can_send_type(connection, DBUS_TYPE_UNIX_FD))
+        ret = -1;
+    else
+        ret = dbus_connection_send_with_reply(connection, message->message,
+                                              &pending, timeout);
+    dbus_connection_unref(connection);
+    Py_END_ALLOW_THREADS
+    if (ret == -1)
+        RETURN_ERROR("connection cannot pass file descriptors");
+    if (!ret || (pending == NULL))
         RETURN_ERROR("dbus_connection_send_with_reply() failed");
+    TRACE_MESSAGE(send, dbus_message_get_serial(message->message), message->message);
+    msgsize = _tdbus_message_get_size(message->message);
+    _tdbus_connection_count_message(self->stats.messages_sent, self->stats.bytes_sent,
+                                    dbus_message_get_type(message->message), msgsize);
+    _tdbus_connection_count_outgoing(self, size + msgsize);
+
+    MALLOC(pdata, sizeof(_tdbus_pending_call_data));
+    pdata->connection = (PyObject *) self;
+    pdata->histogram = NULL;
+    pdata->start = 0;
+    pdata->completed = 0;
+    if (self->histograms != NULL) {
+        pdata->histogram = _tdbus_connection_get_histogram(self, "client", message->message);
+        CHECK_PYTHON_ERROR(pdata->histogram == NULL);
+        Py_INCREF(pdata->histogram);
+        pdata->start = _tdbus_monotonic_usec();
+    }
+    Py_INCREF(self);
+    WITHOUT_GIL(ret = dbus_pending_call_set_data(pending, tdbus_pending_slot, pdata,
+                _tdbus_connection_pending_call_done));
+    if (!ret) {
+        Py_DECREF(self);
+        RETURN_MEMORY_ERROR();
+    }
+    pdata = NULL;
+    self->stats.pending_calls++;
 
     Ppending = PyObject_New(PyTDBusPendingCallObject, &PyTDBusPendingCallType);
     CHECK_PYTHON_ERROR(Ppending == NULL);
@@ -1680,22 +3093,44 @@ tdbus_connection_send_with_reply(PyTDBusConnectionObject *self, PyObject *args)
     return (PyObject *) Ppending;
 
 error:
-    if (pending != NULL) dbus_pending_call_unref(pending);
+    if (pending != NULL) WITHOUT_GIL(dbus_pending_call_unref(pending));
+    if (pdata != NULL) {
+        if (pdata->histogram != NULL) Py_DECREF(pdata->histogram);
+        free(pdata);
+    }
     return NULL;
 }
 
 static PyObject *
-tdbus_connection_dispatch(PyTDBusConnectionObject *self, PyObject *args)
+tdbus_connection_dispatch(PyTDBusConnectionObject *self, PyObject *noargs)
 {
-    int status;
+    int status, type = DBUS_MESSAGE_TYPE_INVALID;
+    long size = 0;
     PyObject *Pstatus;
+    DBusMessage *message;
+    DBusConnection *connection;
 
-    if (!PyArg_ParseTuple(args, ":dispatch"))
-        return NULL;
     if (self->connection == NULL)
         RETURN_ERROR("not connected");
 
-    status = dbus_connection_dispatch(self->connection);
+    /* Peek at the message that is about to be dispatched. This is the only
+     * place where all incoming messages pass, including method returns
+     * that are handled by libdbus and never reach a filter. The receive
+     * counters are updated once the GIL is held again. */
+    self->stats.dispatch_calls++;
+    connection = dbus_connection_ref(self->connection);
+    Py_BEGIN_ALLOW_THREADS
+    if ((message = dbus_connection_borrow_message(connection)) != NULL) {
+        type = dbus_message_get_type(message);
+        size = _tdbus_message_get_size(message);
+        dbus_connection_return_message(connection, message);
+    }
+    status = dbus_connection_dispatch(connection);
+    dbus_connection_unref(connection);
+    Py_END_ALLOW_THREADS
+    if (message != NULL)
+        _tdbus_connection_count_message(self->stats.messages_received,
+                                        self->stats.bytes_received, type, size);
     Pstatus = PyInt_FromLong(status);
     CHECK_PYTHON_ERROR(Pstatus == NULL);
     return Pstatus;
@@ -1705,15 +3140,17 @@ error:
 }
 
 static PyObject *
-tdbus_connection_flush(PyTDBusConnectionObject *self, PyObject *args)
+tdbus_connection_flush(PyTDBusConnectionObject *self, PyObject *noargs)
 {
-    if (!PyArg_ParseTuple(args, ":flush"))
-        return NULL;
+    DBusConnection *connection;
+
     if (self->connection == NULL)
         RETURN_ERROR("not connected");
 
+    connection = dbus_connection_ref(self->connection);
     Py_BEGIN_ALLOW_THREADS
-    dbus_connection_flush(self->connection);
+    dbus_connection_flush(connection);
+    dbus_connection_unref(connection);
     Py_END_ALLOW_THREADS
 
     Py_INCREF(Py_None);
@@ -1724,17 +3161,16 @@ error:
 }
 
 static PyObject *
-tdbus_connection_get_unique_name(PyTDBusConnectionObject *self, PyObject *args)
+tdbus_connection_get_unique_name(PyTDBusConnectionObject *self, PyObject *noargs)
 {
     const char *name;
     PyObject *Paddress;
 
-    if (!PyArg_ParseTuple(args, ":get_unique_name"))
-        return NULL;
     if (self->connection == NULL)
         RETURN_ERROR("not connected");
 
-    if ((name = dbus_bus_get_unique_name(self->connection)) == NULL)
+    WITHOUT_GIL(name = dbus_bus_get_unique_name(self->connection));
+    if (name == NULL)
         RETURN_ERROR("dbus_bus_get_unique_name() failed");
     if ((Paddress = PyString_FromString(name)) == NULL)
         RETURN_ERROR(NULL);
@@ -1745,17 +3181,15 @@ error:
 }
 
 static PyObject *
-tdbus_connection_get_dispatch_status(PyTDBusConnectionObject *self, PyObject *args)
+tdbus_connection_get_dispatch_status(PyTDBusConnectionObject *self, PyObject *noargs)
 {
     int status;
     PyObject *Pstatus;
 
-    if (!PyArg_ParseTuple(args, ":get_dispatch_status"))
-        return NULL;
     if (self->connection == NULL)
         RETURN_ERROR("not connected");
 
-    status = dbus_connection_get_dispatch_status(self->connection);
+    WITHOUT_GIL(status = dbus_connection_get_dispatch_status(self->connection));
     Pstatus = PyInt_FromLong(status);
     CHECK_PYTHON_ERROR(Pstatus == NULL);
     return Pstatus;
@@ -1764,19 +3198,521 @@ error:
     return NULL;
 }
 
+static PyObject *
+tdbus_connection_can_send_type(PyTDBusConnectionObject *self, PyObject *Parg)
+{
+    char type;
+    int ret;
+    PyObject *Presult;
+
+    if (!PyArg_Parse(Parg, "c:can_send_type", &type))
+        return NULL;
+    if (self->connection == NULL)
+        RETURN_ERROR("not connected");
+
+    WITHOUT_GIL(ret = dbus_connection_can_send_type(self->connection, type));
+    Presult = PyBool_FromLong(ret);
+    CHECK_PYTHON_ERROR(Presult == NULL);
+    return Presult;
+
+error:
+    return NULL;
+}
+
+static PyObject *
+tdbus_connection_get_is_connected(PyTDBusConnectionObject *self, PyObject *noargs)
+{
+    int connected = 0;
+    PyObject *Pconnected;
+
+    if (self->connection != NULL)
+        WITHOUT_GIL(connected = dbus_connection_get_is_connected(self->connection));
+    Pconnected = PyBool_FromLong(connected);
+    CHECK_PYTHON_ERROR(Pconnected == NULL);
+    return Pconnected;
+
+error:
+    return NULL;
+}
+
+static const char *_tdbus_message_type_names[DBUS_NUM_MESSAGE_TYPES] = {
+    "invalid", "method_call", "method_return", "error", "signal"
+};
+
+static int
+_tdbus_dict_set_long(PyObject *dict, const char *key, long value)
+{
+    int ret;
+    PyObject *Pvalue;
+
+    if ((Pvalue = PyInt_FromLong(value)) == NULL)
+        return -1;
+    ret = PyDict_SetItemString(dict, key, Pvalue);
+    Py_DECREF(Pvalue);
+    return ret;
+}
+
+static PyObject *
+tdbus_connection_get_stats(PyTDBusConnectionObject *self, PyObject *noargs)
+{
+    int i;
+    long size;
+    char key[64];
+    PyObject *Pstats = NULL;
+    _tdbus_connection_stats *stats = &self->stats;
+
+    if (self->connection == NULL)
+        RETURN_ERROR("not connected");
+
+    Pstats = PyDict_New();
+    CHECK_PYTHON_ERROR(Pstats == NULL);
+
+    #define SET_STAT(name, value) \
+        CHECK_PYTHON_ERROR(_tdbus_dict_set_long(Pstats, name, value) < 0)
+
+    for (i=1; i<DBUS_NUM_MESSAGE_TYPES; i++) {
+        snprintf(key, sizeof(key), "%s_sent", _tdbus_message_type_names[i]);
+        SET_STAT(key, stats->messages_sent[i]);
+        snprintf(key, sizeof(key), "%s_sent_bytes", _tdbus_message_type_names[i]);
+        SET_STAT(key, stats->bytes_sent[i]);
+        snprintf(key, sizeof(key), "%s_received", _tdbus_message_type_names[i]);
+        SET_STAT(key, stats->messages_received[i]);
+        snprintf(key, sizeof(key), "%s_received_bytes", _tdbus_message_type_names[i]);
+        SET_STAT(key, stats->bytes_received[i]);
+    }
+    SET_STAT("filter_calls", stats->filter_calls);
+    SET_STAT("dispatch_calls", stats->dispatch_calls);
+    SET_STAT("pending_calls", stats->pending_calls);
+    WITHOUT_GIL(size = dbus_connection_get_outgoing_size(self->connection));
+    SET_STAT("outgoing_size", size);
+    SET_STAT("peak_outgoing_size", stats->peak_outgoing_size);
+    WITHOUT_GIL(size = dbus_connection_get_outgoing_unix_fds(self->connection));
+    SET_STAT("outgoing_unix_fds", size);
+    SET_STAT("would_block", stats->would_block);
+
+    return Pstats;
+
+error:
+    if (Pstats != NULL) Py_DECREF(Pstats);
+    return NULL;
+}
+
+static PyObject *
+tdbus_connection_reset_stats(PyTDBusConnectionObject *self, PyObject *noargs)
+{
+    long pending_calls, size;
+
+    if (self->connection == NULL)
+        RETURN_ERROR("not connected");
+
+    /* The number of pending calls is a gauge, not a counter. */
+    WITHOUT_GIL(size = dbus_connection_get_outgoing_size(self->connection));
+    pending_calls = self->stats.pending_calls;
+    memset(&self->stats, 0, sizeof(self->stats));
+    self->stats.pending_calls = pending_calls;
+    self->stats.peak_outgoing_size = size;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+
+error:
+    return NULL;
+}
+
+static PyObject *
+tdbus_connection_set_latency_tracking(PyTDBusConnectionObject *self, PyObject *Parg)
+{
+    int enabled;
+
+    if (!PyArg_Parse(Parg, "i:set_latency_tracking", &enabled))
+        return NULL;
+
+    if (enabled && self->histograms == NULL) {
+        self->histograms = PyDict_New();
+        CHECK_PYTHON_ERROR(self->histograms == NULL);
+    } else if (!enabled && self->histograms != NULL) {
+        Py_DECREF(self->histograms);
+        self->histograms = NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+
+error:
+    return NULL;
+}
+
+static PyObject *
+tdbus_connection_set_outgoing_limits(PyTDBusConnectionObject *self, PyObject *args)
+{
+    long high, low, high_fds = 0, low_fds = 0;
+
+    if (!PyArg_ParseTuple(args, "ll|ll:set_outgoing_limits", &high, &low,
+                          &high_fds, &low_fds))
+        return NULL;
+    if (high < 0 || low < 0 || high_fds < 0 || low_fds < 0)
+        RETURN_ERROR("limits cannot be negative");
+    if (low > high || low_fds > high_fds)
+        RETURN_ERROR("low water mark cannot exceed high water mark");
+
+    self->limits.high = high;
+    self->limits.low = low;
+    self->limits.high_fds = high_fds;
+    self->limits.low_fds = low_fds;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+
+error:
+    return NULL;
+}
+
+static PyObject *
+tdbus_connection_set_writable_callback(PyTDBusConnectionObject *self, PyObject *Pcallback)
+{
+    if (Pcallback == Py_None)
+        Pcallback = NULL;
+    else if (!PyCallable_Check(Pcallback))
+        RETURN_ERROR("expecting a Python callable or None");
+
+    Py_XINCREF(Pcallback);
+    Py_XDECREF(self->limits.callback);
+    self->limits.callback = Pcallback;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+
+error:
+    return NULL;
+}
+
+static PyObject *
+tdbus_connection_check_writable(PyTDBusConnectionObject *self, PyObject *noargs)
+{
+    long size, fds;
+    PyObject *Presult;
+
+    if (self->limits.blocked) {
+        if (self->connection == NULL)
+            RETURN_ERROR("not connected");
+        Py_BEGIN_ALLOW_THREADS
+        size = dbus_connection_get_outgoing_size(self->connection);
+        fds = dbus_connection_get_outgoing_unix_fds(self->connection);
+        Py_END_ALLOW_THREADS
+        /* The writable callback is only called from here, and not from
+         * the send functions, so that it never runs inside a send. */
+        if ((self->limits.high == 0 || size <= self->limits.low) &&
+                    (self->limits.high_fds == 0 || fds <= self->limits.low_fds)) {
+            self->limits.blocked = 0;
+            if (self->limits.callback != NULL) {
+                Presult = PyObject_CallObject(self->limits.callback, NULL);
+                if (Presult == NULL)
+                    PyErr_Clear();
+                Py_XDECREF(Presult);
+            }
+        }
+    }
+
+    Presult = self->limits.blocked ? Py_False : Py_True;
+    Py_INCREF(Presult);
+    return Presult;
+
+error:
+    return NULL;
+}
+
+static PyObject *
+tdbus_connection_get_latency_histograms(PyTDBusConnectionObject *self, PyObject *noargs)
+{
+    if (self->histograms == NULL)
+        return PyDict_New();
+    return PyDict_Copy(self->histograms);
+}
+
 static PyMethodDef tdbus_connection_methods[] = \
 {
     { "open", (PyCFunction) tdbus_connection_open, METH_VARARGS },
-    { "close", (PyCFunction) tdbus_connection_close, METH_VARARGS },
-    { "get_loop", (PyCFunction) tdbus_connection_get_loop, METH_VARARGS },
-    { "set_loop", (PyCFunction) tdbus_connection_set_loop, METH_VARARGS },
-    { "add_filter", (PyCFunction) tdbus_connection_add_filter, METH_VARARGS },
+    { "close", (PyCFunction) tdbus_connection_close, METH_NOARGS },
+    { "get_loop", (PyCFunction) tdbus_connection_get_loop, METH_NOARGS },
+    { "set_loop", (PyCFunction) tdbus_connection_set_loop, METH_O },
+    { "add_filter", (PyCFunction) tdbus_connection_add_filter, METH_O },
     { "send", (PyCFunction) tdbus_connection_send, METH_VARARGS },
     { "send_with_reply", (PyCFunction) tdbus_connection_send_with_reply, METH_VARARGS },
-    { "dispatch", (PyCFunction) tdbus_connection_dispatch, METH_VARARGS },
-    { "flush", (PyCFunction) tdbus_connection_flush, METH_VARARGS },
-    { "get_unique_name", (PyCFunction) tdbus_connection_get_unique_name, METH_VARARGS },
-    { "get_dispatch_status", (PyCFunction) tdbus_connection_get_dispatch_status, METH_VARARGS },
+    { "dispatch", (PyCFunction) tdbus_connection_dispatch, METH_NOARGS },
+    { "flush", (PyCFunction) tdbus_connection_flush, METH_NOARGS },
+    { "get_unique_name", (PyCFunction) tdbus_connection_get_unique_name, METH_NOARGS },
+    { "get_dispatch_status", (PyCFunction) tdbus_connection_get_dispatch_status, METH_NOARGS },
+    { "get_is_connected", (PyCFunction) tdbus_connection_get_is_connected, METH_NOARGS },
+    { "can_send_type", (PyCFunction) tdbus_connection_can_send_type, METH_O },
+    { "get_stats", (PyCFunction) tdbus_connection_get_stats, METH_NOARGS },
+    { "reset_stats", (PyCFunction) tdbus_connection_reset_stats, METH_NOARGS },
+    { "set_latency_tracking", (PyCFunction) tdbus_connection_set_latency_tracking, METH_O },
+    { "get_latency_histograms", (PyCFunction) tdbus_connection_get_latency_histograms, METH_NOARGS },
+    { "set_outgoing_limits", (PyCFunction) tdbus_connection_set_outgoing_limits, METH_VARARGS },
+    { "set_writable_callback", (PyCFunction) tdbus_connection_set_writable_callback, METH_O },
+    { "check_writable", (PyCFunction) tdbus_connection_check_writable, METH_NOARGS },
+    { NULL }
+};
+
+
+/*
+ * Server object: accepts direct (peer to peer) connections
+ */
+
+typedef struct
+{
+    PyObject_HEAD
+    DBusServer *server;
+    PyObject *loop;
+} PyTDBusServerObject;
+
+PyTypeObject PyTDBusServerType =
+{
+    PyObject_HEAD_INIT(NULL) 0,
+    "_tdbus.Server",
+    sizeof(PyTDBusServerObject)
+};
+
+static int
+tdbus_server_init(PyTDBusServerObject *self, PyObject *args, PyObject *kwargs)
+{
+    char *address;
+    DBusError error;
+    static char *kwlist[] = { "address", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s", kwlist, &address))
+        return -1;
+
+    dbus_error_init(&error);
+    self->server = dbus_server_listen(address, &error);
+    if (self->server == NULL)
+        RETURN_DBUS_ERROR(error);
+    return 0;
+
+error:
+    dbus_error_free(&error);
+    return -1;
+}
+
+static void
+tdbus_server_dealloc(PyTDBusServerObject *self)
+{
+    if (self->server) {
+        WITHOUT_GIL(dbus_server_disconnect(self->server); dbus_server_unref(self->server));
+        self->server = NULL;
+    }
+    if (self->loop) {
+        Py_DECREF(self->loop);
+        self->loop = NULL;
+    }
+    PyObject_Del(self);
+}
+
+static PyObject *
+tdbus_server_disconnect(PyTDBusServerObject *self, PyObject *noargs)
+{
+    if (self->server != NULL) {
+        WITHOUT_GIL(dbus_server_disconnect(self->server); dbus_server_unref(self->server));
+        self->server = NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *
+tdbus_server_get_is_connected(PyTDBusServerObject *self, PyObject *noargs)
+{
+    int connected = 0;
+    PyObject *Pconnected;
+
+    if (self->server != NULL)
+        WITHOUT_GIL(connected = dbus_server_get_is_connected(self->server));
+    Pconnected = PyBool_FromLong(connected);
+    CHECK_PYTHON_ERROR(Pconnected == NULL);
+    return Pconnected;
+
+error:
+    return NULL;
+}
+
+static PyObject *
+tdbus_server_get_address(PyTDBusServerObject *self, PyObject *noargs)
+{
+    char *address;
+    PyObject *Paddress;
+
+    if (self->server == NULL)
+        RETURN_ERROR("not connected");
+
+    WITHOUT_GIL(address = dbus_server_get_address(self->server));
+    if (address == NULL)
+        RETURN_MEMORY_ERROR();
+    Paddress = PyString_FromString(address);
+    dbus_free(address);
+    CHECK_PYTHON_ERROR(Paddress == NULL);
+    return Paddress;
+
+error:
+    return NULL;
+}
+
+static PyObject *
+tdbus_server_get_id(PyTDBusServerObject *self, PyObject *noargs)
+{
+    char *id;
+    PyObject *Pid;
+
+    if (self->server == NULL)
+        RETURN_ERROR("not connected");
+
+    WITHOUT_GIL(id = dbus_server_get_id(self->server));
+    if (id == NULL)
+        RETURN_MEMORY_ERROR();
+    Pid = PyString_FromString(id);
+    dbus_free(id);
+    CHECK_PYTHON_ERROR(Pid == NULL);
+    return Pid;
+
+error:
+    return NULL;
+}
+
+static PyObject *
+tdbus_server_get_loop(PyTDBusServerObject *self, PyObject *noargs)
+{
+    if (self->server == NULL)
+        RETURN_ERROR("not connected");
+
+    if (self->loop == NULL) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    } else {
+        Py_INCREF(self->loop);
+        return self->loop;
+    }
+
+error:
+    return NULL;
+}
+
+static PyObject *
+tdbus_server_set_loop(PyTDBusServerObject *self, PyObject *loop)
+{
+    int ret;
+    PyObject *Pold;
+
+    if (self->server == NULL)
+        RETURN_ERROR("not connected");
+
+    if (!PyObject_HasAttrString(loop, "add_watch") ||
+                !PyObject_HasAttrString(loop, "remove_watch") ||
+                !PyObject_HasAttrString(loop, "watch_toggled") ||
+                !PyObject_HasAttrString(loop, "add_timeout") ||
+                !PyObject_HasAttrString(loop, "remove_timeout") ||
+                !PyObject_HasAttrString(loop, "timeout_toggled"))
+        RETURN_ERROR("expecting an EventLoop like object");
+
+    /* The reference for the functions is only passed on if libdbus
+     * accepted them. */
+    Py_INCREF(loop);
+    WITHOUT_GIL(ret = dbus_server_set_watch_functions(self->server,
+            _tdbus_add_watch_callback, _tdbus_remove_watch_callback,
+            _tdbus_watch_toggled_callback, loop, _tdbus_decref));
+    if (!ret) {
+        Py_DECREF(loop);
+        RETURN_ERROR("dbus_server_set_watch_functions() failed");
+    }
+
+    Py_INCREF(loop);
+    WITHOUT_GIL(ret = dbus_server_set_timeout_functions(self->server,
+            _tdbus_add_timeout_callback, _tdbus_remove_timeout_callback,
+            _tdbus_timeout_toggled_callback, loop, _tdbus_decref));
+    if (!ret) {
+        Py_DECREF(loop);
+        RETURN_ERROR("dbus_server_set_timeout_functions() failed");
+    }
+
+    Pold = self->loop;
+    Py_INCREF(loop);
+    self->loop = loop;
+    Py_XDECREF(Pold);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+
+error:
+    return NULL;
+}
+
+/* Wrap a new connection in a Connection object and pass it to the Python
+ * callback. If the callback does not keep a reference to it, the
+ * connection is closed again. */
+
+static void
+_tdbus_server_new_connection_callback(DBusServer *server,
+                                      DBusConnection *connection, void *data)
+{
+    int ret;
+    PyObject *Presult;
+    PyTDBusConnectionObject *Pconnection;
+    PyGILState_STATE gstate;
+
+    gstate = PyGILState_Ensure();
+    Pconnection = (PyTDBusConnectionObject *)
+            PyType_GenericNew(&PyTDBusConnectionType, NULL, NULL);
+    if (Pconnection == NULL) {
+        PyErr_Clear();
+        PyGILState_Release(gstate);
+        return;
+    }
+    dbus_connection_ref(connection);
+    Pconnection->connection = connection;
+    WITHOUT_GIL(dbus_connection_set_exit_on_disconnect(connection, FALSE);
+                ret = dbus_connection_set_data(connection, tdbus_app_slot,
+                                               Pconnection, NULL));
+    if (!ret) {
+        Py_DECREF(Pconnection);
+        PyGILState_Release(gstate);
+        return;
+    }
+    Presult = PyObject_CallFunctionObjArgs((PyObject *) data, (PyObject *) Pconnection, NULL);
+    if (Presult == NULL)
+        PyErr_Clear();
+    else
+        Py_DECREF(Presult);
+    Py_DECREF(Pconnection);
+    PyGILState_Release(gstate);
+}
+
+static PyObject *
+tdbus_server_set_new_connection_callback(PyTDBusServerObject *self, PyObject *callback)
+{
+    if (self->server == NULL)
+        RETURN_ERROR("not connected");
+
+    if (!PyCallable_Check(callback))
+        RETURN_ERROR("expecting a Python callable");
+    Py_INCREF(callback);
+    WITHOUT_GIL(dbus_server_set_new_connection_function(self->server,
+                _tdbus_server_new_connection_callback, callback, _tdbus_decref));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+
+error:
+    return NULL;
+}
+
+static PyMethodDef tdbus_server_methods[] = \
+{
+    { "disconnect", (PyCFunction) tdbus_server_disconnect, METH_NOARGS },
+    { "get_is_connected", (PyCFunction) tdbus_server_get_is_connected, METH_NOARGS },
+    { "get_address", (PyCFunction) tdbus_server_get_address, METH_NOARGS },
+    { "get_id", (PyCFunction) tdbus_server_get_id, METH_NOARGS },
+    { "get_loop", (PyCFunction) tdbus_server_get_loop, METH_NOARGS },
+    { "set_loop", (PyCFunction) tdbus_server_set_loop, METH_O },
+    { "set_new_connection_callback", (PyCFunction) tdbus_server_set_new_connection_callback, METH_O },
     { NULL }
 };
 
@@ -1785,7 +3721,143 @@ static PyMethodDef tdbus_connection_methods[] = \
  * _tdbus module
  */
 
+static PyObject *
+tdbus_set_trace_hook(PyObject *self, PyObject *hook)
+{
+    PyObject *old;
+
+    if (hook != Py_None && !PyCallable_Check(hook))
+        RETURN_ERROR("expecting a Python callable or None");
+
+    old = tdbus_trace_hook;
+    if (hook == Py_None)
+        tdbus_trace_hook = NULL;
+    else {
+        Py_INCREF(hook);
+        tdbus_trace_hook = hook;
+    }
+    if (old != NULL)
+        Py_DECREF(old);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+
+error:
+    return NULL;
+}
+
+/* Shared memory support: memfd_create() and atomic access to 64-bit
+ * counters in a buffer (e.g. an mmap), used by tdbus.shm. The memfd allows
+ * sealing, so that a receiver can be sure that it is not truncated. */
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+static PyObject *
+tdbus_memfd_create(PyObject *self, PyObject *Parg)
+{
+    int fd;
+    const char *name;
+    PyObject *Pfd;
+
+    if (!PyArg_Parse(Parg, "s:memfd_create", &name))
+        return NULL;
+
+#ifdef SYS_memfd_create
+    if ((fd = syscall(SYS_memfd_create, name,
+                      MFD_CLOEXEC|MFD_ALLOW_SEALING)) == -1)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    if ((Pfd = (PyObject *) _tdbus_unix_fd_new(fd)) == NULL)
+        close(fd);
+    return Pfd;
+#else
+    PyErr_SetString(PyExc_NotImplementedError, "memfd_create() not available");
+    return NULL;
+#endif
+}
+
+static uint64_t *
+_tdbus_get_counter(PyObject *buffer, Py_ssize_t offset)
+{
+    void *ptr;
+    Py_ssize_t size;
+
+    if (PyObject_AsWriteBuffer(buffer, &ptr, &size) < 0)
+        return NULL;
+    if (offset < 0 || offset % 8 || offset + 8 > size)
+        RETURN_ERROR("illegal counter offset: %ld", (long) offset);
+    return (uint64_t *) ((char *) ptr + offset);
+
+error:
+    return NULL;
+}
+
+static PyObject *
+tdbus_atomic_load(PyObject *self, PyObject *args)
+{
+    PyObject *buffer;
+    Py_ssize_t offset;
+    uint64_t *counter;
+
+    if (!PyArg_ParseTuple(args, "On:atomic_load", &buffer, &offset))
+        return NULL;
+    if ((counter = _tdbus_get_counter(buffer, offset)) == NULL)
+        return NULL;
+    return PyLong_FromUnsignedLongLong(__atomic_load_n(counter, __ATOMIC_ACQUIRE));
+}
+
+static PyObject *
+tdbus_atomic_store(PyObject *self, PyObject *args)
+{
+    PyObject *buffer;
+    Py_ssize_t offset;
+    unsigned PY_LONG_LONG value;
+    uint64_t *counter;
+
+    if (!PyArg_ParseTuple(args, "OnK:atomic_store", &buffer, &offset, &value))
+        return NULL;
+    if ((counter = _tdbus_get_counter(buffer, offset)) == NULL)
+        return NULL;
+    __atomic_store_n(counter, value, __ATOMIC_RELEASE);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *
+tdbus_have_usdt(PyObject *self, PyObject *noargs)
+{
+#ifdef HAVE_SYS_SDT_H
+    return PyBool_FromLong(1);
+#else
+    return PyBool_FromLong(0);
+#endif
+}
+
+/* Return the signature that set_args() infers for `args`. */
+
+static PyObject *
+tdbus_infer_signature(PyObject *self, PyObject *Pargs)
+{
+    char signature[INFER_SIZE];
+
+    if (_tdbus_infer_signature(Pargs, signature) < 0)
+        return NULL;
+    return _tdbus_intern_string(signature);
+}
+
 static PyMethodDef tdbus_methods[] = {
+    { "set_trace_hook", (PyCFunction) tdbus_set_trace_hook, METH_O },
+    { "have_usdt", (PyCFunction) tdbus_have_usdt, METH_NOARGS },
+    { "memfd_create", (PyCFunction) tdbus_memfd_create, METH_O },
+    { "atomic_load", (PyCFunction) tdbus_atomic_load, METH_VARARGS },
+    { "atomic_store", (PyCFunction) tdbus_atomic_store, METH_VARARGS },
+    { "demarshal", (PyCFunction) tdbus_demarshal, METH_O },
+    { "infer_signature", (PyCFunction) tdbus_infer_signature, METH_O },
     { NULL }
 };
 
@@ -1800,6 +3872,10 @@ void init_tdbus(void) {
         return;
     if (PyDict_SetItemString(Pdict, "Error", tdbus_Error) == -1)
         return;
+    if ((tdbus_WouldBlock = PyErr_NewException("_tdbus.WouldBlock", tdbus_Error, NULL)) == NULL)
+        return;
+    if (PyDict_SetItemString(Pdict, "WouldBlock", tdbus_WouldBlock) == -1)
+        return;
 
     #define FINALIZE_TYPE(type, name, methods, init, dealloc) \
         do { \
@@ -1817,12 +3893,18 @@ void init_tdbus(void) {
                   NULL, tdbus_watch_dealloc);
     FINALIZE_TYPE(PyTDBusTimeoutType, "Timeout", tdbus_timeout_methods,
                   NULL, tdbus_timeout_dealloc);
+    FINALIZE_TYPE(PyTDBusHistogramType, "Histogram", tdbus_histogram_methods,
+                  tdbus_histogram_init, tdbus_histogram_dealloc);
+    FINALIZE_TYPE(PyTDBusUnixFdType, "UnixFd", tdbus_unix_fd_methods,
+                  tdbus_unix_fd_init, tdbus_unix_fd_dealloc);
     FINALIZE_TYPE(PyTDBusMessageType, "Message", tdbus_message_methods,
                   tdbus_message_init, tdbus_message_dealloc);
     FINALIZE_TYPE(PyTDBusPendingCallType, "PendingCall", tdbus_pending_call_methods,
                   NULL, tdbus_pending_call_dealloc);
     FINALIZE_TYPE(PyTDBusConnectionType, "Connection", tdbus_connection_methods,
                   tdbus_connection_init, tdbus_connection_dealloc);
+    FINALIZE_TYPE(PyTDBusServerType, "Server", tdbus_server_methods,
+                  tdbus_server_init, tdbus_server_dealloc);
 
     #define EXPORT_STRING(name, value) \
         do { \
@@ -1881,6 +3963,12 @@ void init_tdbus(void) {
     if (!dbus_threads_init_default())
         return;
 
+    /* Callbacks from libdbus use PyGILState_Ensure(). */
+    PyEval_InitThreads();
+
     if (!dbus_connection_allocate_data_slot(&tdbus_app_slot))
         return;
+
+    if (!dbus_pending_call_allocate_data_slot(&tdbus_pending_slot))
+        return;
 }
@@ -0,0 +1,118 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+# Signal batching between tdbus connections.
+#
+# A batch is a single signal with member BATCH_MEMBER and signature "aay".
+# Each element is a signal, marshalled with Message.marshal(). The batch is
+# sent with the interface of the signals in it, so that match rules on the
+# interface (or the sender) still select it. Match rules on the path or the
+# member of the individual signals do not.
+#
+# Signals are queued per (interface, destination). A queue is sent when it
+# reaches `max_size` bytes, or `delay` seconds after its first signal was
+# queued. The receiving connection demarshals the signals and dispatches
+# each of them as if it had been sent on its own, with the sender of the
+# batch.
+
+from __future__ import division, absolute_import
+
+import threading
+
+from tdbus import _tdbus
+
+BATCH_MEMBER = 'TDBusSignalBatch'
+PATH_BATCH = '/com/github/geertj/tdbus/batch'
+
+
+class SignalBatcher(object):
+    """Queues signals for `connection`. See
+    DBusConnection.enable_signal_batching()."""
+
+    def __init__(self, connection, interfaces=None, max_size=65536, delay=0.005):
+        self.connection = connection
+        self.interfaces = None if interfaces is None else frozenset(interfaces)
+        self.max_size = max_size
+        self.delay = delay
+        self._queues = {}
+        self._lock = threading.Lock()
+
+    def wants(self, interface):
+        """Return whether signals on `interface` are batched."""
+        return self.interfaces is None or interface in self.interfaces
+
+    def add(self, message, interface, destination):
+        """Queue a signal."""
+        data = message.marshal()
+        key = (interface, destination)
+        with self._lock:
+            queue = self._queues.get(key)
+            first = queue is None
+            if first:
+                # [first message, marshalled messages, size]
+                queue = self._queues[key] = [message, [], 0]
+            queue[1].append(data)
+            queue[2] += len(data)
+            full = queue[2] >= self.max_size
+            if full:
+                del self._queues[key]
+        if full:
+            self._send(key, queue)
+        elif first:
+            self.connection.call_later(self.delay, lambda: self.flush(key))
+
+    def flush(self, key=None):
+        """Send the queued signals for `key`, or all queued signals."""
+        with self._lock:
+            if key is None:
+                queues, self._queues = self._queues, {}
+            else:
+                queues = {}
+                if key in self._queues:
+                    queues[key] = self._queues.pop(key)
+        for key, queue in queues.items():
+            self._send(key, queue)
+
+    def _send(self, key, queue):
+        interface, destination = key
+        message, signals, size = queue
+        if len(signals) > 1:
+            message = _tdbus.Message(_tdbus.DBUS_MESSAGE_TYPE_SIGNAL,
+                                     path=PATH_BATCH, interface=interface,
+                                     member=BATCH_MEMBER)
+            if destination is not None:
+                message.set_destination(destination)
+            message.set_args('aay', (signals,))
+        self.connection._send(message)
+
+
+def is_batch(message):
+    """Return whether `message` is a batch of signals."""
+    return message.get_member() == BATCH_MEMBER and \
+                message.get_type() == _tdbus.DBUS_MESSAGE_TYPE_SIGNAL and \
+                message.get_signature() == 'aay'
+
+
+def unpack(message):
+    """Return the signals in the batch `message`. Entries that are not
+    signals, are batches themselves or cannot be demarshalled are
+    dropped, as a batch must not be able to inject other messages."""
+    sender = message.get_sender()
+    signals = []
+    for data in message.get_args()[0]:
+        try:
+            signal = _tdbus.demarshal(data)
+        except _tdbus.Error:
+            continue
+        if signal.get_type() != _tdbus.DBUS_MESSAGE_TYPE_SIGNAL or \
+                is_batch(signal):
+            continue
+        if sender is not None:
+            signal.set_sender(sender)
+        signals.append(signal)
+    return signals
@@ -0,0 +1,103 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+from __future__ import division, absolute_import
+
+import os
+import sys
+import time
+import json
+import fnmatch
+import platform
+
+
+def measure(func, repeat=3, mintime=0.2):
+    """Time `func`. Returns a tuple (number, best) where `number` is the
+    number of calls per run and `best` the best time per call in seconds."""
+    number = 1
+    while True:
+        start = time.time()
+        for i in range(number):
+            func()
+        elapsed = time.time() - start
+        if elapsed >= mintime:
+            break
+        number *= 10
+    best = elapsed
+    for i in range(repeat-1):
+        start = time.time()
+        for i in range(number):
+            func()
+        best = min(best, time.time() - start)
+    return number, best / number
+
+
+def percentile(values, pct):
+    """Return the `pct` percentile of the sorted list `values`."""
+    if not values:
+        return None
+    return values[int(pct * (len(values)-1) / 100)]
+
+
+class Reporter(object):
+    """Collect benchmark results.
+
+    Results are printed in human readable form to stdout, and written as one
+    JSON object per line to `output` (if provided) so that they can be
+    compared across releases.
+    """
+
+    def __init__(self, output=None, filter=None):
+        self.output = output
+        self.filter = filter
+        self.results = []
+
+    def selected(self, name):
+        """Return whether the benchmark `name` should be run."""
+        return self.filter is None or fnmatch.fnmatch(name, self.filter)
+
+    def add(self, name, **fields):
+        result = { 'name': name,
+                   'python': platform.python_version(),
+                   'timestamp': int(time.time()) }
+        result.update(fields)
+        self.results.append(result)
+        if 'usec' in fields:
+            sys.stdout.write('%-40s %12.2f usec\n' % (name, fields['usec']))
+        else:
+            values = ['%s=%s' % (key, fields[key]) for key in sorted(fields)]
+            sys.stdout.write('%-40s %s\n' % (name, ' '.join(values)))
+        sys.stdout.flush()
+
+    def close(self):
+        if self.output is None:
+            return
+        with open(self.output, 'w') as fout:
+            for result in self.results:
+                fout.write(json.dumps(result, sort_keys=True))
+                fout.write('\n')
+
+
+def find_benchmarks():
+    """Return the names of all benchmark modules."""
+    dirname = os.path.dirname(__file__)
+    names = [ name[:-3] for name in os.listdir(dirname)
+              if name.startswith('bench_') and name.endswith('.py') ]
+    names.sort()
+    return ['tdbus.bench.%s' % name for name in names]
+
+
+def run_benchmarks(output=None, filter=None, repeat=3):
+    """Run all benchmark modules. Each module must provide a function
+    run(reporter, repeat)."""
+    reporter = Reporter(output, filter)
+    for name in find_benchmarks():
+        module = __import__(name, fromlist=['run'])
+        module.run(reporter, repeat)
+    reporter.close()
+    return reporter.results
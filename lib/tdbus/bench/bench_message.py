@@ -0,0 +1,121 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+# In-process benchmarks for the argument marshalling code. No bus is needed:
+# messages are created, filled with set_args() and read back with
+# get_args().
+
+from __future__ import division, absolute_import
+
+from tdbus import _tdbus
+from tdbus.bench.base import measure
+
+
+def nested_struct(depth, value):
+    if depth == 0:
+        return value
+    return (nested_struct(depth-1, value),)
+
+
+def string_array(size):
+    return ['string%d' % i for i in range(size)]
+
+def property_map(size):
+    props = {}
+    for i in range(size):
+        if i % 3 == 0:
+            props['Property%d' % i] = ('i', i)
+        elif i % 3 == 1:
+            props['Property%d' % i] = ('s', 'value%d' % i)
+        else:
+            props['Property%d' % i] = ('b', True)
+    return props
+
+def struct_array(size):
+    return [(i, 'string%d' % i) for i in range(size)]
+
+def plain_property_map(size):
+    """Like property_map() but with the variant signatures inferred."""
+    return dict((key, value[1]) for key, value in property_map(size).items())
+
+def managed_objects(size):
+    """A GetManagedObjects reply with `size` objects."""
+    return dict(('/com/example/object%d' % i,
+                 { 'com.example.Object': property_map(10) })
+                for i in range(size))
+
+
+# (name, format, size, args)
+cases = [
+    ('byte', 'y', 1, (10,)),
+    ('int32', 'i', 1, (10,)),
+    ('uint64', 't', 1, (0xffffffffffff,)),
+    ('double', 'd', 1, (1.5,)),
+    ('string', 's', 1, ('foo',)),
+    ('scalars', 'ybnqiuxtds', 10, (1, True, -2, 3, -4, 5, -6, 7, 8.5, 'foo')),
+    ('as', 'as', 10, (string_array(10),)),
+    ('as', 'as', 100, (string_array(100),)),
+    ('as', 'as', 1000, (string_array(1000),)),
+    ('a{sv}', 'a{sv}', 10, (property_map(10),)),
+    ('a{sv}', 'a{sv}', 100, (property_map(100),)),
+    ('a{sv}', 'a{sv}', 1000, (property_map(1000),)),
+    ('a{sv}.inferred', 'a{sv}', 100, (plain_property_map(100),)),
+    ('a(is)', 'a(is)', 100, (struct_array(100),)),
+    ('a(is).inferred', None, 100, (struct_array(100),)),
+    ('a{oa{sa{sv}}}', 'a{oa{sa{sv}}}', 100, (managed_objects(100),)),
+    ('struct', '(' * 8 + 'i' + ')' * 8, 8, (nested_struct(8, 1),)),
+    ('struct', '(' * 32 + 'i' + ')' * 32, 32, (nested_struct(32, 1),)),
+    ('ay', 'ay', 1024, ('x' * 1024,)),
+    ('ay', 'ay', 65536, ('x' * 65536,)),
+    ('ay', 'ay', 1048576, ('x' * 1048576,))
+]
+
+
+def new_message():
+    return _tdbus.Message(_tdbus.DBUS_MESSAGE_TYPE_METHOD_CALL, path='/',
+                          interface='com.example', member='Echo')
+
+
+def run(reporter, repeat):
+    name = 'message.new'
+    if reporter.selected(name):
+        number, best = measure(new_message, repeat)
+        reporter.add(name, operation='new', number=number, usec=1e6*best)
+
+    for (label, format, size, args) in cases:
+        name = 'message.set_args.%s.%d' % (label, size)
+        if reporter.selected(name):
+            def set_args():
+                new_message().set_args(format, args)
+            number, best = measure(set_args, repeat)
+            reporter.add(name, operation='set_args', signature=format,
+                         size=size, number=number, usec=1e6*best)
+        name = 'message.get_args.%s.%d' % (label, size)
+        if reporter.selected(name):
+            message = new_message()
+            message.set_args(format, args)
+            number, best = measure(message.get_args, repeat)
+            reporter.add(name, operation='get_args', signature=format,
+                         size=size, number=number, usec=1e6*best)
+
+    name = 'message.get_args.a{sv}.unwrap.100'
+    if reporter.selected(name):
+        message = new_message()
+        message.set_args('a{sv}', (property_map(100),))
+        number, best = measure(lambda: message.get_args(unwrap=True), repeat)
+        reporter.add(name, operation='get_args', signature='a{sv}', size=100,
+                     number=number, usec=1e6*best)
+
+    # Answering with a copy of a prepared reply, as ObjectManager does.
+    name = 'message.copy.a{oa{sa{sv}}}.100'
+    if reporter.selected(name):
+        message = new_message()
+        message.set_args('a{oa{sa{sv}}}', (managed_objects(100),))
+        number, best = measure(message.copy, repeat)
+        reporter.add(name, operation='copy', signature='a{oa{sa{sv}}}',
+                     size=100, number=number, usec=1e6*best)
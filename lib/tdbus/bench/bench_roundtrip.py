@@ -0,0 +1,200 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+# End-to-end benchmarks against a private dbus-daemon. An echo server and a
+# number of client connections are run in this process, and method call
+# throughput and latency, as well as signal throughput, are measured.
+
+from __future__ import division, absolute_import
+
+import sys
+import time
+from threading import Thread
+
+from tdbus import DBusHandler, method, signal_handler, SimpleDBusConnection
+from tdbus.bench.base import percentile
+from tdbus.test.bus import PrivateBus
+
+try:
+    import gevent
+    from gevent.event import Event
+    from tdbus.gevent import GEventDBusConnection
+except ImportError:
+    gevent = None
+
+IFACE_EXAMPLE = 'com.example'
+
+# Number of client connections to run concurrently.
+clients = [1, 4]
+
+# Number of method calls per client.
+calls = 2000
+
+# Number of signals to send.
+signals = 10000
+
+
+class EchoHandler(DBusHandler):
+
+    @method(interface=IFACE_EXAMPLE)
+    def Echo(self, message):
+        self.set_response(message.get_signature(), message.get_args())
+
+    @method(interface=IFACE_EXAMPLE)
+    def Stop(self, message):
+        self.connection.stop()
+
+
+class CountHandler(DBusHandler):
+
+    def __init__(self, count, done):
+        super(CountHandler, self).__init__()
+        self.count = count
+        self.received = 0
+        self.done = done
+
+    @signal_handler(interface=IFACE_EXAMPLE)
+    def Ping(self, message):
+        self.received += 1
+        if self.received == self.count:
+            self.done()
+
+
+def run_calls(conn, server_name, latencies):
+    for i in range(calls):
+        start = time.time()
+        conn.call_method('/', 'Echo', IFACE_EXAMPLE, 'is', (i, 'foo'),
+                         destination=server_name, timeout=10)
+        latencies.append(time.time() - start)
+
+
+def report_calls(reporter, name, nclients, elapsed, latencies):
+    latencies.sort()
+    usec = lambda pct: 1e6 * percentile(latencies, pct)
+    reporter.add(name, clients=nclients, calls=len(latencies),
+                 calls_per_sec=round(len(latencies) / elapsed, 1),
+                 p50_usec=round(usec(50), 1), p99_usec=round(usec(99), 1),
+                 p999_usec=round(usec(99.9), 1))
+
+
+def report_signals(reporter, name, count, elapsed):
+    reporter.add(name, signals=count,
+                 signals_per_sec=round(count / elapsed, 1))
+
+
+def bench_simple(reporter, address):
+    server = SimpleDBusConnection(address)
+    server.add_handler(EchoHandler())
+    server_name = server.get_unique_name()
+    server_thread = Thread(target=server.dispatch)
+    server_thread.start()
+
+    for nclients in clients:
+        name = 'roundtrip.simple.calls.%d' % nclients
+        if not reporter.selected(name):
+            continue
+        conns = [SimpleDBusConnection(address) for i in range(nclients)]
+        latencies = []
+        threads = [Thread(target=run_calls, args=(conn, server_name, latencies))
+                   for conn in conns]
+        start = time.time()
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        elapsed = time.time() - start
+        report_calls(reporter, name, nclients, elapsed, latencies)
+        for conn in conns:
+            conn.close()
+
+    for batched in (False, True):
+        name = 'roundtrip.simple.signals'
+        if batched:
+            name += '.batched'
+        if not reporter.selected(name):
+            continue
+        receiver = SimpleDBusConnection(address)
+        receiver.add_handler(CountHandler(signals, receiver.stop))
+        sender = SimpleDBusConnection(address)
+        if batched:
+            sender.enable_signal_batching([IFACE_EXAMPLE])
+        thread = Thread(target=receiver.dispatch)
+        thread.start()
+        receiver_name = receiver.get_unique_name()
+        start = time.time()
+        for i in range(signals):
+            sender.send_signal('/', 'Ping', IFACE_EXAMPLE, 'i', (i,),
+                               destination=receiver_name)
+        sender.flush_signals()
+        sender._connection.flush()
+        thread.join()
+        elapsed = time.time() - start
+        report_signals(reporter, name, signals, elapsed)
+        sender.close()
+        receiver.close()
+
+    client = SimpleDBusConnection(address)
+    client.call_method('/', 'Stop', IFACE_EXAMPLE, destination=server_name)
+    server_thread.join()
+    client.close()
+    server.close()
+
+
+def bench_gevent(reporter, address):
+    server = GEventDBusConnection(address)
+    server.add_handler(EchoHandler())
+    server_name = server.get_unique_name()
+
+    for nclients in clients:
+        name = 'roundtrip.gevent.calls.%d' % nclients
+        if not reporter.selected(name):
+            continue
+        conns = [GEventDBusConnection(address) for i in range(nclients)]
+        latencies = []
+        start = time.time()
+        greenlets = [gevent.spawn(run_calls, conn, server_name, latencies)
+                     for conn in conns]
+        gevent.joinall(greenlets)
+        elapsed = time.time() - start
+        report_calls(reporter, name, nclients, elapsed, latencies)
+        for conn in conns:
+            conn.close()
+
+    name = 'roundtrip.gevent.signals'
+    if reporter.selected(name):
+        done = Event()
+        receiver = GEventDBusConnection(address)
+        receiver.add_handler(CountHandler(signals, done.set))
+        sender = GEventDBusConnection(address)
+        receiver_name = receiver.get_unique_name()
+        start = time.time()
+        for i in range(signals):
+            sender.send_signal('/', 'Ping', IFACE_EXAMPLE, 'i', (i,),
+                               destination=receiver_name)
+        done.wait()
+        elapsed = time.time() - start
+        report_signals(reporter, name, signals, elapsed)
+        sender.close()
+        receiver.close()
+
+    server.close()
+
+
+def run(reporter, repeat):
+    bus = PrivateBus()
+    try:
+        address = bus.start()
+    except OSError:
+        sys.stderr.write('dbus-launch not found, skipping roundtrip benchmarks\n')
+        return
+    try:
+        bench_simple(reporter, address)
+        if gevent is not None:
+            bench_gevent(reporter, address)
+    finally:
+        bus.stop()
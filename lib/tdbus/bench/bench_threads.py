@@ -0,0 +1,111 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+# Multi-threaded throughput against a private dbus-daemon. In the "calls"
+# benchmarks every thread drives its own client and server connection. In
+# the "shared_send" benchmarks all threads send signals over one shared
+# connection.
+
+from __future__ import division, absolute_import
+
+import sys
+import time
+from threading import Thread
+
+from tdbus import SimpleDBusConnection
+from tdbus.test.bus import PrivateBus
+from tdbus.bench.bench_roundtrip import EchoHandler, CountHandler, IFACE_EXAMPLE
+
+# Number of threads.
+threads = [1, 2, 4]
+
+# Number of method calls per thread.
+calls = 2000
+
+# Number of signals per thread.
+signals = 5000
+
+
+def run_calls(address):
+    server = SimpleDBusConnection(address)
+    server.add_handler(EchoHandler())
+    server_name = server.get_unique_name()
+    server_thread = Thread(target=server.dispatch)
+    server_thread.start()
+    client = SimpleDBusConnection(address)
+    for i in range(calls):
+        client.call_method('/', 'Echo', IFACE_EXAMPLE, 'is', (i, 'foo'),
+                           destination=server_name, timeout=10)
+    client.call_method('/', 'Stop', IFACE_EXAMPLE, destination=server_name)
+    server_thread.join()
+    client.close()
+    server.close()
+
+
+def run_signals(sender, receiver_name):
+    for i in range(signals):
+        sender.send_signal('/', 'Ping', IFACE_EXAMPLE, 'i', (i,),
+                           destination=receiver_name)
+
+
+def bench_calls(reporter, address, nthreads):
+    name = 'threads.calls.%d' % nthreads
+    if not reporter.selected(name):
+        return
+    workers = [Thread(target=run_calls, args=(address,)) for i in range(nthreads)]
+    start = time.time()
+    for worker in workers:
+        worker.start()
+    for worker in workers:
+        worker.join()
+    elapsed = time.time() - start
+    reporter.add(name, threads=nthreads, calls=nthreads*calls,
+                 calls_per_sec=round(nthreads*calls / elapsed, 1))
+
+
+def bench_shared_send(reporter, address, nthreads):
+    name = 'threads.shared_send.%d' % nthreads
+    if not reporter.selected(name):
+        return
+    count = nthreads * signals
+    receiver = SimpleDBusConnection(address)
+    receiver.add_handler(CountHandler(count, receiver.stop))
+    receiver_thread = Thread(target=receiver.dispatch)
+    receiver_thread.start()
+    sender = SimpleDBusConnection(address)
+    receiver_name = receiver.get_unique_name()
+    workers = [Thread(target=run_signals, args=(sender, receiver_name))
+               for i in range(nthreads)]
+    start = time.time()
+    for worker in workers:
+        worker.start()
+    for worker in workers:
+        worker.join()
+    sender._connection.flush()
+    receiver_thread.join()
+    elapsed = time.time() - start
+    reporter.add(name, threads=nthreads, signals=count,
+                 signals_per_sec=round(count / elapsed, 1))
+    sender.close()
+    receiver.close()
+
+
+def run(reporter, repeat):
+    bus = PrivateBus()
+    try:
+        address = bus.start()
+    except OSError:
+        sys.stderr.write('dbus-launch not found, skipping thread benchmarks\n')
+        return
+    try:
+        for nthreads in threads:
+            bench_calls(reporter, address, nthreads)
+        for nthreads in threads:
+            bench_shared_send(reporter, address, nthreads)
+    finally:
+        bus.stop()
@@ -8,64 +8,387 @@
 
 import sys
 import logging
+import threading
 import traceback
 from tdbus import _tdbus
+from tdbus.batch import SignalBatcher, is_batch, unpack
 
 DBusError = _tdbus.Error
+WouldBlock = _tdbus.WouldBlock
 
 
 class DBusConnection(object):
     """A connection to the D-BUS."""
 
     Loop = None
+    Server = None
+    Event = threading.Event
+    get_current = staticmethod(threading.current_thread)
 
-    def __init__(self, address):
-        """Create a new connection."""
+    def __init__(self, address, register=True):
+        """Create a new connection.
+
+        The `address` argument is a D-BUS address, or a _tdbus.Connection
+        that was accepted by a server. If `register` is False, the connection
+        is not registered with a message bus, which is needed to connect
+        directly to a peer (see DBusServer).
+        """
         if self.Loop is None:
             raise NotImplementedError('cannot create Connection without a Loop')
-        self._connection = _tdbus.Connection(address)
+        if isinstance(address, _tdbus.Connection):
+            self._connection = address
+        else:
+            self._connection = _tdbus.Connection(address, register)
         self._connection.set_loop(self.Loop(self._connection))
         self._connection.add_filter(self._dispatch)
         self.handlers = []
         self.logger = logging.getLogger('tdbus')
+        self._server = None
+        self._peers = None
+        self._peer_rules = None
+        self._names = None
+        self._credentials = None
+        self._batcher = None
 
     def add_handler(self, handler):
         """Add a new method/signal handler for this connection."""
         self.handlers.append(handler)
+        if self._server is not None:
+            self._server.add_handler(handler)
+
+    def remove_handler(self, handler):
+        """Remove a handler that was added with add_handler()."""
+        self.handlers.remove(handler)
+        if self._server is not None:
+            self._server.remove_handler(handler)
+            for peer in self.get_peer_connections():
+                if handler in peer.handlers:
+                    peer.handlers.remove(handler)
 
-    def open(self, address):
-        self._connection.open(address)
+    def open(self, address, register=True):
+        self._connection.open(address, register)
 
     def close(self):
         """Close the connection."""
+        if self._batcher is not None:
+            self._batcher.flush()
+        if self._server is not None:
+            for peer in self._peers.values():
+                if peer is not None:
+                    peer.close()
+            self._server.close()
+            self._server = None
+            self._peers = None
+            self._peer_rules = None
         self._connection.close()
 
+    def can_send_type(self, type):
+        """Return whether values of the D-BUS type `type` can be sent over
+        this connection. Use this to check for file descriptor passing
+        ("h")."""
+        return self._connection.can_send_type(type)
+
+    def get_is_connected(self):
+        """Return whether the connection is still connected."""
+        return self._connection.get_is_connected()
+
     def get_unique_name(self):
         """Return the unique connection name."""
         return self._connection.get_unique_name()
 
+    def get_stats(self):
+        """Return a dictionary with transport statistics."""
+        return self._connection.get_stats()
+
+    def reset_stats(self):
+        """Reset the transport statistics."""
+        self._connection.reset_stats()
+
+    def set_latency_tracking(self, enabled):
+        """Enable or disable per method latency histograms. On the server
+        side, latency is measured from receiving a method call until its
+        reply is sent. On the client side, it is measured from sending a
+        method call until its reply is received."""
+        self._connection.set_latency_tracking(enabled)
+
+    def get_latency_histograms(self):
+        """Return the latency histograms as a dictionary, keyed by
+        (side, interface, member) tuples. Side is either "client" or
+        "server"."""
+        return self._connection.get_latency_histograms()
+
+    def set_outgoing_limits(self, high, low=None, high_fds=0, low_fds=None):
+        """Bound the outgoing queue.
+
+        When a method call or signal would take the queue past `high` bytes
+        or `high_fds` file descriptors, it is not queued, and neither are
+        later ones until the queue has drained to `low` bytes and `low_fds`
+        file descriptors. These default to half the high water marks. A
+        message is always queued when the queue is at the low water marks,
+        so that messages larger than the difference still go out.
+        Meanwhile, call_method() and send_signal() call wait_writable().
+        Replies are always queued. A high water mark of 0 disables that
+        limit.
+        """
+        if low is None:
+            low = high // 2
+        if low_fds is None:
+            low_fds = high_fds // 2
+        self._connection.set_outgoing_limits(high, low, high_fds, low_fds)
+        self._connection.set_writable_callback(self.writable_again)
+
+    def writable_again(self):
+        """Called from the event loop when the outgoing queue has drained
+        to the low water mark after a message was refused. Can be overridden
+        in a subclass."""
+
+    def wait_writable(self):
+        """Wait until method calls and signals can be queued again. This
+        base class has no event loop to wait for and raises WouldBlock."""
+        raise WouldBlock('outgoing queue is full')
+
+    def _send(self, message):
+        while True:
+            try:
+                return self._connection.send(message)
+            except WouldBlock:
+                self.wait_writable()
+
+    def _send_with_reply(self, message, timeout):
+        while True:
+            try:
+                return self._connection.send_with_reply(message, timeout)
+            except WouldBlock:
+                self.wait_writable()
+
+    def enable_peer_upgrade(self, address='unix:tmpdir=/tmp'):
+        """Move traffic with other tdbus connections to direct connections.
+
+        When enabled, this connection listens on `address`. Method calls
+        and signals to a destination that has peer upgrades enabled as well
+        are sent over a direct connection to it, instead of through the
+        message bus. If the direct connection goes away, traffic falls back
+        to the bus. Note that messages received over a direct connection do
+        not have a sender.
+
+        Messages can be reordered during the switch. Messages to a
+        destination go through the bus until its direct connection is set
+        up, and then over the direct connection, so a message sent after
+        the switch can arrive before one sent just before it. The same
+        applies when traffic falls back to the bus. Messages to the bus
+        itself never use a direct connection.
+        """
+        from tdbus.peer import PeerHandler
+        if self.Server is None:
+            raise NotImplementedError('cannot enable peer upgrade without a Server')
+        if self._server is not None:
+            return
+        self._server = self.Server(address)
+        self._peers = {}
+        self._peer_rules = set()
+        self.add_handler(PeerHandler(self))
+        for handler in self.handlers[:-1]:
+            self._server.add_handler(handler)
+
+    def enable_name_tracking(self):
+        """Keep a map of the owners of all names on the bus.
+
+        The map is loaded with ListNames and kept up to date with
+        NameOwnerChanged, so that get_name_owner() and name_has_owner()
+        need no round trips to the bus. Enabling is a blocking call, so the
+        connection must return replies from call_method().
+        """
+        from tdbus.names import NameOwnerTracker
+        if self._names is not None:
+            return
+        self._names = NameOwnerTracker(self)
+        self.add_handler(self._names)
+        self._names.start()
+
+    def _get_names(self):
+        if self._names is None:
+            raise DBusError('name tracking is not enabled')
+        return self._names
+
+    def get_name_owner(self, name):
+        """Return the unique name of the owner of `name`, or None if it has
+        no owner. Requires name tracking."""
+        return self._get_names().get_name_owner(name)
+
+    def name_has_owner(self, name):
+        """Return whether `name` has an owner. Requires name tracking."""
+        return name in self._get_names().owners
+
+    def add_name_owner_callback(self, callback, name=None):
+        """Call callback(name, old_owner, new_owner) when the owner of `name`
+        changes, or of any name if `name` is None. Requires name tracking."""
+        self._get_names().add_callback(callback, name)
+
+    def remove_name_owner_callback(self, callback, name=None):
+        """Remove a callback added with add_name_owner_callback()."""
+        self._get_names().remove_callback(callback, name)
+
+    def get_credentials(self, sender):
+        """Return the credentials of the bus connection `sender`, as
+        returned by GetConnectionCredentials: a dictionary with keys like
+        "UnixUserID" and "ProcessID".
+
+        Credentials are cached per unique name until the name disappears
+        from the bus, and concurrent lookups for the same name share one
+        request. This is a blocking call, so the connection must return
+        replies from call_method().
+        """
+        if self._credentials is None:
+            from tdbus.credentials import CredentialsCache
+            self._credentials = CredentialsCache(self)
+            self.add_handler(self._credentials)
+            self._credentials.start()
+        return self._credentials.get_credentials(sender)
+
+    def enable_signal_batching(self, interfaces=None, max_size=65536, delay=0.005):
+        """Send signals in batches.
+
+        Signals on `interfaces`, or on all interfaces if it is None, are
+        queued per interface and destination, and sent as one message when
+        the queue reaches `max_size` bytes or `delay` seconds after the first
+        signal was queued. Queues are sent from the event loop (see
+        call_later()), by flush_signals() and by close(). Batched signals can
+        overtake other messages.
+
+        The receivers must be tdbus connections. They unpack batches without
+        configuration, and their handlers see the individual signals.
+        Receivers must not match on the path or member of these signals.
+        """
+        if self._batcher is not None:
+            self._batcher.flush()
+        self._batcher = SignalBatcher(self, interfaces, max_size, delay)
+
+    def flush_signals(self):
+        """Send the signals that are queued for batching now."""
+        if self._batcher is not None:
+            self._batcher.flush()
+
+    def get_peer(self, destination):
+        """Return the direct connection to `destination`, or None if there
+        is none (yet)."""
+        if self._peers is None:
+            return None
+        peer = self._peers.get(destination)
+        if peer is None:
+            return None
+        if not peer.get_is_connected():
+            self._drop_peer(destination)
+            return None
+        return peer
+
+    def get_peer_connections(self):
+        """Return a list of all direct connections."""
+        if self._server is None:
+            return []
+        peers = set(peer for peer in self._peers.values() if peer is not None)
+        peers.update(self._server.connections)
+        return [ peer for peer in peers if peer.get_is_connected() ]
+
+    def _drop_peer(self, destination):
+        if self._peers is None:
+            return
+        peer = self._peers.pop(destination, None)
+        if peer is not None and peer is not self:
+            peer.close()
+        if destination in self._peer_rules:
+            self._peer_rules.remove(destination)
+            self._peer_match('RemoveMatch', destination)
+
+    def _peer_match(self, member, destination):
+        # Add or remove the match rule for NameOwnerChanged of `destination`.
+        rule = "type='signal',interface='%s',member='NameOwnerChanged'," \
+               "arg0='%s'" % (_tdbus.DBUS_INTERFACE_DBUS, destination)
+        DBusConnection.call_method(self, _tdbus.DBUS_PATH_DBUS, member,
+                                   _tdbus.DBUS_INTERFACE_DBUS, 's', (rule,),
+                                   destination=_tdbus.DBUS_SERVICE_DBUS)
+
+    def _route(self, destination):
+        """Return the connection to use for sending a message to
+        `destination`. Starts a peer upgrade for new destinations."""
+        if destination is None or self._peers is None or \
+                destination == _tdbus.DBUS_SERVICE_DBUS:
+            return self
+        if destination not in self._peers:
+            self._negotiate_peer(destination)
+            return self
+        peer = self.get_peer(destination)
+        if peer is None:
+            return self
+        return peer
+
+    def _negotiate_peer(self, destination):
+        from tdbus.peer import PATH_PEER, IFACE_PEER
+        # Mark the destination as pending (or not upgradable) until the
+        # reply comes in.
+        self._peers[destination] = None
+        def _peer_address_callback(reply):
+            if self._peers is None or reply.get_type() == _tdbus.DBUS_MESSAGE_TYPE_ERROR:
+                return
+            address = reply.get_args()[0]
+            try:
+                peer = type(self)(address, register=False)
+            except DBusError:
+                return
+            for handler in self.handlers:
+                peer.add_handler(handler)
+            DBusConnection.call_method(peer, PATH_PEER, 'SetPeerName', IFACE_PEER,
+                                       's', (self.get_unique_name(),))
+            self._peers[destination] = peer
+            if not destination.startswith(':') and \
+                    destination not in self._peer_rules:
+                # Fall back to the bus when a well-known name changes owner.
+                # The rule is removed again when the peer is dropped.
+                self._peer_rules.add(destination)
+                self._peer_match('AddMatch', destination)
+        # Do not start a service just to ask it for its address.
+        message = _tdbus.Message(_tdbus.DBUS_MESSAGE_TYPE_METHOD_CALL,
+                                 path=PATH_PEER, member='GetPeerAddress',
+                                 interface=IFACE_PEER, destination=destination,
+                                 auto_start=False)
+        deferred = self._send_with_reply(message, 5000)
+        deferred.set_notify(_peer_address_callback)
+
     def send_method_return(self, message, format=None, args=None):
         """Send a method call return."""
         reply = _tdbus.Message(_tdbus.DBUS_MESSAGE_TYPE_METHOD_RETURN,
                                reply_serial=message.get_serial(),
                                destination=message.get_sender())
-        if format is not None:
+        if format is not None or args is not None:
             reply.set_args(format, args)
-        self._connection.send(reply)
+        self._connection.send(reply, message)
+
+    def send_method_return_message(self, message, reply):
+        """Send a copy of the prepared method return `reply` as the reply
+        to `message`."""
+        reply = reply.copy()
+        reply.set_reply_serial(message.get_serial())
+        sender = message.get_sender()
+        if sender is not None:
+            reply.set_destination(sender)
+        self._connection.send(reply, message)
 
     def send_error(self, message, error_name, format=None, args=None):
         """Send an error reply."""
-        reply = _tdbus.Message(_tbus.DBUS_MESSAGE_TYPE_ERROR,
+        reply = _tdbus.Message(_tdbus.DBUS_MESSAGE_TYPE_ERROR,
                                reply_serial=message.get_serial(),
                                destination=message.get_sender(),
                                error_name=error_name)
-        if format is not None:
+        if format is not None or args is not None:
             reply.set_args(format, args)
-        self._connection.send(reply)
+        self._connection.send(reply, message)
 
     def send_signal(self, path, member, interface=None, format=None, args=None,
                     destination=None):
         """Send a signal."""
+        connection = self._route(destination)
+        if connection is not self:
+            connection.send_signal(path, member, interface, format, args)
+            return
         if '.' in member:
             member, interface = self._split_member(member)
         if interface is None:
@@ -74,14 +397,24 @@ class DBusConnection(object):
                                  member=member, interface=interface, path=path)
         if destination is not None:
             message.set_destination(destination)
-        if format is not None:
+        if format is not None or args is not None:
             message.set_args(format, args)
-        self._connection.send(message)
+        if self._batcher is not None and self._batcher.wants(interface):
+            self._batcher.add(message, interface, destination)
+            return
+        self._send(message)
 
     def _dispatch(self, message):
         """Dispatch a message. This is installed as a filter into libdbus so
         it gets called on all incoming messages."""
+        if is_batch(message):
+            for signal in unpack(message):
+                self._dispatch(signal)
+            return True
         for handler in self.handlers:
+            if getattr(handler, 'coalescing', False) and \
+                    handler.coalesce_signal(self, message):
+                continue
             self.spawn(handler.dispatch, self, message)
         return True
 
@@ -95,21 +428,34 @@ class DBusConnection(object):
             for line in lines:
                 self.logger.error(line)
 
+    def call_later(self, delay, callback):
+        """Call `callback` from the event loop after `delay` seconds, or
+        after the current loop iteration if `delay` is 0. This base class has
+        no event loop and calls it right away."""
+        callback()
+
     def call_method(self, path, member, interface=None, format=None, args=None,
                     destination=None, callback=None, timeout=None):
-        """Call a method."""
+        """Call a method. With a `callback`, the _tdbus.PendingCall for the
+        reply is returned."""
+        connection = self._route(destination)
+        if connection is not self:
+            return DBusConnection.call_method(connection, path, member,
+                                              interface, format, args,
+                                              callback=callback, timeout=timeout)
         message = _tdbus.Message(_tdbus.DBUS_MESSAGE_TYPE_METHOD_CALL,
                                  path=path, member=member, interface=interface,
                                  destination=destination)
-        if format is not None:
+        if format is not None or args is not None:
             message.set_args(format, args)
         if callback is None:
             message.set_no_reply(True)
-            self._connection.send(message)
+            self._send(message)
         else:
             if timeout is None:
                 timeout = -1
             else:
                 timeout = int(1000 * timeout)
-            deferred = self._connection.send_with_reply(message, timeout)
+            deferred = self._send_with_reply(message, timeout)
             deferred.set_notify(callback)
+            return deferred
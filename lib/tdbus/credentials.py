@@ -0,0 +1,104 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+# Peer credentials cache.
+#
+# The credentials of a connection on the bus (its uid, pid, etc.) cannot
+# change while it is connected, and unique names are never reused. So the
+# result of GetConnectionCredentials can be cached per unique name until
+# the bus says that the name has gone away, which it does with a
+# NameOwnerChanged signal that has an empty new owner.
+#
+# A lookup that is in flight is shared: other threads or greenlets that
+# want the same credentials wait for it, using the Event type of the
+# connection. A lookup for the same name from the task that started it
+# (which can happen when handlers run while a blocking call waits for its
+# reply) sends its own request instead of waiting for itself.
+
+from __future__ import division, absolute_import
+
+from tdbus import _tdbus
+from tdbus.connection import DBusError
+from tdbus.handler import DBusHandler, signal_handler
+
+MATCH_NAME_LOST = "type='signal',sender='%s',interface='%s'," \
+                  "member='NameOwnerChanged',arg2=''" \
+                  % (_tdbus.DBUS_SERVICE_DBUS, _tdbus.DBUS_INTERFACE_DBUS)
+
+
+class _Lookup(object):
+
+    def __init__(self, owner):
+        self.event = owner.Event()
+        self.task = owner.get_current()
+        self.credentials = None
+        self.error = None
+        self.gone = False
+
+
+class CredentialsCache(DBusHandler):
+    """Caches the credentials of the connections on the bus of `owner`,
+    which is a DBusConnection. See DBusConnection.get_credentials()."""
+
+    def __init__(self, owner):
+        super(CredentialsCache, self).__init__()
+        self.owner = owner
+        self.credentials = {}
+        self._pending = {}
+
+    def _bus_call(self, member, format, args):
+        reply = self.owner.call_method(_tdbus.DBUS_PATH_DBUS, member,
+                                       _tdbus.DBUS_INTERFACE_DBUS, format, args,
+                                       destination=_tdbus.DBUS_SERVICE_DBUS)
+        return reply.get_args(unwrap=True)
+
+    def start(self):
+        """Add the match rule for names that go away."""
+        self._bus_call('AddMatch', 's', (MATCH_NAME_LOST,))
+
+    def get_credentials(self, sender):
+        """Return the credentials of `sender`."""
+        credentials = self.credentials.get(sender)
+        if credentials is not None:
+            return credentials
+        # setdefault() checks and registers the lookup in one step, so that
+        # only one task sends the request.
+        lookup = _Lookup(self.owner)
+        existing = self._pending.setdefault(sender, lookup)
+        if existing is not lookup and existing.task is not lookup.task:
+            existing.event.wait()
+            if existing.error is not None:
+                raise DBusError(existing.error)
+            return existing.credentials
+        try:
+            credentials = self._bus_call('GetConnectionCredentials', 's', (sender,))[0]
+            lookup.credentials = credentials
+        except DBusError as e:
+            lookup.error = e[0]
+            raise
+        finally:
+            if self._pending.get(sender) is lookup:
+                del self._pending[sender]
+            lookup.event.set()
+        # Well-known names can move to another connection, so only unique
+        # names are cached.
+        if sender.startswith(':') and not lookup.gone:
+            self.credentials[sender] = credentials
+        return credentials
+
+    @signal_handler(interface=_tdbus.DBUS_INTERFACE_DBUS)
+    def NameOwnerChanged(self, message):
+        if message.get_sender() != _tdbus.DBUS_SERVICE_DBUS:
+            return
+        name, old_owner, new_owner = message.get_args()
+        if new_owner:
+            return
+        self.credentials.pop(name, None)
+        lookup = self._pending.get(name)
+        if lookup is not None:
+            lookup.gone = True
@@ -9,12 +9,14 @@
 from __future__ import division, absolute_import
 
 import gevent
+import gevent.event
 from gevent import core, local
 from gevent.hub import get_hub, Waiter
 
 from tdbus import _tdbus
 from tdbus.loop import EventLoop
 from tdbus.connection import DBusConnection, DBusError
+from tdbus.server import DBusServer
 
 
 class GEventLoop(EventLoop):
@@ -56,6 +58,8 @@ class GEventLoop(EventLoop):
         if evtype & core.WRITE:
             flags |= _tdbus.DBUS_WATCH_WRITABLE
         watch.handle(flags)
+        if flags & _tdbus.DBUS_WATCH_WRITABLE:
+            self._connection.check_writable()
         self._hub.loop.run_callback(self._handle_dispatch, self._connection)
 
     def add_timeout(self, timeout):
@@ -94,17 +98,28 @@ class GEventLoop(EventLoop):
             connection.dispatch()
 
 
+class GEventServerLoop(GEventLoop):
+    """Integration of a server with the GEvent event loop. A server only
+    accepts connections and has no messages to dispatch."""
+
+    def _handle_dispatch(self, server):
+        pass
+
+
 class GEventDBusConnection(DBusConnection):
 
     Loop = GEventLoop
     Local = local.local
+    Event = gevent.event.Event
+    get_current = staticmethod(gevent.getcurrent)
 
     def call_method(self, *args, **kwargs):
-        """Call a method."""
+        """Call a method. With a `callback`, the _tdbus.PendingCall for
+        the reply is returned right away. Otherwise the current greenlet
+        waits for the reply, which is returned."""
         callback = kwargs.get('callback')
         if callback is not None:
-            super(GEventDBusConnection, self).call_method(*args, **kwargs)
-            return
+            return super(GEventDBusConnection, self).call_method(*args, **kwargs)
         waiter = Waiter()
         def _gevent_callback(message):
             waiter.switch(message)
@@ -115,5 +130,35 @@ class GEventDBusConnection(DBusConnection):
             raise DBusError(reply.get_error_name())
         return reply
 
+    _writable = None
+
+    def writable_again(self):
+        event, self._writable = self._writable, None
+        if event is not None:
+            event.set()
+
+    def wait_writable(self):
+        """Wait, without blocking other greenlets, until the outgoing queue
+        has drained."""
+        while not self._connection.check_writable():
+            if self._writable is None:
+                self._writable = gevent.event.Event()
+            self._writable.wait()
+
     def spawn(self, handler, *args):
         gevent.spawn(handler, *args)
+
+    def call_later(self, delay, callback):
+        if delay == 0:
+            get_hub().loop.run_callback(callback)
+        else:
+            gevent.spawn_later(delay, callback)
+
+
+class GEventDBusServer(DBusServer):
+
+    Loop = GEventServerLoop
+    Connection = GEventDBusConnection
+
+
+GEventDBusConnection.Server = GEventDBusServer
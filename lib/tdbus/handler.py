@@ -9,10 +9,13 @@
 import sys
 import logging
 import fnmatch
+import threading
 import traceback
 
 from tdbus import _tdbus, DBusError
 
+IFACE_PROPERTIES = 'org.freedesktop.DBus.Properties'
+
 
 def method(path=None, member=None, interface=None):
     def _decorate(func):
@@ -23,32 +26,84 @@ def method(path=None, member=None, interface=None):
         return func
     return _decorate
  
-def signal_handler(path=None, member=None, interface=None):
+def signal_handler(path=None, member=None, interface=None, coalesce=None,
+                   key=None):
+    """Decorate a signal handler. With `coalesce`, signals are held back
+    for that many seconds, and only the latest one with the same sender,
+    path, interface and member, and if `key` is given the same argument
+    number `key`, is passed to the handler. The others are dropped."""
     def _decorate(func):
         func.signal_handler = True
         func.member = member or func.__name__
         func.path = path
         func.interface = interface
+        func.coalesce = coalesce
+        func.coalesce_key = key
         return func
     return _decorate
 
 
+class dbus_property(object):
+    """Declare a property of type `signature` on `interface` in the body of
+    a DBusHandler subclass. `access` is "read", "write" or "readwrite".
+
+    The value is read and set as an attribute of the handler. Setting it
+    records a change, see DBusHandler.export_properties().
+    """
+
+    def __init__(self, signature, interface, access='read', name=None,
+                 default=None):
+        if access not in ('read', 'write', 'readwrite'):
+            raise ValueError('illegal access: %s' % access)
+        self.signature = signature
+        self.interface = interface
+        self.access = access
+        self.member = name
+        self.default = default
+
+    def __get__(self, obj, cls):
+        if obj is None:
+            return self
+        return obj._property_values.get((self.interface, self.member),
+                                        self.default)
+
+    def __set__(self, obj, value):
+        obj.set_property(self.member, value, self.interface)
+
+
 class DBusHandler(object):
     """Handler for method calls and signals."""
 
     def __init__(self):
         self.methods = {}
+        self.property_methods = {}
         self.signal_handlers = {}
+        self.properties = {}
         self.logger = logging.getLogger('tdbus')
+        self._property_values = {}
+        self._exported = None
         self._init_handlers()
+        self.coalescing = any(getattr(handler, 'coalesce', None) is not None
+                              for handler in self.signal_handlers.values())
+        if self.coalescing:
+            self._held = {}
+            self._held_lock = threading.Lock()
 
     def _init_handlers(self):
-        for name in vars(self.__class__):
-            handler = getattr(self, name)
-            if getattr(handler, 'method', False):
-                self.methods[handler.member] = handler
-            elif getattr(handler, 'signal_handler', False):
-                self.signal_handlers[handler.member] = handler
+        # Walk the MRO so that handlers are inherited, with handlers in
+        # subclasses overriding those in base classes.
+        for cls in reversed(self.__class__.__mro__):
+            for name, value in vars(cls).items():
+                if getattr(value, 'method', False):
+                    handler = getattr(self, name)
+                    self.methods[handler.member] = handler
+                elif getattr(value, 'signal_handler', False):
+                    handler = getattr(self, name)
+                    self.signal_handlers[handler.member] = handler
+                elif isinstance(value, dbus_property):
+                    if value.member is None:
+                        value.member = name
+                    self.properties[(value.interface, value.member)] = value
 
     def _get_connection(self):
         return self.local.connection
@@ -60,10 +115,178 @@ class DBusHandler(object):
 
     message = property(_get_message)
 
+    def get_sender_credentials(self):
+        """Return the credentials of the sender of the current message.
+        See DBusConnection.get_credentials()."""
+        sender = self.message.get_sender()
+        if sender is None:
+            raise DBusError('message has no sender')
+        return self.connection.get_credentials(sender)
+
     def set_response(self, format, args):
-        """Used by method call handlers to set the response arguments."""
+        """Used by method call handlers to set the response arguments. If
+        `format` is None, the signature is inferred from `args`."""
         self.local.response = (format, args)
 
+    def set_response_message(self, reply):
+        """Used by method call handlers to respond with a prepared method
+        return message. A copy of `reply` is sent, so the same message can be
+        used for many calls without marshalling its arguments again."""
+        self.local.response = reply
+
+    def _match(self, handlers, message):
+        handler = handlers.get(message.get_member())
+        if handler is None:
+            return None
+        if handler.interface and handler.interface != message.get_interface():
+            return None
+        if handler.path and not fnmatch.fnmatch(message.get_path(), handler.path):
+            return None
+        return handler
+
+    def export_properties(self, connection, path, interval=0):
+        """Export the declared properties as the object at `path`.
+
+        Get, GetAll and Set calls for that object are answered from the
+        handler. Changes are collected per interface and sent on
+        `connection` as one PropertiesChanged signal per interface, after
+        the current loop iteration or, with an `interval`, at most once per
+        `interval` seconds. See DBusConnection.call_later().
+
+        The Get, GetAll and Set handlers are kept apart from the methods of
+        the handler, so methods with the same names on other interfaces
+        still work. A handler that implements the properties interface
+        itself cannot export its properties.
+        """
+        for handler in self.methods.values():
+            if handler.interface == IFACE_PROPERTIES:
+                raise ValueError('%s already implements %s'
+                                 % (self.__class__.__name__, IFACE_PROPERTIES))
+        self._exported = (connection, path, interval)
+        self._changed = {}
+        self._flush_pending = False
+        self._property_lock = threading.Lock()
+        def wrap(member, func):
+            return method(path, member, IFACE_PROPERTIES)(
+                        lambda message: func(message))
+        self.property_methods = {
+            'Get': wrap('Get', self._get_property),
+            'GetAll': wrap('GetAll', self._get_all_properties),
+            'Set': wrap('Set', self._set_property) }
+
+    def _find_property(self, name, interface=None):
+        if interface is not None:
+            prop = self.properties.get((interface, name))
+        else:
+            found = [ prop for prop in self.properties.values()
+                      if prop.member == name ]
+            prop = found[0] if len(found) == 1 else None
+        if prop is None:
+            raise DBusError('org.freedesktop.DBus.Error.UnknownProperty')
+        return prop
+
+    def get_property(self, name, interface=None):
+        """Return the value of the declared property `name`. The
+        `interface` is needed if more than one interface has the name."""
+        prop = self._find_property(name, interface)
+        return self._property_values.get((prop.interface, name), prop.default)
+
+    def set_property(self, name, value, interface=None):
+        """Set the value of the declared property `name`. If the properties
+        are exported and the value changes, a change is recorded."""
+        prop = self._find_property(name, interface)
+        interface = prop.interface
+        key = (interface, name)
+        if key in self._property_values and self._property_values[key] == value:
+            return
+        self._property_values[key] = value
+        if self._exported is None:
+            return
+        connection, path, interval = self._exported
+        with self._property_lock:
+            self._changed.setdefault(interface, {})[name] = (prop.signature, value)
+            if self._flush_pending:
+                return
+            self._flush_pending = True
+        connection.call_later(interval, self.flush_properties)
+
+    def flush_properties(self):
+        """Send the recorded changes now."""
+        connection, path, interval = self._exported
+        with self._property_lock:
+            changed, self._changed = self._changed, {}
+            self._flush_pending = False
+        for interface, values in changed.items():
+            connection.send_signal(path, 'PropertiesChanged', IFACE_PROPERTIES,
+                                   'sa{sv}as', (interface, values, []))
+
+    def _get_property(self, message):
+        interface, name = message.get_args()
+        prop = self._find_property(name, interface)
+        if prop.access == 'write':
+            raise DBusError('org.freedesktop.DBus.Error.AccessDenied')
+        self.set_response('v', ((prop.signature, self.get_property(name, interface)),))
+
+    def _get_all_properties(self, message):
+        interface = message.get_args()[0]
+        values = {}
+        for (pinterface, name), prop in self.properties.items():
+            if pinterface == interface and prop.access != 'write':
+                values[name] = (prop.signature, self.get_property(name, interface))
+        self.set_response('a{sv}', (values,))
+
+    def _set_property(self, message):
+        interface, name, (signature, value) = message.get_args()
+        prop = self._find_property(name, interface)
+        if prop.access == 'read':
+            raise DBusError('org.freedesktop.DBus.Error.PropertyReadOnly')
+        if signature != prop.signature:
+            raise DBusError('org.freedesktop.DBus.Error.InvalidArgs')
+        self.set_property(name, value, interface)
+
+    def coalesce_signal(self, connection, message):
+        """Hold back `message` if it is a signal for a coalescing signal
+        handler. Returns True if it was held back, in which case the latest
+        signal with the same key is dispatched later. This is called by the
+        connection before it spawns the handler."""
+        if message.get_type() != _tdbus.DBUS_MESSAGE_TYPE_SIGNAL:
+            return False
+        handler = self._match(self.signal_handlers, message)
+        if handler is None or getattr(handler, 'coalesce', None) is None:
+            return False
+        key = (message.get_sender(), message.get_path(),
+               message.get_interface(), message.get_member())
+        if handler.coalesce_key is not None:
+            args = message.get_args()
+            if handler.coalesce_key < len(args):
+                arg = args[handler.coalesce_key]
+                try:
+                    hash(arg)
+                except TypeError:
+                    arg = repr(arg)
+                key += (arg,)
+        with self._held_lock:
+            first = key not in self._held
+            self._held[key] = (connection, message)
+        if first:
+            connection.call_later(handler.coalesce,
+                                  lambda: self._release_signal(key))
+        return True
+
+    def _release_signal(self, key):
+        with self._held_lock:
+            connection, message = self._held.pop(key)
+        connection.spawn(self.dispatch, connection, message)
+
+    def get_method(self, message):
+        """Return the method handler for the method call `message`, or None
+        if this handler does not implement it."""
+        if message.get_interface() == IFACE_PROPERTIES:
+            handler = self._match(self.property_methods, message)
+            if handler is not None:
+                return handler
+        return self._match(self.methods, message)
+
     def dispatch(self, connection, message):
         """Dispatch a message. Returns True if the message was dispatched."""
         if not hasattr(self, 'local'):
@@ -72,14 +295,9 @@ class DBusHandler(object):
         self.local.message = message
         self.local.response = (None, None)
         mtype = message.get_type()
-        member = message.get_member()
         if mtype == _tdbus.DBUS_MESSAGE_TYPE_METHOD_CALL:
-            if member not in self.methods:
-                return False
-            handler = self.methods[member]
-            if handler.interface and handler.interface != message.get_interface():
-                return False
-            if handler.path and not fnmatch.fnmatch(message.get_path(), handler.path):
+            handler = self.get_method(message)
+            if handler is None:
                 return False
             try:
                 ret = handler(message)
@@ -92,15 +310,15 @@ class DBusHandler(object):
                     self.logger.error(line)
                 self.connection.send_error(message, 'UncaughtException')
             else:
-                fmt, args = self.local.response
-                self.connection.send_method_return(message, fmt, args)
+                response = self.local.response
+                if isinstance(response, _tdbus.Message):
+                    self.connection.send_method_return_message(message, response)
+                else:
+                    fmt, args = response
+                    self.connection.send_method_return(message, fmt, args)
         elif mtype == _tdbus.DBUS_MESSAGE_TYPE_SIGNAL:
-            if member not in self.signal_handlers:
-                return False
-            handler = self.signal_handlers[member]
-            if handler.interface and handler.interface != message.get_interface():
-                return False
-            if handler.path and not fnmatch.fnmatch(message.get_path(), handler.path):
+            handler = self._match(self.signal_handlers, message)
+            if handler is None:
                 return False
             try:
                 ret = handler(message)
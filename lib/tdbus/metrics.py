@@ -0,0 +1,69 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+from __future__ import division, absolute_import
+
+# Default bucket bounds in microseconds: powers of two from 16us to about 67
+# seconds. Like Prometheus bounds, the upper bounds of the buckets of
+# _tdbus.Histogram are inclusive, and powers of two are among them.
+default_buckets = [2**i for i in range(4, 27)]
+
+
+def _round_bound(bound):
+    """Round `bound` down to an upper bound of a bucket of
+    _tdbus.Histogram. These are the numbers with at most four significant
+    bits."""
+    shift = max(0, int(bound).bit_length() - 4)
+    return (int(bound) >> shift) << shift
+
+
+def _escape(value):
+    """Escape a Prometheus label value."""
+    if value is None:
+        return ''
+    return value.replace('\\', '\\\\').replace('"', '\\"').replace('\n', '\\n')
+
+
+def format_histograms(histograms, name='tdbus_method_latency_seconds',
+                      buckets=None, reset=False):
+    """Format latency histograms in the Prometheus text format.
+
+    The `histograms` argument is a dictionary as returned by
+    DBusConnection.get_latency_histograms(). The `buckets` argument contains
+    the bucket bounds to export, in microseconds. Bounds that are not an
+    upper bound of a histogram bucket are rounded down to one, and exported
+    as such. If `reset` is True, the histograms are reset after they are
+    read.
+    """
+    if buckets is None:
+        buckets = default_buckets
+    buckets = sorted(set(_round_bound(bound) for bound in buckets))
+    lines = ['# HELP %s D-BUS method call latency.' % name,
+             '# TYPE %s histogram' % name]
+    for key in sorted(histograms):
+        side, interface, member = key
+        snapshot = histograms[key].snapshot(reset)
+        labels = 'side="%s",interface="%s",member="%s"' % \
+                    (_escape(side), _escape(interface), _escape(member))
+        counts = snapshot['buckets']
+        # The snapshot reads the count before the buckets, without a lock,
+        # so values recorded in between are only in the buckets. Export the
+        # bucket total as the count, so that the buckets stay monotonic.
+        total = sum(count for bound, count in counts)
+        cumulative = 0; pos = 0
+        for bound in buckets:
+            while pos < len(counts) and counts[pos][0] <= bound:
+                cumulative += counts[pos][1]
+                pos += 1
+            lines.append('%s_bucket{%s,le="%.9g"} %d' % (name, labels, bound / 1e6,
+                                                      cumulative))
+        lines.append('%s_bucket{%s,le="+Inf"} %d' % (name, labels, total))
+        lines.append('%s_sum{%s} %.9g' % (name, labels, snapshot['sum'] / 1e6))
+        lines.append('%s_count{%s} %d' % (name, labels, total))
+    lines.append('')
+    return '\n'.join(lines)
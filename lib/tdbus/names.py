@@ -0,0 +1,90 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+# Name owner tracking.
+#
+# The tracker adds a match rule for all NameOwnerChanged signals and then
+# takes a snapshot of the names on the bus with ListNames. From then on,
+# every name that has an owner is in the map, so a name that is not in the
+# map has no owner. Unique names own themselves. The owners of well-known
+# names in the snapshot are resolved with GetNameOwner when they are first
+# looked up; owners that come in with NameOwnerChanged are stored directly.
+
+from __future__ import division, absolute_import
+
+from tdbus import _tdbus
+from tdbus.connection import DBusError
+from tdbus.handler import DBusHandler, signal_handler
+
+MATCH_NAME_OWNER_CHANGED = "type='signal',sender='%s',interface='%s'," \
+                           "member='NameOwnerChanged'" \
+                           % (_tdbus.DBUS_SERVICE_DBUS, _tdbus.DBUS_INTERFACE_DBUS)
+
+
+class NameOwnerTracker(DBusHandler):
+    """Keeps a map of the owners of all names on the bus of `owner`, which
+    is a DBusConnection. See DBusConnection.enable_name_tracking()."""
+
+    def __init__(self, owner):
+        super(NameOwnerTracker, self).__init__()
+        self.owner = owner
+        self.owners = {}
+        self.callbacks = []
+
+    def _bus_call(self, member, format=None, args=None):
+        reply = self.owner.call_method(_tdbus.DBUS_PATH_DBUS, member,
+                                       _tdbus.DBUS_INTERFACE_DBUS, format, args,
+                                       destination=_tdbus.DBUS_SERVICE_DBUS)
+        return reply.get_args()
+
+    def start(self):
+        """Add the match rule and take a snapshot of the names."""
+        self._bus_call('AddMatch', 's', (MATCH_NAME_OWNER_CHANGED,))
+        names = self._bus_call('ListNames')[0]
+        # None marks a well-known name whose owner is not known yet.
+        self.owners = dict((name, name if name.startswith(':') else None)
+                           for name in names)
+
+    def get_name_owner(self, name):
+        """Return the unique name of the owner of `name`, or None."""
+        owner = self.owners.get(name)
+        if owner is not None or name not in self.owners:
+            return owner
+        try:
+            owner = self._bus_call('GetNameOwner', 's', (name,))[0]
+        except DBusError:
+            self.owners.pop(name, None)
+            return None
+        # A NameOwnerChanged signal that arrived while waiting is older
+        # than the reply.
+        if name in self.owners:
+            self.owners[name] = owner
+        return owner
+
+    def add_callback(self, callback, name=None):
+        """Call callback(name, old_owner, new_owner) when the owner of `name`,
+        or of any name if `name` is None, changes. The owners are None when
+        there is no owner."""
+        self.callbacks.append((callback, name))
+
+    def remove_callback(self, callback, name=None):
+        """Remove a callback that was added with add_callback()."""
+        self.callbacks.remove((callback, name))
+
+    @signal_handler(interface=_tdbus.DBUS_INTERFACE_DBUS)
+    def NameOwnerChanged(self, message):
+        if message.get_sender() != _tdbus.DBUS_SERVICE_DBUS:
+            return
+        name, old_owner, new_owner = message.get_args()
+        if new_owner:
+            self.owners[name] = new_owner
+        else:
+            self.owners.pop(name, None)
+        for callback, filter in self.callbacks[:]:
+            if filter is None or filter == name:
+                callback(name, old_owner or None, new_owner or None)
@@ -0,0 +1,104 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+# Server side object manager.
+#
+# An ObjectManager implements org.freedesktop.DBus.ObjectManager for a tree
+# of objects, so that clients can load all objects, their interfaces and
+# their properties with a single GetManagedObjects call, and follow changes
+# with the InterfacesAdded and InterfacesRemoved signals.
+#
+# The reply to GetManagedObjects is kept as a marshalled message. It is
+# built on the first call after a change, and every call until the next
+# change is answered with a copy of it, which copies bytes and does not
+# convert any Python objects. A burst of changes therefore costs one
+# rebuild, and a burst of clients costs none.
+
+from __future__ import division, absolute_import
+
+import threading
+
+from tdbus import _tdbus
+from tdbus.handler import DBusHandler, method
+
+IFACE_OBJECT_MANAGER = 'org.freedesktop.DBus.ObjectManager'
+
+
+class ObjectManager(DBusHandler):
+    """An object manager at `path` on `connection`.
+
+    Objects are added with add_object(), and their interfaces are
+    described by a dictionary that maps each interface name to a dictionary
+    of properties. Property values are variants: either a (signature,
+    value) tuple, or a value whose signature is inferred.
+
+    The manager adds itself as a handler on `connection`. It only answers
+    GetManagedObjects; the objects themselves are implemented by other
+    handlers.
+    """
+
+    def __init__(self, connection, path='/'):
+        super(ObjectManager, self).__init__()
+        self._connection = connection
+        self.path = path
+        self.objects = {}
+        self._snapshot = None
+        self._lock = threading.Lock()
+        connection.add_handler(self)
+
+    def get_method(self, message):
+        if message.get_path() != self.path:
+            return None
+        return super(ObjectManager, self).get_method(message)
+
+    def add_object(self, path, interfaces):
+        """Add the object at `path`, or add interfaces to it if it exists.
+        An InterfacesAdded signal is sent for `interfaces`."""
+        with self._lock:
+            current = self.objects.setdefault(path, {})
+            for name, properties in interfaces.items():
+                current[name] = dict(properties)
+            self._snapshot = None
+        self._connection.send_signal(self.path, 'InterfacesAdded',
+                                     IFACE_OBJECT_MANAGER, 'oa{sa{sv}}',
+                                     (path, interfaces))
+
+    def remove_object(self, path, interfaces=None):
+        """Remove the interfaces named in `interfaces` from the object at
+        `path`, or the whole object if `interfaces` is None. An
+        InterfacesRemoved signal is sent for the interfaces that are
+        removed."""
+        with self._lock:
+            current = self.objects.get(path)
+            if current is None:
+                raise KeyError(path)
+            if interfaces is None:
+                interfaces = list(current)
+            removed = [ name for name in interfaces if name in current ]
+            for name in removed:
+                del current[name]
+            if not current:
+                del self.objects[path]
+            self._snapshot = None
+        if removed:
+            self._connection.send_signal(self.path, 'InterfacesRemoved',
+                                         IFACE_OBJECT_MANAGER, 'oas',
+                                         (path, removed))
+
+    def get_snapshot(self):
+        """Return the reply to GetManagedObjects, as a message."""
+        with self._lock:
+            if self._snapshot is None:
+                snapshot = _tdbus.Message(_tdbus.DBUS_MESSAGE_TYPE_METHOD_RETURN)
+                snapshot.set_args('a{oa{sa{sv}}}', (self.objects,))
+                self._snapshot = snapshot
+            return self._snapshot
+
+    @method(interface=IFACE_OBJECT_MANAGER)
+    def GetManagedObjects(self, message):
+        self.set_response_message(self.get_snapshot())
@@ -0,0 +1,59 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+# Upgrade from the bus to direct peer to peer connections.
+#
+# A connection that has peer upgrades enabled listens on a private address
+# and exports it with the GetPeerAddress method. When it sends a method
+# call or a unicast signal to a destination, it asks the destination for
+# its peer address (asynchronously, in the mean time traffic goes through
+# the bus). If the destination has peer upgrades enabled too, a direct
+# connection is opened to it and the local unique name is passed with
+# SetPeerName, so that the destination can use the same connection in the
+# other direction. From then on, traffic to the destination uses the direct
+# connection. If the direct connection goes away, or if a well-known
+# destination name changes owner, traffic falls back to the bus.
+
+from tdbus import _tdbus, DBusError
+from tdbus.handler import DBusHandler, method, signal_handler
+
+IFACE_PEER = 'com.github.geertj.tdbus.Peer'
+PATH_PEER = '/com/github/geertj/tdbus/Peer'
+
+
+class PeerHandler(DBusHandler):
+    """Handler for the peer upgrade protocol. It is installed on the bus
+    connection and on all peer connections of `owner`."""
+
+    def __init__(self, owner):
+        super(PeerHandler, self).__init__()
+        self.owner = owner
+
+    @method(path=PATH_PEER, interface=IFACE_PEER)
+    def GetPeerAddress(self, message):
+        self.set_response('s', (self.owner._server.get_address(),))
+
+    @method(path=PATH_PEER, interface=IFACE_PEER)
+    def SetPeerName(self, message):
+        # Only a direct connection that was accepted by our server can name
+        # itself, and it cannot take over the name of an existing peer.
+        server = self.owner._server
+        if server is None or self.connection not in server.connections:
+            raise DBusError('org.freedesktop.DBus.Error.AccessDenied')
+        name = message.get_args()[0]
+        peer = self.owner._peers.get(name)
+        if peer is not None and peer.get_is_connected():
+            raise DBusError('org.freedesktop.DBus.Error.AccessDenied')
+        self.owner._peers[name] = self.connection
+
+    @signal_handler(interface=_tdbus.DBUS_INTERFACE_DBUS)
+    def NameOwnerChanged(self, message):
+        if message.get_sender() != _tdbus.DBUS_SERVICE_DBUS:
+            return
+        name = message.get_args()[0]
+        self.owner._drop_peer(name)
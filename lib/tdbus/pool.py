@@ -0,0 +1,108 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+from __future__ import division, absolute_import
+
+import zlib
+import itertools
+import threading
+
+
+def round_robin(pool, destination):
+    """Use the connections in turn. Gives the best spread, but messages
+    to the same destination may be reordered."""
+    return next(pool._counter) % len(pool.connections)
+
+def by_destination(pool, destination):
+    """Use the same connection for each destination. Messages to a
+    destination stay in order."""
+    if destination is None:
+        return 0
+    return zlib.crc32(destination) % len(pool.connections)
+
+def by_thread(pool, destination):
+    """Use the same connection for each thread. Threads are assigned to
+    connections in turn. Messages from a thread stay in order. This is the
+    policy to use with blocking connections (like SimpleDBusConnection)
+    that are shared between threads, with no more threads than
+    connections."""
+    index = getattr(pool._local, 'index', None)
+    if index is None:
+        index = pool._local.index = next(pool._counter) % len(pool.connections)
+    return index
+
+policies = { 'round_robin': round_robin, 'destination': by_destination,
+             'thread': by_thread }
+
+
+class ConnectionPool(object):
+    """A pool of connections to the same bus.
+
+    Outgoing method calls and signals are spread over the connections
+    according to `policy`, which is one of "round_robin", "destination"
+    (the default) or "thread", or a function policy(pool, destination) that
+    returns the index of the connection to use.
+
+    Handlers are installed only on the first connection, the signal
+    connection, so that signals are received once. Note that each
+    connection has its own unique name. Peers see the signal connection's
+    name only in messages that are sent over it.
+    """
+
+    def __init__(self, connection_class, address, size=4, policy='destination'):
+        if size < 1:
+            raise ValueError('size must be at least 1')
+        if not callable(policy):
+            policy = policies[policy]
+        self.policy = policy
+        self.connections = [ connection_class(address) for i in range(size) ]
+        self._counter = itertools.count()
+        self._local = threading.local()
+
+    def get_signal_connection(self):
+        """Return the connection that handlers are installed on."""
+        return self.connections[0]
+
+    def get_connection(self, destination=None):
+        """Return the connection to use for a message to `destination`."""
+        return self.connections[self.policy(self, destination)]
+
+    def add_handler(self, handler):
+        """Add a method/signal handler to the signal connection."""
+        self.connections[0].add_handler(handler)
+
+    def call_method(self, path, member, interface=None, format=None, args=None,
+                    destination=None, callback=None, timeout=None):
+        """Call a method on one of the connections."""
+        connection = self.get_connection(destination)
+        return connection.call_method(path, member, interface, format, args,
+                                      destination=destination,
+                                      callback=callback, timeout=timeout)
+
+    def send_signal(self, path, member, interface=None, format=None, args=None,
+                    destination=None):
+        """Send a signal on one of the connections."""
+        connection = self.get_connection(destination)
+        connection.send_signal(path, member, interface, format, args,
+                               destination=destination)
+
+    def get_stats(self):
+        """Return the transport statistics, summed over all connections."""
+        total = {}
+        for connection in self.connections:
+            for key, value in connection.get_stats().items():
+                if key.startswith('peak_'):
+                    total[key] = max(total.get(key, 0), value)
+                else:
+                    total[key] = total.get(key, 0) + value
+        return total
+
+    def close(self):
+        """Close all connections."""
+        for connection in self.connections:
+            connection.close()
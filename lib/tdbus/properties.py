@@ -0,0 +1,154 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+# Client side property cache.
+#
+# A PropertyCache holds the properties of one interface of a remote object.
+# It adds a match rule for the PropertiesChanged signals of that object and
+# interface only, and then loads all properties with GetAll. The match rule
+# is added first, so that no change can be missed. Changes are applied as
+# they come in. Properties that are invalidated without a new value are
+# fetched with Get on the next read.
+#
+# For a well-known destination, the cache also follows NameOwnerChanged for
+# that name. Signals are only accepted from the current owner, and when the
+# name moves to a new owner, the properties are loaded again from it.
+
+from __future__ import division, absolute_import
+
+from tdbus import _tdbus, DBusError
+from tdbus.handler import DBusHandler, signal_handler, IFACE_PROPERTIES
+
+
+class PropertyCache(DBusHandler):
+    """A local copy of the properties of `interface` on the object at `path`
+    on `destination`.
+
+    The cache installs itself as a handler on `connection`, and is kept up
+    to date while the connection dispatches messages. Loading the
+    properties and fetching invalidated properties are blocking calls, so
+    the connection must return replies from call_method(), like
+    SimpleDBusConnection and GEventDBusConnection do.
+    """
+
+    def __init__(self, connection, destination, path, interface, timeout=None):
+        super(PropertyCache, self).__init__()
+        self._connection = connection
+        self.destination = destination
+        self.path = path
+        self.interface = interface
+        self.timeout = timeout
+        self.properties = {}
+        self.callbacks = []
+        self._invalidated = set()
+        self._rule = "type='signal',sender='%s',path='%s',interface='%s'," \
+                     "member='PropertiesChanged',arg0='%s'" \
+                     % (destination, path, IFACE_PROPERTIES, interface)
+        self._bus_call('AddMatch', 's', (self._rule,))
+        if destination.startswith(':'):
+            self._owner_rule = None
+            self._owner = destination
+        else:
+            self._owner_rule = "type='signal',sender='%s',interface='%s'," \
+                               "member='NameOwnerChanged',arg0='%s'" \
+                               % (_tdbus.DBUS_SERVICE_DBUS, _tdbus.DBUS_INTERFACE_DBUS,
+                                  destination)
+            self._bus_call('AddMatch', 's', (self._owner_rule,))
+            self._owner = self._bus_call('GetNameOwner', 's', (destination,))[0]
+        connection.add_handler(self)
+        self.refresh()
+
+    def _bus_call(self, member, format, args):
+        reply = self._connection.call_method(_tdbus.DBUS_PATH_DBUS, member,
+                                             _tdbus.DBUS_INTERFACE_DBUS, format, args,
+                                             destination=_tdbus.DBUS_SERVICE_DBUS,
+                                             timeout=self.timeout)
+        return reply.get_args()
+
+    def _call(self, member, format, args):
+        reply = self._connection.call_method(self.path, member, IFACE_PROPERTIES,
+                                             format, args,
+                                             destination=self.destination,
+                                             timeout=self.timeout)
+        return reply.get_args(unwrap=True)
+
+    def refresh(self):
+        """Load all properties with GetAll."""
+        self.properties = self._call('GetAll', 's', (self.interface,))[0]
+        self._invalidated.clear()
+
+    def get(self, name, default=None):
+        """Return the value of property `name`, or `default` if the object
+        does not have it."""
+        if name in self._invalidated:
+            self.properties[name] = self._call('Get', 'ss', (self.interface, name))[0]
+            self._invalidated.discard(name)
+        return self.properties.get(name, default)
+
+    def __getitem__(self, name):
+        if name not in self.properties and name not in self._invalidated:
+            raise KeyError(name)
+        return self.get(name)
+
+    def __contains__(self, name):
+        return name in self.properties or name in self._invalidated
+
+    def get_all(self):
+        """Return a dictionary with all properties."""
+        for name in list(self._invalidated):
+            self.get(name)
+        return dict(self.properties)
+
+    def add_callback(self, callback):
+        """Call callback(cache, changed, invalidated) after every change.
+        `changed` is a dictionary with the new values, `invalidated` a list
+        of names of properties that have changed without a new value. When
+        the destination changes owner, `changed` holds all properties of
+        the new owner."""
+        self.callbacks.append(callback)
+
+    @signal_handler(interface=IFACE_PROPERTIES)
+    def PropertiesChanged(self, message):
+        if message.get_path() != self.path or message.get_sender() != self._owner:
+            return
+        interface, changed, invalidated = message.get_args(unwrap=True)
+        if interface != self.interface:
+            return
+        self.properties.update(changed)
+        self._invalidated.difference_update(changed)
+        for name in invalidated:
+            self.properties.pop(name, None)
+            self._invalidated.add(name)
+        for callback in self.callbacks:
+            callback(self, changed, invalidated)
+
+    @signal_handler(interface=_tdbus.DBUS_INTERFACE_DBUS)
+    def NameOwnerChanged(self, message):
+        if message.get_sender() != _tdbus.DBUS_SERVICE_DBUS:
+            return
+        name, old_owner, new_owner = message.get_args()
+        if name != self.destination or self._owner_rule is None:
+            return
+        self._owner = new_owner or None
+        if self._owner is None:
+            return
+        # The new owner may have different values, or not have the object.
+        try:
+            self.refresh()
+        except DBusError:
+            self.properties = {}
+            self._invalidated.clear()
+        for callback in self.callbacks:
+            callback(self, dict(self.properties), [])
+
+    def close(self):
+        """Stop tracking changes."""
+        self._connection.remove_handler(self)
+        self._bus_call('RemoveMatch', 's', (self._rule,))
+        if self._owner_rule is not None:
+            self._bus_call('RemoveMatch', 's', (self._owner_rule,))
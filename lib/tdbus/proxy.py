@@ -0,0 +1,303 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+# Proxies for remote objects.
+#
+# A Proxy introspects a remote object once, and then calls its methods with
+# the signatures from the introspection data, so that no format strings are
+# needed. The introspection data is kept in a SignatureCache, keyed by
+# destination, path and interface. A cache can be backed by a file, so that
+# short-lived processes that share the file do not introspect at all.
+#
+# The file is a JSON object that maps "destination path" to the interfaces
+# of an object. Updates are read-modify-write cycles that are serialized
+# between processes with an exclusive flock() on "<filename>.lock", and the
+# new contents are renamed into place so that readers never see a partial
+# file. Objects behind unique names are not written to the file, as unique
+# names are never reused.
+
+from __future__ import division, absolute_import
+
+import os
+import json
+import fcntl
+import tempfile
+import threading
+from xml.etree import ElementTree
+
+from tdbus.connection import DBusError
+
+IFACE_INTROSPECTABLE = 'org.freedesktop.DBus.Introspectable'
+IFACE_PROPERTIES = 'org.freedesktop.DBus.Properties'
+
+# Errors after which cached signatures are no longer trusted.
+stale_errors = ('org.freedesktop.DBus.Error.UnknownMethod',
+                'org.freedesktop.DBus.Error.InvalidArgs')
+
+
+def parse_introspection(data):
+    """Parse introspection XML. Returns a dict that maps each interface name
+    to a dict with "methods" (name -> [in_signature, out_signature]),
+    "signals" (name -> signature) and "properties" (name -> [type, access])."""
+    interfaces = {}
+    for node in ElementTree.fromstring(data).findall('interface'):
+        methods = {}; signals = {}; properties = {}
+        for elem in node.findall('method'):
+            args = elem.findall('arg')
+            methods[elem.get('name')] = \
+                [ ''.join(arg.get('type') for arg in args
+                          if arg.get('direction', 'in') == 'in'),
+                  ''.join(arg.get('type') for arg in args
+                          if arg.get('direction') == 'out') ]
+        for elem in node.findall('signal'):
+            signals[elem.get('name')] = \
+                ''.join(arg.get('type') for arg in elem.findall('arg'))
+        for elem in node.findall('property'):
+            properties[elem.get('name')] = [elem.get('type'), elem.get('access')]
+        interfaces[node.get('name')] = { 'methods': methods, 'signals': signals,
+                                         'properties': properties }
+    return interfaces
+
+
+def _to_str(value):
+    """Convert the unicode strings that json returns to str."""
+    if isinstance(value, unicode):
+        return str(value)
+    elif isinstance(value, list):
+        return [ _to_str(item) for item in value ]
+    elif isinstance(value, dict):
+        return dict((str(key), _to_str(item)) for key, item in value.items())
+    return value
+
+
+class SignatureCache(object):
+    """Introspection data, keyed by (destination, path, interface).
+
+    With a `filename`, the data is also stored in that file and can be
+    shared between processes.
+    """
+
+    def __init__(self, filename=None):
+        self.filename = filename
+        self._objects = {}
+        self._lock = threading.Lock()
+        if filename is not None:
+            self._objects.update(self._load())
+
+    def _load(self):
+        try:
+            with open(self.filename) as fin:
+                data = json.load(fin)
+        except (IOError, ValueError):
+            return {}
+        objects = {}
+        for key, interfaces in data.items():
+            destination, path = str(key).split(' ', 1)
+            objects[(destination, path)] = _to_str(interfaces)
+        return objects
+
+    def _store(self, key, interfaces):
+        # Merge with the current file, which may have been updated by
+        # another process. The lock keeps two processes from merging with
+        # the same contents and losing one of the updates.
+        with open(self.filename + '.lock', 'a') as lock:
+            fcntl.flock(lock.fileno(), fcntl.LOCK_EX)
+            self._merge(key, interfaces)
+
+    def _merge(self, key, interfaces):
+        objects = self._load()
+        if interfaces is None:
+            objects.pop(key, None)
+        else:
+            objects[key] = interfaces
+        data = dict(('%s %s' % key, value) for key, value in objects.items())
+        dirname = os.path.dirname(os.path.abspath(self.filename))
+        fd, tmpname = tempfile.mkstemp(dir=dirname, prefix='.tdbus-cache-')
+        try:
+            with os.fdopen(fd, 'w') as fout:
+                json.dump(data, fout)
+            os.rename(tmpname, self.filename)
+        except:
+            os.unlink(tmpname)
+            raise
+
+    def get_object(self, destination, path):
+        """Return the interfaces of an object, or None if it is not cached."""
+        return self._objects.get((destination, path))
+
+    def get(self, destination, path, interface):
+        """Return the description of an interface, or None if it is not
+        cached."""
+        interfaces = self._objects.get((destination, path))
+        if interfaces is None:
+            return None
+        return interfaces.get(interface)
+
+    def put_object(self, destination, path, interfaces):
+        """Store the interfaces of an object."""
+        with self._lock:
+            self._objects[(destination, path)] = interfaces
+            if self.filename is not None and not destination.startswith(':'):
+                self._store((destination, path), interfaces)
+
+    def invalidate(self, destination, path):
+        """Forget an object."""
+        with self._lock:
+            if self._objects.pop((destination, path), None) is None:
+                return
+            if self.filename is not None and not destination.startswith(':'):
+                self._store((destination, path), None)
+
+
+default_cache = SignatureCache()
+
+
+class ProxyMethod(object):
+    """A method of a remote object, with its signature looked up in
+    advance."""
+
+    def __init__(self, proxy, member, interface, signature, result):
+        self.proxy = proxy
+        self.member = member
+        self.interface = interface
+        self.signature = signature
+        self.result = result
+
+    def __call__(self, *args, **kwargs):
+        """Call the method. Returns None, the result, or a tuple of results if
+        the method has more than one. Takes an optional `timeout`."""
+        proxy = self.proxy
+        timeout = kwargs.pop('timeout', proxy.timeout)
+        if kwargs:
+            raise TypeError('unexpected keyword arguments: %s'
+                            % ', '.join(kwargs))
+        if self.signature:
+            format = self.signature
+        elif args:
+            raise TypeError('%s takes no arguments' % self.member)
+        else:
+            format = args = None
+        try:
+            reply = proxy.connection.call_method(proxy.path, self.member,
+                                                 self.interface, format, args,
+                                                 destination=proxy.destination,
+                                                 timeout=timeout)
+        except DBusError as e:
+            if e[0] in stale_errors:
+                proxy.invalidate()
+            raise
+        result = reply.get_args()
+        if len(result) == 0:
+            return None
+        elif len(result) == 1:
+            return result[0]
+        return result
+
+
+class Proxy(object):
+    """A local proxy for the object at `path` on `destination`.
+
+    The methods of the object are available as attributes. If `interface`
+    is given, only that interface is searched for methods and properties.
+    The object is introspected when it is not in `cache`, which defaults to
+    a cache that is shared by all proxies in the process.
+
+    The connection must return replies from call_method(), like
+    SimpleDBusConnection and GEventDBusConnection do.
+    """
+
+    def __init__(self, connection, destination, path, interface=None,
+                 cache=None, timeout=None):
+        self.connection = connection
+        self.destination = destination
+        self.path = path
+        self.interface = interface
+        self.cache = default_cache if cache is None else cache
+        self.timeout = timeout
+        self._interfaces = self.cache.get_object(destination, path)
+        if self._interfaces is None:
+            self.introspect()
+
+    def _forget_methods(self):
+        for name, value in self.__dict__.items():
+            if isinstance(value, ProxyMethod):
+                del self.__dict__[name]
+
+    def introspect(self):
+        """Introspect the object, and update the cache."""
+        reply = self.connection.call_method(self.path, 'Introspect',
+                                            IFACE_INTROSPECTABLE,
+                                            destination=self.destination,
+                                            timeout=self.timeout)
+        self._interfaces = parse_introspection(reply.get_args()[0])
+        self.cache.put_object(self.destination, self.path, self._interfaces)
+        self._forget_methods()
+
+    def invalidate(self):
+        """Forget the signatures of the object, here and in the cache. The
+        object is introspected again when a member is looked up next."""
+        self.cache.invalidate(self.destination, self.path)
+        self._interfaces = None
+        self._forget_methods()
+
+    def _get_interfaces(self):
+        if self._interfaces is None:
+            self.introspect()
+        return self._interfaces
+
+    def get_interfaces(self):
+        """Return the names of the interfaces of the object."""
+        return sorted(self._get_interfaces())
+
+    def _find(self, kind, name, interface=None):
+        if interface is None:
+            interface = self.interface
+        interfaces = self._get_interfaces()
+        if interface is None:
+            candidates = sorted(interfaces)
+        else:
+            candidates = [interface]
+        for interface in candidates:
+            members = interfaces.get(interface, {}).get(kind, {})
+            if name in members:
+                return interface, members[name]
+        raise AttributeError('no %s "%s" on %s at %s'
+                             % (kind[:-1], name, self.destination, self.path))
+
+    def get_method(self, name, interface=None):
+        """Return the method `name` as a ProxyMethod."""
+        interface, (signature, result) = self._find('methods', name, interface)
+        return ProxyMethod(self, name, interface, signature, result)
+
+    def get_signal_signature(self, name, interface=None):
+        """Return the signature of signal `name`."""
+        return self._find('signals', name, interface)[1]
+
+    def __getattr__(self, name):
+        if name.startswith('_'):
+            raise AttributeError(name)
+        method = self.get_method(name)
+        self.__dict__[name] = method
+        return method
+
+    def get_property(self, name, interface=None):
+        """Return the value of property `name`."""
+        interface, (type, access) = self._find('properties', name, interface)
+        reply = self.connection.call_method(self.path, 'Get', IFACE_PROPERTIES,
+                                            'ss', (interface, name),
+                                            destination=self.destination,
+                                            timeout=self.timeout)
+        return reply.get_args()[0][1]
+
+    def set_property(self, name, value, interface=None):
+        """Set property `name` to `value`."""
+        interface, (type, access) = self._find('properties', name, interface)
+        self.connection.call_method(self.path, 'Set', IFACE_PROPERTIES, 'ssv',
+                                    (interface, name, (type, value)),
+                                    destination=self.destination,
+                                    timeout=self.timeout)
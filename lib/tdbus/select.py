@@ -16,6 +16,7 @@ import errno
 from tdbus import _tdbus
 from tdbus.loop import EventLoop
 from tdbus.connection import DBusConnection, DBusError
+from tdbus.server import DBusServer
 
 
 class SelectLoop(EventLoop):
@@ -58,6 +59,79 @@ class SelectLoop(EventLoop):
     def timeout_toggled(self, timeout):
         pass
 
+    def call_later(self, delay, callback):
+        """Call `callback` once, after `delay` seconds."""
+        expires = time.time() + delay
+        heapq.heappush(self.timeouts, (expires, _Later(self, callback)))
+
+
+class _Later(object):
+    """A one-shot timeout for SelectLoop.call_later()."""
+
+    def __init__(self, loop, callback):
+        self._loop = loop
+        self._callback = callback
+
+    def get_interval(self):
+        return 0
+
+    def get_enabled(self):
+        return True
+
+    def handle(self):
+        self._loop.remove_timeout(self)
+        self._callback()
+
+
+def select_loops(loops, maxwait=4):
+    """Wait until a watch of one of the SelectLoops in `loops` is ready or
+    a timeout expires, for at most `maxwait` seconds. Then handle the
+    watches that are ready and the timeouts that have expired."""
+    rfds = []; wfds = []
+    wait = maxwait
+    for loop in loops:
+        for watch in loop.watches:
+            if not watch.get_enabled():
+                continue
+            fd = watch.get_fd()
+            flags = watch.get_flags()
+            if flags & _tdbus.DBUS_WATCH_READABLE:
+                rfds.append(fd)
+            if flags & _tdbus.DBUS_WATCH_WRITABLE:
+                wfds.append(fd)
+        if loop.timeouts:
+            wait = max(0, min(wait, loop.timeouts[0][0] - time.time()))
+    try:
+        rfds, wfds, _ = select.select(rfds, wfds, [], wait)
+    except select.error as e:
+        if e[0] != errno.EINTR:
+            raise
+        rfds = wfds = []
+    for loop in loops:
+        for watch in loop.watches[:]:
+            if not watch.get_enabled():
+                continue
+            fd = watch.get_fd()
+            flags = 0
+            if fd in rfds:
+                flags |= _tdbus.DBUS_WATCH_READABLE
+            if fd in wfds:
+                flags |= _tdbus.DBUS_WATCH_WRITABLE
+            if flags:
+                watch.handle(flags)
+            if flags & _tdbus.DBUS_WATCH_WRITABLE:
+                loop._connection.check_writable()
+    now = time.time()
+    for loop in loops:
+        while loop.timeouts and loop.timeouts[0][0] < now:
+            # Reschedule before handling, so that the timeout can be
+            # removed from within handle().
+            expires, timeout = heapq.heappop(loop.timeouts)
+            heapq.heappush(loop.timeouts,
+                           (now + timeout.get_interval()/1000, timeout))
+            if timeout.get_enabled():
+                timeout.handle()
+
 
 class SimpleDBusConnection(DBusConnection):
     """A connection that uses a simple select() based event loop.
@@ -70,69 +144,110 @@ class SimpleDBusConnection(DBusConnection):
     Loop = SelectLoop
     Local = type('Object', (object,), {})
 
+    _dispatching = False
+
     def call_method(self, *args, **kwargs):
         callback = kwargs.get('callback')
         if callback is not None:
-            super(SimpleDBusConnection, self).call_method(*args, **kwargs)
-            return
+            return super(SimpleDBusConnection, self).call_method(*args, **kwargs)
         replies = []
-        def _method_callback(message):
-            replies.append(message)
-            self.stop()
-        kwargs['callback'] = _method_callback
-        super(SimpleDBusConnection, self).call_method(*args, **kwargs)
-        self.dispatch()
+        kwargs['callback'] = replies.append
+        pending = super(SimpleDBusConnection, self).call_method(*args, **kwargs)
+        if self._dispatching:
+            # Called from a handler. Libdbus cannot dispatch a connection
+            # recursively, so wait for the reply only. Other messages stay
+            # queued until the handler returns.
+            pending.block()
+        else:
+            self._run_until(lambda: replies)
         assert len(replies) == 1
         reply = replies[0]
         if reply.get_type() == _tdbus.DBUS_MESSAGE_TYPE_ERROR:
             raise DBusError(reply.get_error_name())
         return reply
 
+    def wait_writable(self):
+        """Run the loop until the outgoing queue has drained. From a
+        handler, where the loop cannot run, block until the queue has been
+        written."""
+        if self._dispatching:
+            self._connection.flush()
+        else:
+            self._run_until(self._connection.check_writable)
+
     def dispatch(self):
-        """Start the loop."""
+        """Start the loop. If peer upgrades are enabled, the loop also
+        handles the server and the direct connections."""
         self._stop = False
-        loop = self._connection.get_loop()
-        while not self._stop:
-            rfds = []; wfds = []
-            for watch in loop.watches:
-                if not watch.get_enabled():
-                    continue
-                fd = watch.get_fd()
-                flags = watch.get_flags()
-                if flags & _tdbus.DBUS_WATCH_READABLE:
-                    rfds.append(fd)
-                if flags & _tdbus.DBUS_WATCH_WRITABLE:
-                    wfds.append(fd)
-            if loop.timeouts:
-                timeout = loop.timeouts[0][0]
-            else:
-                timeout = 4
-            try:
-                rfds, wfds, _ = select.select(rfds, wfds, [], timeout)
-            except select.error as e:
-                if e[0] != errno.EINTR:
-                    raise
-            for watch in loop.watches:
-                if not watch.get_enabled():
-                    continue
-                fd = watch.get_fd()
-                flags = 0
-                if fd in rfds:
-                    flags |= _tdbus.DBUS_WATCH_READABLE
-                if fd in wfds:
-                    flags |= _tdbus.DBUS_WATCH_WRITABLE
-                if flags:
-                    watch.handle(flags)
-            now = time.time()
-            while loop.timeouts and loop.timeouts[0][0] < now:
-                expires, timeout = heapq.heappop(loop.timeouts)
-                timeout.handle()
-                heapq.heappush(loop.timeouts, (expires + timeout.get_interval()/1000))
+        self._run_until(lambda: self._stop)
+        self._connection.flush()
+
+    def _run_until(self, done):
+        while not done():
+            connections = [self] + self.get_peer_connections()
+            loops = [ connection._connection.get_loop()
+                      for connection in connections ]
+            if self._server is not None:
+                loops.append(self._server._server.get_loop())
+            select_loops(loops)
+            for connection in connections:
+                if not connection._dispatching:
+                    connection.dispatch_messages()
+            if self._server is not None:
+                self._server.remove_disconnected()
+
+    def call_later(self, delay, callback):
+        """Call `callback` from dispatch() after `delay` seconds, or after
+        the current loop iteration if `delay` is 0. This should be called
+        from the thread that runs the loop."""
+        self._connection.get_loop().call_later(delay, callback)
+
+    def dispatch_messages(self):
+        """Dispatch all messages that have been received."""
+        self._dispatching = True
+        try:
             while self._connection.get_dispatch_status() ==  \
                         _tdbus.DBUS_DISPATCH_DATA_REMAINS:
                 self._connection.dispatch()
-        self._connection.flush()
+        finally:
+            self._dispatching = False
 
     def stop(self):
         """Stop the event loop."""
         self._stop = True
+
+
+class SimpleDBusServer(DBusServer):
+    """A server that uses a simple select() based event loop.
+
+    The loop handles the server itself and all accepted connections.
+    """
+
+    Loop = SelectLoop
+    Connection = SimpleDBusConnection
+
+    def __init__(self, address):
+        super(SimpleDBusServer, self).__init__(address)
+        self._stop = False
+
+    def dispatch(self):
+        """Start the loop. The loop runs until stop() is called, which may
+        happen from another thread even before the loop is started."""
+        while not self._stop:
+            loops = [self._server.get_loop()]
+            loops += [ connection._connection.get_loop()
+                       for connection in self.connections ]
+            select_loops(loops)
+            for connection in self.connections:
+                connection.dispatch_messages()
+            self.remove_disconnected()
+        for connection in self.connections:
+            connection._connection.flush()
+        self._stop = False
+
+    def stop(self):
+        """Stop the event loop."""
+        self._stop = True
+
+
+SimpleDBusConnection.Server = SimpleDBusServer
@@ -0,0 +1,72 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+from tdbus import _tdbus
+
+
+class DBusServer(object):
+    """A server that accepts direct (peer to peer) connections.
+
+    Messages on peer to peer connections do not pass through the message
+    bus. Clients connect with a DBusConnection that is created with
+    `register=False`. Peer connections do not have a unique name, and
+    messages on them do not have a sender or a destination.
+    """
+
+    Loop = None
+    Connection = None
+
+    def __init__(self, address):
+        """Listen on `address`, e.g. "unix:tmpdir=/tmp"."""
+        if self.Loop is None or self.Connection is None:
+            raise NotImplementedError('cannot create Server without a Loop')
+        self._server = _tdbus.Server(address)
+        self._server.set_loop(self.Loop(self._server))
+        self._server.set_new_connection_callback(self._new_connection)
+        self.handlers = []
+        self.connections = []
+
+    def add_handler(self, handler):
+        """Add a new method/signal handler. The handler is added to all
+        current and future connections."""
+        self.handlers.append(handler)
+        for connection in self.connections:
+            connection.add_handler(handler)
+
+    def remove_handler(self, handler):
+        """Remove a handler from the server and all its connections."""
+        self.handlers.remove(handler)
+        for connection in self.connections:
+            connection.remove_handler(handler)
+
+    def get_address(self):
+        """Return the address that clients can connect to."""
+        return self._server.get_address()
+
+    def close(self):
+        """Stop listening and close all connections."""
+        self._server.disconnect()
+        for connection in self.connections:
+            connection.close()
+        self.connections = []
+
+    def _new_connection(self, connection):
+        connection = self.Connection(connection)
+        for handler in self.handlers:
+            connection.add_handler(handler)
+        self.connections.append(connection)
+        self.new_connection(connection)
+
+    def new_connection(self, connection):
+        """Called when a new client has connected. Can be overridden in a
+        subclass."""
+
+    def remove_disconnected(self):
+        """Forget about connections that were closed by the peer."""
+        self.connections = [ connection for connection in self.connections
+                             if connection.get_is_connected() ]
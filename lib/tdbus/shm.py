@@ -0,0 +1,242 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+# Shared memory bulk channels.
+#
+# A sender creates a ring buffer in a memfd and passes the file descriptor
+# to a receiver once, with the Open method. After that, every frame is
+# written to the ring buffer and announced with a small Frame signal that
+# carries only the position and the length of the frame. The receiver
+# reads the frame directly from shared memory and releases it by advancing
+# the tail counter in the ring header. Frames can be released out of order,
+# for example by a connection that dispatches in threads. The tail only
+# moves past frames that have all been released. The channel is closed with
+# the Close method.
+#
+# The ring buffer layout is a header with two 64-bit counters on separate
+# cache lines: "head" (bytes written, owned by the sender) and "tail" (bytes
+# released, owned by the receiver), followed by the data area. Positions
+# are monotonic byte counts; a frame never wraps around the end of the data
+# area, so that it can always be read without copying.
+#
+# The sender seals the memfd against shrinking and growing, and the receiver
+# only maps a file descriptor that has these seals and the expected size.
+# Without them, a sender could truncate the file and make the receiver crash
+# with SIGBUS when it reads a frame. As only a memfd can be sealed, there is
+# no fallback for systems without memfd_create().
+
+from __future__ import division, absolute_import
+
+import os
+import mmap
+import stat
+import uuid
+import fcntl
+import threading
+
+from tdbus import _tdbus, DBusError
+from tdbus.handler import DBusHandler, method, signal_handler
+
+IFACE_SHM = 'com.github.geertj.tdbus.SharedMemory'
+PATH_SHM = '/com/github/geertj/tdbus/SharedMemory'
+
+HEAD_OFFSET = 0
+TAIL_OFFSET = 64
+HEADER_SIZE = 128
+
+# From <fcntl.h>. The fcntl module does not define these.
+F_ADD_SEALS = 1033
+F_GET_SEALS = 1034
+F_SEAL_SHRINK = 0x0002
+F_SEAL_GROW = 0x0004
+
+SEALS = F_SEAL_SHRINK | F_SEAL_GROW
+
+
+class RingBuffer(object):
+    """A single producer, single consumer ring buffer in shared memory."""
+
+    def __init__(self, fd, size):
+        """Map a ring buffer with a data area of `size` bytes from `fd`,
+        which can be anything that is accepted by UnixFd()."""
+        if not isinstance(fd, _tdbus.UnixFd):
+            fd = _tdbus.UnixFd(fd)
+        self.fd = fd
+        self.size = size
+        self.head = 0
+        self.mmap = mmap.mmap(fd.fileno(), HEADER_SIZE + size)
+        self.tail = _tdbus.atomic_load(self.mmap, TAIL_OFFSET)
+        self._released = {}
+        self._lock = threading.Lock()
+
+    @classmethod
+    def create(cls, size, name='tdbus-ring'):
+        """Create a new ring buffer with a data area of `size` bytes, in a
+        memfd that is sealed against changes of its size. Raises
+        NotImplementedError if the system has no memfd_create()."""
+        fd = _tdbus.memfd_create(name)
+        try:
+            os.ftruncate(fd.fileno(), HEADER_SIZE + size)
+            fcntl.fcntl(fd.fileno(), F_ADD_SEALS, SEALS)
+        except:
+            fd.close()
+            raise
+        return cls(fd, size)
+
+    @classmethod
+    def open(cls, fd, size):
+        """Map a ring buffer that was created by another process. Raises
+        a DBusError unless `fd` is a regular file of the right size that is
+        sealed against changes of its size."""
+        if not isinstance(fd, _tdbus.UnixFd):
+            fd = _tdbus.UnixFd(fd)
+        error = DBusError('org.freedesktop.DBus.Error.InvalidArgs')
+        try:
+            st = os.fstat(fd.fileno())
+            seals = fcntl.fcntl(fd.fileno(), F_GET_SEALS)
+        except (IOError, OSError):
+            raise error
+        if size <= 0 or not stat.S_ISREG(st.st_mode) or \
+                st.st_size != HEADER_SIZE + size or seals & SEALS != SEALS:
+            raise error
+        return cls(fd, size)
+
+    def close(self):
+        self.mmap.close()
+        self.fd.close()
+
+    def write(self, data):
+        """Write a frame. Returns its position, or None if the buffer is
+        full."""
+        length = len(data)
+        if length > self.size:
+            raise ValueError('frame larger than ring buffer')
+        head = self.head
+        tail = _tdbus.atomic_load(self.mmap, TAIL_OFFSET)
+        offset = head % self.size
+        if offset + length > self.size:
+            # Skip the remainder of the data area.
+            head += self.size - offset
+            offset = 0
+        if head + length - tail > self.size:
+            return None
+        start = HEADER_SIZE + offset
+        self.mmap[start:start+length] = data
+        self.head = head + length
+        _tdbus.atomic_store(self.mmap, HEAD_OFFSET, self.head)
+        return head
+
+    def read(self, position, length):
+        """Return a read-only buffer for the frame at `position`. The buffer
+        is valid until the frame is released."""
+        start = HEADER_SIZE + position % self.size
+        return buffer(self.mmap, start, length)
+
+    def _follows(self, tail):
+        """Return the position of the released frame that was written when
+        the head was at `tail`, or None if it has not been released yet."""
+        if tail in self._released:
+            return tail
+        # The frame was moved to the start of the data area if it did not
+        # fit before the end.
+        offset = tail % self.size
+        position = tail + self.size - offset
+        if offset and offset + self._released.get(position, 0) > self.size:
+            return position
+
+    def release(self, position, length):
+        """Release the frame at `position`. Frames can be released in any
+        order, but the tail only moves past frames that have all been
+        released."""
+        if length == 0:
+            return
+        with self._lock:
+            self._released[position] = length
+            tail = self.tail
+            position = self._follows(tail)
+            while position is not None:
+                tail = position + self._released.pop(position)
+                position = self._follows(tail)
+            if tail != self.tail:
+                self.tail = tail
+                _tdbus.atomic_store(self.mmap, TAIL_OFFSET, tail)
+
+    def get_free(self):
+        """Return the number of bytes that are not in use."""
+        return self.size - (self.head - _tdbus.atomic_load(self.mmap, TAIL_OFFSET))
+
+
+class SharedMemorySender(object):
+    """The sending side of a shared memory channel to `destination`."""
+
+    def __init__(self, connection, destination, size=16*1024*1024):
+        if not connection.can_send_type('h'):
+            raise DBusError('connection cannot pass file descriptors')
+        self.connection = connection
+        self.destination = destination
+        self.channel = uuid.uuid4().hex
+        self.ring = RingBuffer.create(size)
+        connection.call_method(PATH_SHM, 'Open', IFACE_SHM, 'sht',
+                               (self.channel, self.ring.fd, size),
+                               destination=destination)
+
+    def send(self, data):
+        """Send a frame. Returns False if there is no room for it, in which
+        case it must be retried after the receiver has caught up."""
+        position = self.ring.write(data)
+        if position is None:
+            return False
+        self.connection.send_signal(PATH_SHM, 'Frame', IFACE_SHM, 'stt',
+                                    (self.channel, position, len(data)),
+                                    destination=self.destination)
+        return True
+
+    def close(self):
+        """Close the channel."""
+        self.connection.call_method(PATH_SHM, 'Close', IFACE_SHM, 's',
+                                    (self.channel,), destination=self.destination)
+        self.ring.close()
+
+
+class SharedMemoryHandler(DBusHandler):
+    """The receiving side of shared memory channels.
+
+    Override frame_received() in a subclass. Frames are released when
+    frame_received() returns, so the data must be copied if it is needed
+    after that.
+    """
+
+    def __init__(self):
+        super(SharedMemoryHandler, self).__init__()
+        self.channels = {}
+
+    @method(path=PATH_SHM, interface=IFACE_SHM)
+    def Open(self, message):
+        channel, fd, size = message.get_args()
+        self.channels[channel] = RingBuffer.open(fd, size)
+
+    @method(path=PATH_SHM, interface=IFACE_SHM)
+    def Close(self, message):
+        channel = message.get_args()[0]
+        ring = self.channels.pop(channel, None)
+        if ring is not None:
+            ring.close()
+
+    @signal_handler(path=PATH_SHM, interface=IFACE_SHM)
+    def Frame(self, message):
+        channel, position, length = message.get_args()
+        ring = self.channels.get(channel)
+        if ring is None:
+            return
+        try:
+            self.frame_received(channel, ring.read(position, length))
+        finally:
+            ring.release(position, length)
+
+    def frame_received(self, channel, data):
+        """Called for every frame. `data` is a read-only buffer."""
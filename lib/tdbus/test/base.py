@@ -6,46 +6,31 @@
 # Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
 # complete list.
 
-import os
-import re
-import subprocess
-import signal
-
 import tdbus
+from tdbus.test.bus import PrivateBus
 from nose import SkipTest
 
 
 class BaseTest(object):
     """Test infrastructure for tdbus tests."""
 
-    _re_assign = re.compile(r'^([a-zA-Z_][a-zA-Z0-9_]*)=' \
-                            r'''([^"']*?|'[^']*'|"([^"\\]|\\.)*");?$''')
+    _have_session_bus = False
 
     @classmethod
     def setup_class(cls):
+        cls._bus = PrivateBus()
         try:
-            output = subprocess.check_output(['dbus-launch', '--sh-syntax'])
+            cls._bus_address = cls._bus.start()
         except OSError:
             raise SkipTest('dbus-launch is required for running this test')
-        for line in output.splitlines():
-            mobj = cls._re_assign.match(line)
-            if not mobj:
-                continue
-            key = mobj.group(1)
-            value = mobj.group(2)
-            if value.startswith('"') or value.startswith("'"):
-                value = value[1:-1]
-            if key == 'DBUS_SESSION_BUS_ADDRESS':
-                cls._bus_address = value
-                # the following is a trick to allow us to have a different
-                # session bus for each test.
-                tdbus.DBUS_BUS_SESSION = value
-            elif key == 'DBUS_SESSION_BUS_PID':
-                cls._bus_pid = int(value)
+        cls._bus_pid = cls._bus.pid
+        # the following is a trick to allow us to have a different
+        # session bus for each test.
+        tdbus.DBUS_BUS_SESSION = cls._bus_address
         cls._have_session_bus = True
 
     @classmethod
     def teardown_class(cls):
         if not cls._have_session_bus:
             return
-        os.kill(cls._bus_pid, signal.SIGTERM)
+        cls._bus.stop()
@@ -0,0 +1,51 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+# A private D-BUS daemon for the test suite and the benchmarks. This module
+# does not depend on nose so that the benchmarks can use it too.
+
+import os
+import re
+import signal
+import subprocess
+
+
+class PrivateBus(object):
+    """A private D-BUS daemon, started with dbus-launch."""
+
+    _re_assign = re.compile(r'^([a-zA-Z_][a-zA-Z0-9_]*)=' \
+                            r'''([^"']*?|'[^']*'|"([^"\\]|\\.)*");?$''')
+
+    def __init__(self):
+        self.address = None
+        self.pid = None
+
+    def start(self):
+        """Start the bus and return its address. Raises OSError if
+        dbus-launch is not available."""
+        output = subprocess.check_output(['dbus-launch', '--sh-syntax'])
+        for line in output.splitlines():
+            mobj = self._re_assign.match(line)
+            if not mobj:
+                continue
+            key = mobj.group(1)
+            value = mobj.group(2)
+            if value.startswith('"') or value.startswith("'"):
+                value = value[1:-1]
+            if key == 'DBUS_SESSION_BUS_ADDRESS':
+                self.address = value
+            elif key == 'DBUS_SESSION_BUS_PID':
+                self.pid = int(value)
+        return self.address
+
+    def stop(self):
+        """Stop the bus."""
+        if self.pid is None:
+            return
+        os.kill(self.pid, signal.SIGTERM)
+        self.pid = None
@@ -7,7 +7,10 @@
 # complete list.
 
 import time
+from threading import Thread
 from tdbus import *
+from tdbus import _tdbus
+from tdbus.batch import unpack, BATCH_MEMBER, PATH_BATCH
 from tdbus.test.base import *
 
 from nose.tools import assert_raises
@@ -40,3 +43,378 @@ class TestSimpleDBusConnection(BaseTest):
         name = conn.get_unique_name()
         assert name.startswith(':')
         conn.close()
+
+    def test_get_stats(self):
+        conn = SimpleDBusConnection(DBUS_BUS_SESSION)
+        conn.reset_stats()
+        conn.call_method(_tdbus.DBUS_PATH_DBUS, 'ListNames',
+                         _tdbus.DBUS_INTERFACE_DBUS,
+                         destination=_tdbus.DBUS_SERVICE_DBUS)
+        stats = conn.get_stats()
+        assert stats['method_call_sent'] == 1
+        assert stats['method_call_sent_bytes'] > 0
+        assert stats['method_return_received'] == 1
+        assert stats['method_return_received_bytes'] > 0
+        assert stats['dispatch_calls'] >= 1
+        assert stats['pending_calls'] == 0
+        assert stats['outgoing_size'] == 0
+        # The call was queued before it was written out.
+        assert stats['peak_outgoing_size'] >= stats['method_call_sent_bytes']
+        conn.reset_stats()
+        assert conn.get_stats()['method_call_sent'] == 0
+        # The gauge counts calls without a reply, not PendingCall objects.
+        replies = []
+        pending = conn.call_method(_tdbus.DBUS_PATH_DBUS, 'ListNames',
+                                   _tdbus.DBUS_INTERFACE_DBUS,
+                                   destination=_tdbus.DBUS_SERVICE_DBUS,
+                                   callback=replies.append)
+        assert conn.get_stats()['pending_calls'] == 1
+        pending.block()
+        assert len(replies) == 1
+        assert conn.get_stats()['pending_calls'] == 0
+        conn.close()
+
+    def test_can_send_type(self):
+        conn = SimpleDBusConnection(DBUS_BUS_SESSION)
+        assert conn.can_send_type('i')
+        assert conn.can_send_type('h')
+        conn.close()
+
+    def test_latency_tracking(self):
+        conn = SimpleDBusConnection(DBUS_BUS_SESSION)
+        conn.set_latency_tracking(True)
+        conn.call_method(_tdbus.DBUS_PATH_DBUS, 'ListNames',
+                         _tdbus.DBUS_INTERFACE_DBUS,
+                         destination=_tdbus.DBUS_SERVICE_DBUS)
+        histograms = conn.get_latency_histograms()
+        key = ('client', _tdbus.DBUS_INTERFACE_DBUS, 'ListNames')
+        assert list(histograms) == [key]
+        assert histograms[key].get_count() == 1
+        conn.set_latency_tracking(False)
+        assert conn.get_latency_histograms() == {}
+        conn.close()
+
+    def test_trace_hook(self):
+        conn = SimpleDBusConnection(DBUS_BUS_SESSION)
+        events = []
+        _tdbus.set_trace_hook(lambda *args: events.append(args))
+        try:
+            conn.call_method(_tdbus.DBUS_PATH_DBUS, 'ListNames',
+                             _tdbus.DBUS_INTERFACE_DBUS,
+                             destination=_tdbus.DBUS_SERVICE_DBUS)
+        finally:
+            _tdbus.set_trace_hook(None)
+        sends = [event for event in events if event[0] == 'send']
+        assert len(sends) == 1
+        serial, member, size = sends[0][1:]
+        assert member == 'ListNames'
+        assert size > 0
+        replies = [event for event in events if event[0] == 'reply']
+        assert len(replies) == 1
+        assert replies[0][1] == serial
+        assert replies[0][3] > 0
+        assert 'watch_handle' in [event[0] for event in events]
+        conn.close()
+
+    def test_shared_send(self):
+        receiver = SimpleDBusConnection(DBUS_BUS_SESSION)
+        handler = PingCounter(400)
+        handler.stop = receiver
+        receiver.add_handler(handler)
+        thread = Thread(target=receiver.dispatch)
+        thread.start()
+        sender = SimpleDBusConnection(DBUS_BUS_SESSION)
+        name = receiver.get_unique_name()
+        def send_pings():
+            for i in range(100):
+                sender.send_signal('/', 'Ping', IFACE_EXAMPLE, 'i', (i,),
+                                   destination=name)
+        senders = [ Thread(target=send_pings) for i in range(4) ]
+        for sender_thread in senders:
+            sender_thread.start()
+        for sender_thread in senders:
+            sender_thread.join()
+        # Messages that were queued while another thread was writing are
+        # only written out by a flush, as the sender does not run a loop.
+        sender._connection.flush()
+        thread.join(10)
+        assert not thread.is_alive()
+        assert handler.count == 400
+        assert sender.get_stats()['signal_sent'] == 400
+        sender.close()
+        receiver.close()
+
+    def test_shared_notify(self):
+        conn = SimpleDBusConnection(DBUS_BUS_SESSION)
+        thread = Thread(target=conn.dispatch)
+        thread.start()
+        replies = []
+        def call_methods():
+            for i in range(500):
+                message = _tdbus.Message(_tdbus.DBUS_MESSAGE_TYPE_METHOD_CALL,
+                                         path=_tdbus.DBUS_PATH_DBUS, member='GetId',
+                                         interface=_tdbus.DBUS_INTERFACE_DBUS,
+                                         destination=_tdbus.DBUS_SERVICE_DBUS)
+                pending = conn._connection.send_with_reply(message)
+                pending.set_notify(replies.append)
+        callers = [ Thread(target=call_methods) for i in range(3) ]
+        for caller in callers:
+            caller.start()
+        for caller in callers:
+            caller.join()
+        for i in range(100):
+            if len(replies) == 1500:
+                break
+            time.sleep(0.05)
+        conn.stop()
+        # Wake up the loop.
+        conn.send_signal('/', 'Ping', IFACE_EXAMPLE, 'i', (0,),
+                         destination=conn.get_unique_name())
+        thread.join()
+        assert len(replies) == 1500
+        conn.close()
+
+    def test_signal_coalescing(self):
+        receiver = SimpleDBusConnection(DBUS_BUS_SESSION)
+        handler = StateHandler(2)
+        handler.stop = receiver
+        receiver.add_handler(handler)
+        counter = PingCounter(None)
+        receiver.add_handler(counter)
+        thread = Thread(target=receiver.dispatch)
+        thread.start()
+        sender = SimpleDBusConnection(DBUS_BUS_SESSION)
+        name = receiver.get_unique_name()
+        for i in range(50):
+            for device in ('eth0', 'eth1'):
+                sender.send_signal('/', 'State', IFACE_EXAMPLE, 'si', (device, i),
+                                   destination=name)
+                sender.send_signal('/', 'Ping', IFACE_EXAMPLE, 'i', (i,),
+                                   destination=name)
+        sender._connection.flush()
+        thread.join(10)
+        assert not thread.is_alive()
+        assert sorted(handler.states) == [('eth0', 49), ('eth1', 49)]
+        # Handlers without a policy see every signal.
+        assert counter.count == 100
+        sender.close()
+        receiver.close()
+
+    def test_signal_coalescing_senders(self):
+        receiver = SimpleDBusConnection(DBUS_BUS_SESSION)
+        handler = StateHandler(2)
+        handler.stop = receiver
+        receiver.add_handler(handler)
+        thread = Thread(target=receiver.dispatch)
+        thread.start()
+        senders = [ SimpleDBusConnection(DBUS_BUS_SESSION) for i in range(2) ]
+        name = receiver.get_unique_name()
+        for i, sender in enumerate(senders):
+            sender.send_signal('/', 'State', IFACE_EXAMPLE, 'si', ('eth0', i),
+                               destination=name)
+            sender._connection.flush()
+        thread.join(10)
+        assert not thread.is_alive()
+        # The same key from different senders is not coalesced.
+        assert sorted(handler.states) == [('eth0', 0), ('eth0', 1)]
+        for sender in senders:
+            sender.close()
+        receiver.close()
+
+    def test_signal_batching(self):
+        receiver = SimpleDBusConnection(DBUS_BUS_SESSION)
+        handler = PingCounter(300)
+        handler.stop = receiver
+        receiver.add_handler(handler)
+        thread = Thread(target=receiver.dispatch)
+        thread.start()
+        sender = SimpleDBusConnection(DBUS_BUS_SESSION)
+        sender.enable_signal_batching([IFACE_EXAMPLE], max_size=8192)
+        name = receiver.get_unique_name()
+        for i in range(300):
+            sender.send_signal('/', 'Ping', IFACE_EXAMPLE, 'i', (i,),
+                               destination=name)
+        sender.flush_signals()
+        sender._connection.flush()
+        thread.join(10)
+        assert not thread.is_alive()
+        assert handler.count == 300
+        assert handler.args == range(300)
+        assert handler.senders == set([sender.get_unique_name()])
+        assert sender.get_stats()['signal_sent'] < 30
+        sender.close()
+        receiver.close()
+
+    def test_unpack_signals_only(self):
+        def batch(entries):
+            message = _tdbus.Message(_tdbus.DBUS_MESSAGE_TYPE_SIGNAL,
+                                     path=PATH_BATCH, interface=IFACE_EXAMPLE,
+                                     member=BATCH_MEMBER)
+            message.set_args('aay', (entries,))
+            return message
+        signal = _tdbus.Message(_tdbus.DBUS_MESSAGE_TYPE_SIGNAL, path='/',
+                                interface=IFACE_EXAMPLE, member='Ping')
+        call = _tdbus.Message(_tdbus.DBUS_MESSAGE_TYPE_METHOD_CALL, path='/',
+                              interface=IFACE_EXAMPLE, member='Echo')
+        nested = batch([signal.marshal()])
+        signals = unpack(batch([call.marshal(), nested.marshal(), 'garbage',
+                                signal.marshal()]))
+        assert len(signals) == 1
+        assert signals[0].get_member() == 'Ping'
+
+
+IFACE_EXAMPLE = 'com.example'
+
+
+class EchoHandler(DBusHandler):
+
+    @method(interface=IFACE_EXAMPLE)
+    def Echo(self, message):
+        self.set_response(message.get_signature(), message.get_args())
+
+    @method(interface=IFACE_EXAMPLE)
+    def Stop(self, message):
+        self.stop.stop()
+
+
+class PingCounter(DBusHandler):
+
+    def __init__(self, expected):
+        super(PingCounter, self).__init__()
+        self.expected = expected
+        self.count = 0
+        self.args = []
+        self.senders = set()
+
+    @signal_handler(interface=IFACE_EXAMPLE)
+    def Ping(self, message):
+        self.count += 1
+        self.args.append(message.get_args()[0])
+        self.senders.add(message.get_sender())
+        if self.count == self.expected:
+            self.stop.stop()
+
+
+class StateHandler(DBusHandler):
+
+    def __init__(self, expected):
+        super(StateHandler, self).__init__()
+        self.expected = expected
+        self.states = []
+
+    @signal_handler(interface=IFACE_EXAMPLE, coalesce=0.2, key=0)
+    def State(self, message):
+        self.states.append(message.get_args())
+        if len(self.states) == self.expected:
+            self.stop.stop()
+
+
+class TestPeerUpgrade(BaseTest):
+
+    def setup(self):
+        self.server = SimpleDBusConnection(DBUS_BUS_SESSION)
+        self.server.enable_peer_upgrade()
+        handler = EchoHandler()
+        handler.stop = self.server
+        self.server.add_handler(handler)
+        self.server_name = self.server.get_unique_name()
+        self.thread = Thread(target=self.server.dispatch)
+        self.thread.start()
+        self.client = SimpleDBusConnection(DBUS_BUS_SESSION)
+        self.client.enable_peer_upgrade()
+
+    def teardown(self):
+        self.client.call_method('/', 'Stop', IFACE_EXAMPLE,
+                                destination=self.server_name)
+        self.thread.join()
+        self.client.close()
+        self.server.close()
+
+    def echo(self, *args):
+        reply = self.client.call_method('/', 'Echo', IFACE_EXAMPLE, 's', args,
+                                        destination=self.server_name, timeout=10)
+        return reply.get_args()
+
+    def test_upgrade(self):
+        assert self.echo('foo') == ('foo',)
+        assert self.client.get_peer(self.server_name) is not None
+        received = self.server.get_stats()['method_call_received']
+        for i in range(10):
+            assert self.echo('bar%d' % i) == ('bar%d' % i,)
+        assert self.server.get_stats()['method_call_received'] == received
+
+    def test_fallback(self):
+        assert self.echo('foo') == ('foo',)
+        peer = self.client.get_peer(self.server_name)
+        assert peer is not None
+        peer.close()
+        assert self.echo('bar') == ('bar',)
+        assert self.client.get_peer(self.server_name) is None
+
+    def test_not_upgradable(self):
+        self.client.call_method(_tdbus.DBUS_PATH_DBUS, 'ListNames',
+                                _tdbus.DBUS_INTERFACE_DBUS,
+                                destination=_tdbus.DBUS_SERVICE_DBUS)
+        self.client.call_method(_tdbus.DBUS_PATH_DBUS, 'ListNames',
+                                _tdbus.DBUS_INTERFACE_DBUS,
+                                destination=_tdbus.DBUS_SERVICE_DBUS)
+        assert self.client.get_peer(_tdbus.DBUS_SERVICE_DBUS) is None
+        # The bus is not even asked for a peer address.
+        assert _tdbus.DBUS_SERVICE_DBUS not in self.client._peers
+
+    def test_probe_no_auto_start(self):
+        messages = []
+        send_with_reply = self.client._send_with_reply
+        def record(message, timeout):
+            messages.append(message)
+            return send_with_reply(message, timeout)
+        self.client._send_with_reply = record
+        self.client._route('com.example.NotRunning')
+        del self.client._send_with_reply
+        assert len(messages) == 1
+        assert messages[0].get_member() == 'GetPeerAddress'
+        assert not messages[0].get_auto_start()
+
+    def test_set_peer_name_over_bus(self):
+        from tdbus.peer import PATH_PEER, IFACE_PEER
+        other = SimpleDBusConnection(DBUS_BUS_SESSION)
+        # A bus client cannot register the bus connection as a peer ...
+        assert_raises(DBusError, other.call_method, PATH_PEER, 'SetPeerName',
+                      IFACE_PEER, 's', ('org.victim',),
+                      destination=self.server_name)
+        # ... and cannot make it drop peers with a fake NameOwnerChanged.
+        other.send_signal(_tdbus.DBUS_PATH_DBUS, 'NameOwnerChanged',
+                          _tdbus.DBUS_INTERFACE_DBUS, 'sss', ('org.victim', '', ''),
+                          destination=self.server_name)
+        reply = other.call_method('/', 'Echo', IFACE_EXAMPLE, 's', ('foo',),
+                                  destination=self.server_name)
+        assert reply.get_args() == ('foo',)
+        assert 'org.victim' not in self.server._peers
+        assert self.server.get_is_connected()
+        other.close()
+        assert self.echo('bar') == ('bar',)
+
+    def test_peer_match_rules(self):
+        name = 'com.example.PeerUpgrade'
+        self.server.call_method(_tdbus.DBUS_PATH_DBUS, 'RequestName',
+                                _tdbus.DBUS_INTERFACE_DBUS, 'su', (name, 0),
+                                destination=_tdbus.DBUS_SERVICE_DBUS)
+        calls = []
+        peer_match = self.client._peer_match
+        def record(member, destination):
+            calls.append(member)
+            peer_match(member, destination)
+        self.client._peer_match = record
+        for i in range(5):
+            for j in range(2):
+                reply = self.client.call_method('/', 'Echo', IFACE_EXAMPLE, 's',
+                                                ('foo',), destination=name)
+                assert reply.get_args() == ('foo',)
+            peer = self.client.get_peer(name)
+            assert peer is not None
+            peer.close()
+            self.client.get_peer(name)
+            # Every upgrade adds the rule once, and dropping the peer
+            # removes it again.
+            assert calls == ['AddMatch', 'RemoveMatch'] * (i+1)
+        del self.client._peer_match
@@ -0,0 +1,161 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+import os
+import time
+import threading
+from threading import Thread
+
+from tdbus import *
+from tdbus import _tdbus
+from tdbus.credentials import CredentialsCache
+from tdbus.test.base import BaseTest
+from nose.tools import assert_raises
+
+IFACE_EXAMPLE = 'com.example'
+
+
+class AuthHandler(DBusHandler):
+
+    @method(interface=IFACE_EXAMPLE)
+    def WhoAmI(self, message):
+        credentials = self.get_sender_credentials()
+        self.set_response('uu', (credentials['UnixUserID'],
+                                 credentials['ProcessID']))
+
+    @method(interface=IFACE_EXAMPLE)
+    def IsCached(self, message):
+        name = message.get_args()[0]
+        self.set_response('b', (name in self.connection._credentials.credentials,))
+
+    @method(interface=IFACE_EXAMPLE)
+    def Lookups(self, message):
+        self.set_response('u', (self.connection.get_stats()['method_call_sent'],))
+
+    @method(interface=IFACE_EXAMPLE)
+    def Stop(self, message):
+        self.connection.stop()
+
+
+class SlowBus(object):
+    """Answers GetConnectionCredentials after `release` is set."""
+
+    Event = threading.Event
+    get_current = staticmethod(threading.current_thread)
+
+    def __init__(self):
+        self.calls = 0
+        self.release = threading.Event()
+
+    def call_method(self, path, member, interface=None, format=None, args=None,
+                    destination=None):
+        self.calls += 1
+        self.release.wait()
+        reply = _tdbus.Message(_tdbus.DBUS_MESSAGE_TYPE_METHOD_RETURN)
+        reply.set_args('a{sv}', ({'UnixUserID': ('u', 1000)},))
+        return reply
+
+
+class TestCredentials(BaseTest):
+
+    @classmethod
+    def setup_class(cls):
+        super(TestCredentials, cls).setup_class()
+        conn = SimpleDBusConnection(DBUS_BUS_SESSION)
+        conn.add_handler(AuthHandler())
+        cls.server_name = conn.get_unique_name()
+        cls.server = Thread(target=conn.dispatch)
+        cls.server.start()
+
+    @classmethod
+    def teardown_class(cls):
+        client = SimpleDBusConnection(DBUS_BUS_SESSION)
+        client.call_method('/', 'Stop', IFACE_EXAMPLE, destination=cls.server_name)
+        cls.server.join()
+        super(TestCredentials, cls).teardown_class()
+
+    def call(self, client, member, format=None, args=None):
+        reply = client.call_method('/', member, IFACE_EXAMPLE, format, args,
+                                   destination=self.server_name)
+        return reply.get_args()
+
+    def test_cached(self):
+        client = SimpleDBusConnection(DBUS_BUS_SESSION)
+        assert self.call(client, 'WhoAmI') == (os.getuid(), os.getpid())
+        lookups = self.call(client, 'Lookups')[0]
+        for i in range(10):
+            assert self.call(client, 'WhoAmI') == (os.getuid(), os.getpid())
+        assert self.call(client, 'Lookups')[0] == lookups
+        client.close()
+
+    def test_invalidated(self):
+        client = SimpleDBusConnection(DBUS_BUS_SESSION)
+        name = client.get_unique_name()
+        self.call(client, 'WhoAmI')
+        client.close()
+        other = SimpleDBusConnection(DBUS_BUS_SESSION)
+        for i in range(50):
+            if not self.call(other, 'IsCached', 's', (name,))[0]:
+                break
+            time.sleep(0.05)
+        else:
+            raise AssertionError('credentials were not invalidated')
+        other.close()
+
+    def test_unknown_name(self):
+        client = SimpleDBusConnection(DBUS_BUS_SESSION)
+        assert_raises(DBusError, client.get_credentials, ':1.999999')
+        assert client.get_credentials(client.get_unique_name())['ProcessID'] == os.getpid()
+        client.close()
+
+    def test_coalesced(self):
+        bus = SlowBus()
+        cache = CredentialsCache(bus)
+        results = []
+        def lookup():
+            results.append(cache.get_credentials(':1.1'))
+        threads = [ Thread(target=lookup) for i in range(5) ]
+        for thread in threads:
+            thread.start()
+        while not cache._pending:
+            time.sleep(0.01)
+        time.sleep(0.05)
+        bus.release.set()
+        for thread in threads:
+            thread.join()
+        assert bus.calls == 1
+        assert results == [{'UnixUserID': 1000}] * 5
+        assert cache.get_credentials(':1.1') == {'UnixUserID': 1000}
+        assert bus.calls == 1
+
+    def test_coalesced_race(self):
+        # A lookup that is started between the check for a pending lookup
+        # and its registration must still be coalesced.
+        class RacyDict(dict):
+            # Lets two threads read the dict before either can change it.
+            calls = []
+            both = threading.Event()
+            def get(self, key, default=None):
+                value = dict.get(self, key, default)
+                self.calls.append(key)
+                if len(self.calls) == 2:
+                    self.both.set()
+                self.both.wait(0.2)
+                return value
+        bus = SlowBus()
+        cache = CredentialsCache(bus)
+        cache._pending = RacyDict()
+        threads = [ Thread(target=cache.get_credentials, args=(':1.1',))
+                    for i in range(2) ]
+        for thread in threads:
+            thread.start()
+        time.sleep(0.2)
+        bus.release.set()
+        for thread in threads:
+            thread.join()
+        assert bus.calls == 1
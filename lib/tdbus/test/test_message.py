@@ -6,8 +6,10 @@
 # Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
 # complete list.
 
+import os
 import math
 import time
+import tempfile
 from threading import Thread, currentThread
 
 import tdbus
@@ -152,6 +154,64 @@ class MessageTest(BaseTest):
     def test_arg_invalid_variant(self):
         assert_raises(DBusError, self.echo, 'v', (('ii', (1,2)),))
 
+    def test_arg_variant_inferred(self):
+        assert self.echo('v', (10,)) == (('i', 10),)
+        assert self.echo('v', (1<<40,)) == (('x', 1<<40),)
+        assert self.echo('v', (1<<63,)) == (('t', 1<<63),)
+        assert self.echo('v', (5L,)) == (('i', 5),)
+        assert self.echo('v', (True,)) == (('b', True),)
+        assert self.echo('v', (1.5,)) == (('d', 1.5),)
+        assert self.echo('v', ('foo',)) == (('s', 'foo'),)
+        assert self.echo('v', (['foo', 'bar', 'baz'],)) == \
+                    (('as', ['foo', 'bar', 'baz']),)
+        assert self.echo('v', ([1, 'foo', 2],)) == \
+                    (('av', [('i', 1), ('s', 'foo'), ('i', 2)]),)
+        assert self.echo('v', ({'foo': 1},)) == (('a{si}', {'foo': 1}),)
+        assert self.echo('v', ({'foo': 1, 'bar': 'baz'},)) == \
+                    (('a{sv}', {'foo': ('i', 1), 'bar': ('s', 'baz')}),)
+        assert_raises(DBusError, self.echo, 'v', (object(),))
+
+    def test_arg_variant_pair(self):
+        # Any sequence of two items is a (signature, value) pair.
+        assert self.echo('v', (['s', 'foo'],)) == (('s', 'foo'),)
+        assert self.echo('v', (['ai', [1, 2]],)) == (('ai', [1, 2]),)
+        assert self.echo('v', (('(si)', ('foo', 1)),)) == (('(si)', ('foo', 1)),)
+        assert_raises(DBusError, self.echo, 'v', ((u's', 'foo'),))
+        assert_raises(DBusError, self.echo, 'v', ((1, 'foo'),))
+        assert_raises(DBusError, self.echo, 'v', (('foo', 1),))
+        assert_raises(DBusError, self.echo, 'v', (['foo', 'bar'],))
+
+    def test_arg_inferred(self):
+        assert self.echo(None, (1, 'foo', True)) == (1, 'foo', True)
+        assert self.echo(None, ([(1, 'foo'), (2, 'bar')],)) == \
+                    ([(1, 'foo'), (2, 'bar')],)
+        assert self.echo(None, ({'foo': [1, 1<<40]},)) == ({'foo': [1, 1<<40]},)
+        assert self.echo(None, ([1, 'foo'],)) == ([('i', 1), ('s', 'foo')],)
+        assert_raises(DBusError, self.echo, None, (None,))
+
+    def test_infer_signature(self):
+        infer = tdbus._tdbus.infer_signature
+        assert infer((1, 1<<40, 1<<63, 1.5, True, 'foo')) == 'ixtdbs'
+        assert infer(([(1, 'foo')],)) == 'a(is)'
+        assert infer(([1, 1<<40],)) == 'ax'
+        assert infer((5L, -5L, 1L<<40, -1L<<40)) == 'iixx'
+        assert infer(([5L, 5],)) == 'ai'
+        struct = tuple(range(130))
+        assert infer(([struct, struct],)) == 'a(%s)' % ('i' * 130)
+        assert infer(([], {})) == 'ava{sv}'
+        assert infer(({'foo': 1},)) == 'a{si}'
+        assert infer(({'foo': 1, 'bar': 'baz'},)) == 'a{sv}'
+        assert infer((1,)) is infer((2,))
+        assert_raises(DBusError, infer, ((),))
+        assert_raises(DBusError, infer, ({(1,): 1},))
+
+    def test_arg_property_map(self):
+        props = {'Name': 'foo', 'Size': 10, 'Tags': ['a', 'b', 'c'],
+                 'Mode': ('q', 2)}
+        result = self.echo('a{sv}', (props,))
+        assert result == ({'Name': ('s', 'foo'), 'Size': ('i', 10),
+                           'Tags': ('as', ['a', 'b', 'c']), 'Mode': ('q', 2)},)
+
     def test_arg_multi(self):
         assert self.echo('ii', (1, 2)) == (1, 2)
         assert self.echo('iii', (1, 2, 3)) == (1, 2, 3)
@@ -194,6 +254,92 @@ class MessageTest(BaseTest):
     def test_arg_byte_array_illegal_type(self):
         assert_raises(DBusError, self.echo, 'ay', ([1,2,3],))
 
+    def test_arg_unix_fd(self):
+        rfd, wfd = os.pipe()
+        try:
+            os.write(wfd, 'foo')
+            result = self.echo('h', (rfd,))
+            assert isinstance(result[0], UnixFd)
+            assert result[0].fileno() not in (rfd, wfd)
+            assert os.read(result[0].fileno(), 3) == 'foo'
+        finally:
+            os.close(rfd)
+            os.close(wfd)
+
+    def test_arg_unix_fd_fileno(self):
+        with tempfile.TemporaryFile() as fout:
+            fout.write('bar')
+            fout.flush()
+            result = self.echo('(sh)', (('file', fout),))
+            fd = result[0][1].take()
+            os.lseek(fd, 0, os.SEEK_SET)
+            assert os.read(fd, 3) == 'bar'
+            os.close(fd)
+
+    def test_arg_unix_fd_array(self):
+        rfd, wfd = os.pipe()
+        try:
+            result = self.echo('ah', ([rfd, wfd, UnixFd(rfd)],))
+            assert len(result[0]) == 3
+            assert all(isinstance(fd, UnixFd) for fd in result[0])
+        finally:
+            os.close(rfd)
+            os.close(wfd)
+
+    def test_arg_unix_fd_illegal(self):
+        assert_raises(DBusError, self.echo, 'h', (-1,))
+        assert_raises(DBusError, self.echo, 'h', ('foo',))
+
+    def test_marshal(self):
+        message = tdbus._tdbus.Message(tdbus._tdbus.DBUS_MESSAGE_TYPE_METHOD_CALL,
+                                       path='/', member='Echo',
+                                       interface=IFACE_EXAMPLE)
+        message.set_args('sa{si}', ('foo', {'bar': 1}))
+        copy = tdbus._tdbus.demarshal(message.marshal())
+        assert copy.get_member() == 'Echo'
+        assert copy.get_args() == ('foo', {'bar': 1})
+        assert copy.get_serial() != 0
+        assert copy.copy().get_serial() == 0
+        data = message.marshal()
+        assert_raises(DBusError, tdbus._tdbus.demarshal, data[:-1])
+
+    def test_get_size(self):
+        for format, args in [('', ()),
+                             ('sivay(ix)', ('foo', 1, ('as', ['a', 'bc']), 'xyz', (2, 3))),
+                             ('yad', (1, [1.5, 2.5])),
+                             ('aas', ([['a'], [], ['bcd']],)),
+                             ('a{sv}', ({'Name': ('s', 'foo'), 'Size': ('t', 10)},)),
+                             ('a{oa{sa{sv}}}', ({'/a': {IFACE_EXAMPLE: {'x': ('ay', 'y')}}},))]:
+            message = tdbus._tdbus.Message(tdbus._tdbus.DBUS_MESSAGE_TYPE_METHOD_CALL,
+                                           path='/', member='Echo',
+                                           interface=IFACE_EXAMPLE)
+            if format:
+                message.set_args(format, args)
+            assert message.get_size() == len(message.marshal())
+
+    def test_interned_strings(self):
+        message = tdbus._tdbus.Message(tdbus._tdbus.DBUS_MESSAGE_TYPE_METHOD_CALL,
+                                       path='/', member='Echo',
+                                       interface=IFACE_EXAMPLE)
+        message.set_args('a{sv}a{sv}', ({'Name': ('s', 'foo')},
+                                         {'Name': ('i', 1)}))
+        copy = tdbus._tdbus.demarshal(message.marshal())
+        assert copy.get_member() is message.get_member()
+        assert copy.get_interface() is message.get_interface()
+        first, second = copy.get_args()
+        assert first.keys()[0] is second.keys()[0]
+        assert first['Name'][0] is copy.get_args()[0]['Name'][0]
+
+    def test_get_args_unwrap(self):
+        message = tdbus._tdbus.Message(tdbus._tdbus.DBUS_MESSAGE_TYPE_METHOD_CALL,
+                                       path='/', member='Echo',
+                                       interface=IFACE_EXAMPLE)
+        message.set_args('a{sv}v', ({'Name': 'foo', 'Map': {'Size': 10}},
+                                    ('ai', [1, 2])))
+        assert message.get_args(unwrap=True) == \
+                    ({'Name': 'foo', 'Map': {'Size': 10}}, [1, 2])
+        assert message.get_args()[1] == ('ai', [1, 2])
+
 
 class EchoHandler(DBusHandler):
 
@@ -236,6 +382,33 @@ class TestMessageSimple(MessageTest):
         return reply.get_args()
 
 
+class TestMessagePeer(MessageTest):
+    """Run the message tests over a direct peer to peer connection."""
+
+    @classmethod
+    def setup_class(cls):
+        super(TestMessagePeer, cls).setup_class()
+        cls.server = SimpleDBusServer('unix:tmpdir=/tmp')
+        cls.server.add_handler(EchoHandler())
+        cls.server_thread = Thread(target=cls.server.dispatch)
+        cls.server_thread.start()
+        cls.client = SimpleDBusConnection(cls.server.get_address(), register=False)
+
+    @classmethod
+    def teardown_class(cls):
+        cls.server.stop()
+        cls.client.close()
+        cls.server_thread.join()
+        cls.server.close()
+        super(TestMessagePeer, cls).teardown_class()
+
+    @classmethod
+    def echo(cls, format=None, args=None):
+        reply = cls.client.call_method('/', 'Echo', IFACE_EXAMPLE, format, args,
+                                       timeout=10)
+        return reply.get_args()
+
+
 class TestMessageGEvent(MessageTest):
 
     @classmethod
@@ -252,3 +425,12 @@ class TestMessageGEvent(MessageTest):
         reply = cls.client.call_method('/', 'Echo', IFACE_EXAMPLE, format, args,
                                        destination=cls.server_name, timeout=10)
         return reply.get_args()
+
+    def test_call_method_callback(self):
+        import gevent.event
+        result = gevent.event.AsyncResult()
+        pending = self.client.call_method('/', 'Echo', IFACE_EXAMPLE, 's',
+                                          ('foo',), destination=self.server_name,
+                                          callback=result.set, timeout=10)
+        assert isinstance(pending, tdbus._tdbus.PendingCall)
+        assert result.get(timeout=10).get_args() == ('foo',)
@@ -0,0 +1,108 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+from tdbus import _tdbus
+from tdbus.metrics import format_histograms
+
+
+class TestHistogram(object):
+
+    def test_record(self):
+        hist = _tdbus.Histogram()
+        for value in (0, 1, 7, 100, 1000):
+            hist.record(value)
+        snapshot = hist.snapshot()
+        assert snapshot['count'] == 5
+        assert snapshot['sum'] == 1108
+        assert sum(count for bound, count in snapshot['buckets']) == 5
+        assert hist.get_count() == 5
+
+    def test_bucket_precision(self):
+        hist = _tdbus.Histogram()
+        for value in (10, 100, 1000, 10000, 100000):
+            hist.record(value)
+        bounds = [bound for bound, count in hist.snapshot()['buckets']]
+        for value, bound in zip((10, 100, 1000, 10000, 100000), bounds):
+            assert value <= bound <= value * 1.125
+
+    def test_inclusive_bounds(self):
+        hist = _tdbus.Histogram()
+        for value in (0, 1, 8, 16, 17, 1024, 1025):
+            hist.record(value)
+        assert hist.snapshot()['buckets'] == \
+                    [(1, 2), (8, 1), (16, 1), (18, 1), (1024, 1), (1152, 1)]
+
+    def test_large_value(self):
+        hist = _tdbus.Histogram()
+        hist.record(2**50)
+        snapshot = hist.snapshot()
+        assert snapshot['count'] == 1
+        assert len(snapshot['buckets']) == 1
+
+    def test_snapshot_reset(self):
+        hist = _tdbus.Histogram()
+        hist.record(10)
+        assert hist.snapshot(True)['count'] == 1
+        assert hist.snapshot()['count'] == 0
+        assert hist.snapshot()['buckets'] == []
+
+    def test_reset(self):
+        hist = _tdbus.Histogram()
+        hist.record(10)
+        hist.reset()
+        assert hist.get_count() == 0
+
+
+class TestPrometheus(object):
+
+    def test_format(self):
+        hist = _tdbus.Histogram()
+        hist.record(10)
+        hist.record(1000)
+        text = format_histograms({('server', 'com.example', 'Echo'): hist},
+                                 buckets=[16, 1024])
+        lines = text.splitlines()
+        labels = 'side="server",interface="com.example",member="Echo"'
+        assert lines[1] == '# TYPE tdbus_method_latency_seconds histogram'
+        assert 'tdbus_method_latency_seconds_bucket{%s,le="1.6e-05"} 1' % labels in lines
+        assert 'tdbus_method_latency_seconds_bucket{%s,le="0.001024"} 2' % labels in lines
+        assert 'tdbus_method_latency_seconds_bucket{%s,le="+Inf"} 2' % labels in lines
+        assert 'tdbus_method_latency_seconds_count{%s} 2' % labels in lines
+
+    def test_format_bounds(self):
+        hist = _tdbus.Histogram()
+        hist.record(16)
+        hist.record(17)
+        hist.record(1000)
+        text = format_histograms({('server', 'com.example', 'Echo'): hist},
+                                 buckets=[16, 1000])
+        lines = text.splitlines()
+        labels = 'side="server",interface="com.example",member="Echo"'
+        # A value equal to a bound is counted in it.
+        assert 'tdbus_method_latency_seconds_bucket{%s,le="1.6e-05"} 1' % labels in lines
+        # Other bounds are rounded down to a bucket bound.
+        assert 'tdbus_method_latency_seconds_bucket{%s,le="0.00096"} 2' % labels in lines
+
+    def test_format_count(self):
+        # A snapshot that raced with record() has more values in its
+        # buckets than in its count.
+        class Racy(object):
+            def snapshot(self, reset=False):
+                return { 'count': 1, 'sum': 30, 'buckets': [(8, 1), (32, 2)] }
+        text = format_histograms({('server', 'com.example', 'Echo'): Racy()},
+                                 buckets=[8, 32])
+        lines = text.splitlines()
+        labels = 'side="server",interface="com.example",member="Echo"'
+        assert 'tdbus_method_latency_seconds_bucket{%s,le="3.2e-05"} 3' % labels in lines
+        assert 'tdbus_method_latency_seconds_bucket{%s,le="+Inf"} 3' % labels in lines
+        assert 'tdbus_method_latency_seconds_count{%s} 3' % labels in lines
+
+    def test_escape(self):
+        hist = _tdbus.Histogram()
+        text = format_histograms({('client', None, 'Foo"'): hist})
+        assert 'interface="",member="Foo\\""' in text
@@ -0,0 +1,75 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+from tdbus import *
+from tdbus import _tdbus
+from tdbus.test.base import BaseTest
+from nose.tools import assert_raises
+
+SERVICE_EXAMPLE = 'com.example.Names'
+
+
+class TestNameTracking(BaseTest):
+
+    def setup(self):
+        self.client = SimpleDBusConnection(DBUS_BUS_SESSION)
+        self.client.enable_name_tracking()
+
+    def teardown(self):
+        self.client.close()
+
+    def bus_call(self, connection, member, format=None, args=None):
+        reply = connection.call_method(_tdbus.DBUS_PATH_DBUS, member,
+                                       _tdbus.DBUS_INTERFACE_DBUS, format, args,
+                                       destination=_tdbus.DBUS_SERVICE_DBUS)
+        return reply.get_args()
+
+    def sync(self):
+        # Signals that were sent before the reply are dispatched while
+        # waiting for it.
+        self.bus_call(self.client, 'GetId')
+
+    def test_lookup(self):
+        name = self.client.get_unique_name()
+        assert self.client.get_name_owner(name) == name
+        assert self.client.get_name_owner(_tdbus.DBUS_SERVICE_DBUS) == \
+                    _tdbus.DBUS_SERVICE_DBUS
+        assert self.client.name_has_owner(name)
+        assert not self.client.name_has_owner(SERVICE_EXAMPLE)
+        assert self.client.get_name_owner(SERVICE_EXAMPLE) is None
+
+    def test_no_round_trips(self):
+        self.client.get_name_owner(_tdbus.DBUS_SERVICE_DBUS)
+        sent = self.client.get_stats()['method_call_sent']
+        for i in range(100):
+            self.client.get_name_owner(_tdbus.DBUS_SERVICE_DBUS)
+            self.client.get_name_owner(SERVICE_EXAMPLE)
+            self.client.name_has_owner(self.client.get_unique_name())
+        assert self.client.get_stats()['method_call_sent'] == sent
+
+    def test_owner_changed(self):
+        changes = []
+        self.client.add_name_owner_callback(
+                lambda *args: changes.append(args), SERVICE_EXAMPLE)
+        other = SimpleDBusConnection(DBUS_BUS_SESSION)
+        self.bus_call(other, 'RequestName', 'su', (SERVICE_EXAMPLE, 0))
+        self.sync()
+        owner = other.get_unique_name()
+        assert self.client.get_name_owner(SERVICE_EXAMPLE) == owner
+        assert self.client.get_name_owner(owner) == owner
+        assert changes == [(SERVICE_EXAMPLE, None, owner)]
+        other.close()
+        self.sync()
+        assert self.client.get_name_owner(SERVICE_EXAMPLE) is None
+        assert not self.client.name_has_owner(owner)
+        assert changes[-1] == (SERVICE_EXAMPLE, owner, None)
+
+    def test_not_enabled(self):
+        conn = SimpleDBusConnection(DBUS_BUS_SESSION)
+        assert_raises(DBusError, conn.get_name_owner, SERVICE_EXAMPLE)
+        conn.close()
@@ -0,0 +1,126 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+from threading import Thread
+
+from tdbus import *
+from tdbus import _tdbus
+from tdbus.objectmanager import IFACE_OBJECT_MANAGER
+from tdbus.test.base import BaseTest
+from nose.tools import assert_raises
+
+IFACE_EXAMPLE = 'com.example'
+IFACE_DEVICE = 'com.example.Device'
+PATH_ROOT = '/com/example'
+
+
+class DeviceManagerHandler(DBusHandler):
+
+    def __init__(self, manager):
+        super(DeviceManagerHandler, self).__init__()
+        self.manager = manager
+
+    @method(interface=IFACE_EXAMPLE)
+    def AddDevice(self, message):
+        path, name = message.get_args()
+        self.manager.add_object(path, { IFACE_DEVICE: { 'Name': name,
+                                                        'Level': ('u', 1) } })
+
+    @method(interface=IFACE_EXAMPLE)
+    def RemoveDevice(self, message):
+        self.manager.remove_object(message.get_args()[0])
+
+    @method(interface=IFACE_EXAMPLE)
+    def Stop(self, message):
+        self.connection.stop()
+
+
+class SignalHandler(DBusHandler):
+
+    def __init__(self):
+        super(SignalHandler, self).__init__()
+        self.signals = []
+
+    @signal_handler(interface=IFACE_OBJECT_MANAGER)
+    def InterfacesAdded(self, message):
+        self.signals.append(('added',) + message.get_args(unwrap=True))
+
+    @signal_handler(interface=IFACE_OBJECT_MANAGER)
+    def InterfacesRemoved(self, message):
+        self.signals.append(('removed',) + message.get_args())
+
+
+class TestObjectManager(BaseTest):
+
+    @classmethod
+    def setup_class(cls):
+        super(TestObjectManager, cls).setup_class()
+        conn = SimpleDBusConnection(DBUS_BUS_SESSION)
+        cls.manager = ObjectManager(conn, PATH_ROOT)
+        cls.manager.add_object(PATH_ROOT + '/eth0',
+                               { IFACE_DEVICE: { 'Name': 'eth0', 'Level': ('u', 3) },
+                                 'com.example.Stats': {} })
+        conn.add_handler(DeviceManagerHandler(cls.manager))
+        cls.server_name = conn.get_unique_name()
+        cls.server = Thread(target=conn.dispatch)
+        cls.server.start()
+
+    @classmethod
+    def teardown_class(cls):
+        client = SimpleDBusConnection(DBUS_BUS_SESSION)
+        client.call_method('/', 'Stop', IFACE_EXAMPLE, destination=cls.server_name)
+        cls.server.join()
+        super(TestObjectManager, cls).teardown_class()
+
+    def setup(self):
+        self.client = SimpleDBusConnection(DBUS_BUS_SESSION)
+
+    def teardown(self):
+        self.client.close()
+
+    def call(self, member, format=None, args=None, path=PATH_ROOT):
+        reply = self.client.call_method(path, member, IFACE_EXAMPLE, format, args,
+                                        destination=self.server_name)
+        return reply.get_args()
+
+    def get_managed_objects(self, path=PATH_ROOT):
+        reply = self.client.call_method(path, 'GetManagedObjects',
+                                        IFACE_OBJECT_MANAGER,
+                                        destination=self.server_name)
+        return reply.get_args(unwrap=True)[0]
+
+    def test_get_managed_objects(self):
+        objects = self.get_managed_objects()
+        assert objects[PATH_ROOT + '/eth0'] == \
+                    { IFACE_DEVICE: { 'Name': 'eth0', 'Level': 3 },
+                      'com.example.Stats': {} }
+        snapshot = self.manager.get_snapshot()
+        assert self.get_managed_objects() == objects
+        assert self.manager.get_snapshot() is snapshot
+
+    def test_wrong_path(self):
+        assert_raises(DBusError, self.get_managed_objects, '/')
+
+    def test_signals(self):
+        handler = SignalHandler()
+        self.client.add_handler(handler)
+        self.client.call_method(_tdbus.DBUS_PATH_DBUS, 'AddMatch',
+                                _tdbus.DBUS_INTERFACE_DBUS, 's',
+                                ("type='signal',interface='%s'" % IFACE_OBJECT_MANAGER,),
+                                destination=_tdbus.DBUS_SERVICE_DBUS)
+        path = PATH_ROOT + '/wlan0'
+        snapshot = self.manager.get_snapshot()
+        self.call('AddDevice', 'os', (path, 'wlan0'))
+        assert handler.signals == \
+                [('added', path, { IFACE_DEVICE: { 'Name': 'wlan0', 'Level': 1 } })]
+        assert self.get_managed_objects()[path] == \
+                    { IFACE_DEVICE: { 'Name': 'wlan0', 'Level': 1 } }
+        assert self.manager.get_snapshot() is not snapshot
+        self.call('RemoveDevice', 'o', (path,))
+        assert handler.signals[-1] == ('removed', path, [IFACE_DEVICE])
+        assert path not in self.get_managed_objects()
@@ -0,0 +1,80 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+from threading import Thread
+
+from tdbus import *
+from tdbus import _tdbus
+from tdbus.test.base import BaseTest
+from nose.tools import assert_raises
+
+
+class TestConnectionPool(BaseTest):
+
+    def list_names(self, pool, count):
+        for i in range(count):
+            reply = pool.call_method(_tdbus.DBUS_PATH_DBUS, 'ListNames',
+                                     _tdbus.DBUS_INTERFACE_DBUS,
+                                     destination=_tdbus.DBUS_SERVICE_DBUS)
+            names = reply.get_args()[0]
+        return names
+
+    def calls_per_connection(self, pool):
+        return [ conn.get_stats()['method_call_sent'] for conn in pool.connections ]
+
+    def test_connections(self):
+        pool = ConnectionPool(SimpleDBusConnection, DBUS_BUS_SESSION, 3)
+        names = self.list_names(pool, 1)
+        for conn in pool.connections:
+            assert conn.get_unique_name() in names
+        pool.close()
+
+    def test_round_robin(self):
+        pool = ConnectionPool(SimpleDBusConnection, DBUS_BUS_SESSION, 3,
+                              policy='round_robin')
+        self.list_names(pool, 6)
+        assert self.calls_per_connection(pool) == [2, 2, 2]
+        assert pool.get_stats()['method_call_sent'] == 6
+        pool.close()
+
+    def test_destination(self):
+        pool = ConnectionPool(SimpleDBusConnection, DBUS_BUS_SESSION, 3)
+        self.list_names(pool, 6)
+        assert sorted(self.calls_per_connection(pool)) == [0, 0, 6]
+        pool.close()
+
+    def test_thread(self):
+        pool = ConnectionPool(SimpleDBusConnection, DBUS_BUS_SESSION, 4,
+                              policy='thread')
+        threads = [ Thread(target=self.list_names, args=(pool, 10))
+                    for i in range(4) ]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        assert pool.get_stats()['method_call_sent'] == 40
+        pool.close()
+
+    def test_custom_policy(self):
+        pool = ConnectionPool(SimpleDBusConnection, DBUS_BUS_SESSION, 2,
+                              policy=lambda pool, destination: 1)
+        self.list_names(pool, 3)
+        assert self.calls_per_connection(pool) == [0, 3]
+        pool.close()
+
+    def test_signal_connection(self):
+        pool = ConnectionPool(SimpleDBusConnection, DBUS_BUS_SESSION, 2)
+        handler = DBusHandler()
+        pool.add_handler(handler)
+        assert pool.get_signal_connection().handlers == [handler]
+        assert pool.connections[1].handlers == []
+        pool.close()
+
+    def test_illegal_size(self):
+        assert_raises(ValueError, ConnectionPool, SimpleDBusConnection,
+                      DBUS_BUS_SESSION, 0)
@@ -0,0 +1,304 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+import time
+from threading import Thread
+
+from tdbus import *
+from tdbus import _tdbus
+from tdbus.properties import IFACE_PROPERTIES
+from tdbus.test.base import BaseTest
+from nose.tools import assert_raises
+
+IFACE_EXAMPLE = 'com.example'
+SERVICE_EXAMPLE = 'com.example.Properties'
+
+
+class DeviceHandler(DBusHandler):
+
+    def __init__(self):
+        super(DeviceHandler, self).__init__()
+        self.reset()
+        self.calls = 0
+
+    def reset(self):
+        self.properties = { 'Name': ('s', 'eth0'), 'Level': ('i', 1) }
+
+    @method(interface=IFACE_PROPERTIES)
+    def GetAll(self, message):
+        self.calls += 1
+        self.set_response('a{sv}', (self.properties,))
+
+    @method(interface=IFACE_PROPERTIES)
+    def Get(self, message):
+        self.calls += 1
+        interface, name = message.get_args()
+        self.set_response('v', (self.properties[name],))
+
+    @method(interface=IFACE_EXAMPLE)
+    def Change(self, message):
+        name, value, invalidate = message.get_args()
+        self.properties[name] = value
+        changed = {} if invalidate else { name: value }
+        invalidated = [name] if invalidate else []
+        for path in ('/', '/other'):
+            self.connection.send_signal(path, 'PropertiesChanged', IFACE_PROPERTIES,
+                                        'sa{sv}as', (IFACE_EXAMPLE, changed, invalidated))
+        self.connection.send_signal('/', 'PropertiesChanged', IFACE_PROPERTIES,
+                                    'sa{sv}as', ('com.example.Other', { name: ('i', 0) }, []))
+
+    @method(interface=IFACE_EXAMPLE)
+    def Stop(self, message):
+        self.connection.stop()
+
+
+class TestPropertyCache(BaseTest):
+
+    @classmethod
+    def setup_class(cls):
+        super(TestPropertyCache, cls).setup_class()
+        cls.handler = DeviceHandler()
+        conn = SimpleDBusConnection(DBUS_BUS_SESSION)
+        conn.add_handler(cls.handler)
+        cls.server_name = conn.get_unique_name()
+        conn.call_method(_tdbus.DBUS_PATH_DBUS, 'RequestName',
+                         _tdbus.DBUS_INTERFACE_DBUS, 'su', (SERVICE_EXAMPLE, 0),
+                         destination=_tdbus.DBUS_SERVICE_DBUS)
+        cls.server = Thread(target=conn.dispatch)
+        cls.server.start()
+
+    @classmethod
+    def teardown_class(cls):
+        client = SimpleDBusConnection(DBUS_BUS_SESSION)
+        client.call_method('/', 'Stop', IFACE_EXAMPLE, destination=cls.server_name)
+        cls.server.join()
+        super(TestPropertyCache, cls).teardown_class()
+
+    def setup(self):
+        self.handler.reset()
+        self.client = SimpleDBusConnection(DBUS_BUS_SESSION)
+
+    def teardown(self):
+        self.client.close()
+
+    def change(self, name, value, invalidate=False):
+        # The signals arrive before the reply, and are dispatched while the
+        # client waits for it.
+        self.client.call_method('/', 'Change', IFACE_EXAMPLE, 'svb',
+                                (name, value, invalidate),
+                                destination=SERVICE_EXAMPLE)
+
+    def test_read(self):
+        cache = PropertyCache(self.client, SERVICE_EXAMPLE, '/', IFACE_EXAMPLE)
+        calls = self.handler.calls
+        for i in range(10):
+            assert cache.get('Name') == 'eth0'
+            assert cache['Level'] == 1
+        assert self.handler.calls == calls
+        assert cache.get('Unknown') is None
+        assert 'Name' in cache
+        assert_raises(KeyError, cache.__getitem__, 'Unknown')
+        cache.close()
+
+    def test_changed(self):
+        cache = PropertyCache(self.client, SERVICE_EXAMPLE, '/', IFACE_EXAMPLE)
+        changes = []
+        cache.add_callback(lambda cache, changed, invalidated:
+                                changes.append((changed, invalidated)))
+        calls = self.handler.calls
+        self.change('Level', ('i', 2))
+        assert cache['Level'] == 2
+        assert self.handler.calls == calls
+        assert changes == [({'Level': 2}, [])]
+        self.change('Level', ('i', 3), invalidate=True)
+        assert changes[-1] == ({}, ['Level'])
+        assert cache['Level'] == 3
+        assert self.handler.calls == calls + 1
+        assert cache.get_all() == { 'Name': 'eth0', 'Level': 3 }
+        cache.close()
+        self.change('Level', ('i', 4))
+        assert cache['Level'] == 3
+
+    def test_unique_name(self):
+        cache = PropertyCache(self.client, self.server_name, '/', IFACE_EXAMPLE)
+        self.change('Name', ('s', 'eth1'))
+        assert cache['Name'] == 'eth1'
+        cache.close()
+        assert self.client.handlers == []
+
+    def start_service(self, name, level):
+        handler = DeviceHandler()
+        handler.properties['Level'] = ('i', level)
+        conn = SimpleDBusConnection(DBUS_BUS_SESSION)
+        conn.add_handler(handler)
+        conn.call_method(_tdbus.DBUS_PATH_DBUS, 'RequestName',
+                         _tdbus.DBUS_INTERFACE_DBUS, 'su', (name, 0),
+                         destination=_tdbus.DBUS_SERVICE_DBUS)
+        thread = Thread(target=conn.dispatch)
+        thread.start()
+        return conn, thread
+
+    def stop_service(self, conn, thread):
+        self.client.call_method('/', 'Stop', IFACE_EXAMPLE,
+                                destination=conn.get_unique_name())
+        thread.join()
+        conn.close()
+
+    def test_owner_change(self):
+        name = 'com.example.Restart'
+        service = self.start_service(name, 1)
+        cache = PropertyCache(self.client, name, '/', IFACE_EXAMPLE)
+        changes = []
+        cache.add_callback(lambda cache, changed, invalidated:
+                                changes.append((changed, invalidated)))
+        assert cache['Level'] == 1
+        self.stop_service(*service)
+        # The service restarts under the same name.
+        service = self.start_service(name, 5)
+        # NameOwnerChanged is dispatched while waiting for this reply.
+        self.client.call_method('/', 'Change', IFACE_EXAMPLE, 'svb',
+                                ('Name', ('s', 'eth1'), False), destination=name)
+        assert cache['Level'] == 5
+        assert cache['Name'] == 'eth1'
+        assert changes[0][0]['Level'] == 5
+        cache.close()
+        self.stop_service(*service)
+
+
+IFACE_DEVICE = 'com.example.Device'
+
+
+class ExportedDevice(DBusHandler):
+
+    Name = dbus_property('s', IFACE_DEVICE, default='eth0')
+    Level = dbus_property('u', IFACE_DEVICE, access='readwrite', default=0)
+    Secret = dbus_property('s', IFACE_DEVICE, access='write')
+
+    @method(path='/dev', interface=IFACE_EXAMPLE)
+    def Bump(self, message):
+        for i in range(5):
+            self.Level += 1
+        self.Name = 'eth%d' % self.Level
+
+    @method(path='/dev', interface=IFACE_EXAMPLE)
+    def Ping(self, message):
+        pass
+
+    @method(path='/dev', interface=IFACE_EXAMPLE)
+    def Get(self, message):
+        self.set_response('s', ('example',))
+
+    @method(path='/dev', interface=IFACE_EXAMPLE)
+    def Stop(self, message):
+        self.connection.stop()
+
+
+class SlowDevice(ExportedDevice):
+
+    @method(path='/slow', interface=IFACE_EXAMPLE)
+    def Bump(self, message):
+        super(SlowDevice, self).Bump(message)
+
+    @method(path='/slow', interface=IFACE_EXAMPLE)
+    def Ping(self, message):
+        pass
+
+    @method(path='/slow', interface=IFACE_EXAMPLE)
+    def Stop(self, message):
+        pass
+
+
+class TestExportedProperties(BaseTest):
+
+    @classmethod
+    def setup_class(cls):
+        super(TestExportedProperties, cls).setup_class()
+        conn = SimpleDBusConnection(DBUS_BUS_SESSION)
+        cls.device = ExportedDevice()
+        cls.device.export_properties(conn, '/dev')
+        cls.slow_device = SlowDevice()
+        cls.slow_device.export_properties(conn, '/slow', interval=1)
+        conn.add_handler(cls.device)
+        conn.add_handler(cls.slow_device)
+        cls.server_name = conn.get_unique_name()
+        cls.server = Thread(target=conn.dispatch)
+        cls.server.start()
+
+    @classmethod
+    def teardown_class(cls):
+        client = SimpleDBusConnection(DBUS_BUS_SESSION)
+        client.call_method('/dev', 'Stop', IFACE_EXAMPLE, destination=cls.server_name)
+        cls.server.join()
+        super(TestExportedProperties, cls).teardown_class()
+
+    def setup(self):
+        self.client = SimpleDBusConnection(DBUS_BUS_SESSION)
+
+    def teardown(self):
+        self.client.close()
+
+    def call(self, path, member, interface=IFACE_EXAMPLE, format=None, args=None):
+        reply = self.client.call_method(path, member, interface, format, args,
+                                        destination=self.server_name)
+        return reply.get_args()
+
+    def test_get_set(self):
+        name = self.device.Name
+        assert self.call('/dev', 'Get', IFACE_PROPERTIES, 'ss',
+                         (IFACE_DEVICE, 'Name')) == (('s', name),)
+        self.call('/dev', 'Set', IFACE_PROPERTIES, 'ssv',
+                  (IFACE_DEVICE, 'Level', ('u', 10)))
+        assert self.device.Level == 10
+        values = self.call('/dev', 'GetAll', IFACE_PROPERTIES, 's', (IFACE_DEVICE,))[0]
+        assert values == { 'Name': ('s', name), 'Level': ('u', 10) }
+        self.call('/dev', 'Set', IFACE_PROPERTIES, 'ssv',
+                  (IFACE_DEVICE, 'Secret', ('s', 'foo')))
+        assert self.device.get_property('Secret') == 'foo'
+        assert_raises(DBusError, self.call, '/dev', 'Get', IFACE_PROPERTIES,
+                      'ss', (IFACE_DEVICE, 'Secret'))
+        assert_raises(DBusError, self.call, '/dev', 'Get', IFACE_PROPERTIES,
+                      'ss', (IFACE_DEVICE, 'Unknown'))
+        assert_raises(DBusError, self.call, '/dev', 'Set', IFACE_PROPERTIES,
+                      'ssv', (IFACE_DEVICE, 'Name', ('s', 'eth1')))
+        assert_raises(DBusError, self.call, '/dev', 'Set', IFACE_PROPERTIES,
+                      'ssv', (IFACE_DEVICE, 'Level', ('s', 'high')))
+
+    def test_method_names(self):
+        # A method named Get on another interface does not hide the
+        # properties interface, nor the other way around.
+        assert self.call('/dev', 'Get') == ('example',)
+        assert self.call('/dev', 'Get', IFACE_PROPERTIES, 'ss',
+                         (IFACE_DEVICE, 'Name')) == (('s', self.device.Name),)
+        # A handler that implements the properties interface itself.
+        assert_raises(ValueError, DeviceHandler().export_properties,
+                      self.client, '/')
+
+    def test_coalesced(self):
+        cache = PropertyCache(self.client, self.server_name, '/dev', IFACE_DEVICE)
+        changes = []
+        cache.add_callback(lambda cache, changed, invalidated: changes.append(changed))
+        self.call('/dev', 'Bump')
+        # The changes are sent after the loop iteration that handled Bump.
+        self.call('/dev', 'Ping')
+        level = self.device.Level
+        assert changes == [{ 'Level': level, 'Name': 'eth%d' % level }]
+        assert cache['Level'] == level
+        cache.close()
+
+    def test_interval(self):
+        cache = PropertyCache(self.client, self.server_name, '/slow', IFACE_DEVICE)
+        changes = []
+        cache.add_callback(lambda cache, changed, invalidated: changes.append(changed))
+        for i in range(3):
+            self.call('/slow', 'Bump')
+        self.call('/slow', 'Ping')
+        assert changes == []
+        time.sleep(1.5)
+        self.call('/slow', 'Ping')
+        assert changes == [{ 'Level': 15, 'Name': 'eth15' }]
+        cache.close()
@@ -0,0 +1,230 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+import os
+import tempfile
+from threading import Thread
+
+from tdbus import *
+from tdbus import _tdbus
+from tdbus.proxy import IFACE_INTROSPECTABLE, IFACE_PROPERTIES
+from tdbus.test.base import BaseTest
+from nose.tools import assert_raises
+
+IFACE_EXAMPLE = 'com.example'
+SERVICE_EXAMPLE = 'com.example.Proxy'
+
+INTROSPECTION = """
+<node>
+  <interface name="com.example">
+    <method name="Echo">
+      <arg name="value" type="y" direction="in"/>
+      <arg name="values" type="a{sv}" direction="in"/>
+      <arg name="value" type="y" direction="out"/>
+      <arg name="values" type="a{sv}" direction="out"/>
+    </method>
+    <method name="Add">
+      <arg type="q"/>
+      <arg type="q"/>
+      <arg type="u" direction="out"/>
+    </method>
+    <method name="Nothing"/>
+    <method name="Stop"/>
+    <signal name="Changed">
+      <arg type="s"/>
+      <arg type="v"/>
+    </signal>
+    <property name="Level" type="y" access="readwrite"/>
+  </interface>
+  <interface name="org.freedesktop.DBus.Introspectable">
+    <method name="Introspect">
+      <arg type="s" direction="out"/>
+    </method>
+  </interface>
+</node>
+"""
+
+
+class ExampleHandler(DBusHandler):
+
+    def __init__(self):
+        super(ExampleHandler, self).__init__()
+        self.introspected = 0
+        self.level = 0
+
+    @method(interface=IFACE_INTROSPECTABLE)
+    def Introspect(self, message):
+        self.introspected += 1
+        self.set_response('s', (INTROSPECTION,))
+
+    @method(interface=IFACE_EXAMPLE)
+    def Echo(self, message):
+        self.set_response(message.get_signature(), message.get_args())
+
+    @method(interface=IFACE_EXAMPLE)
+    def Add(self, message):
+        self.set_response('u', (sum(message.get_args()),))
+
+    @method(interface=IFACE_EXAMPLE)
+    def Nothing(self, message):
+        pass
+
+    @method(interface=IFACE_EXAMPLE)
+    def Removed(self, message):
+        raise DBusError('org.freedesktop.DBus.Error.UnknownMethod')
+
+    @method(interface=IFACE_EXAMPLE)
+    def Stop(self, message):
+        self.connection.stop()
+
+    @method(interface=IFACE_PROPERTIES)
+    def Get(self, message):
+        self.set_response('v', (('y', self.level),))
+
+    @method(interface=IFACE_PROPERTIES)
+    def Set(self, message):
+        self.level = message.get_args()[2][1]
+
+
+class TestProxy(BaseTest):
+
+    @classmethod
+    def setup_class(cls):
+        super(TestProxy, cls).setup_class()
+        cls.handler = ExampleHandler()
+        conn = SimpleDBusConnection(DBUS_BUS_SESSION)
+        conn.add_handler(cls.handler)
+        cls.server_name = conn.get_unique_name()
+        conn.call_method(_tdbus.DBUS_PATH_DBUS, 'RequestName',
+                         _tdbus.DBUS_INTERFACE_DBUS, 'su', (SERVICE_EXAMPLE, 0),
+                         destination=_tdbus.DBUS_SERVICE_DBUS)
+        cls.server = Thread(target=conn.dispatch)
+        cls.server.start()
+        cls.client = SimpleDBusConnection(DBUS_BUS_SESSION)
+
+    @classmethod
+    def teardown_class(cls):
+        cls.client.call_method('/', 'Stop', IFACE_EXAMPLE,
+                               destination=cls.server_name)
+        cls.server.join()
+        super(TestProxy, cls).teardown_class()
+
+    def proxy(self, cache=None):
+        if cache is None:
+            cache = SignatureCache()
+        return Proxy(self.client, self.server_name, '/', cache=cache)
+
+    def test_call(self):
+        proxy = self.proxy()
+        assert proxy.Echo(10, {'foo': 1}) == (10, {'foo': ('i', 1)})
+        assert proxy.Add(1, 2) == 3
+        assert proxy.Nothing() is None
+        assert proxy.get_interfaces() == [IFACE_EXAMPLE, IFACE_INTROSPECTABLE]
+        assert proxy.get_signal_signature('Changed') == 'sv'
+        assert_raises(DBusError, proxy.Add, 1, -1)
+        assert_raises(DBusError, proxy.Add, 1)
+        assert_raises(TypeError, proxy.Nothing, 1)
+
+    def test_unknown_member(self):
+        proxy = self.proxy()
+        assert_raises(AttributeError, getattr, proxy, 'Unknown')
+        assert_raises(AttributeError, proxy.get_signal_signature, 'Unknown')
+        assert_raises(AttributeError, proxy.get_method, 'Echo', 'com.example.Other')
+
+    def test_cache(self):
+        cache = SignatureCache()
+        introspected = self.handler.introspected
+        self.proxy(cache)
+        self.proxy(cache)
+        assert self.handler.introspected == introspected + 1
+        assert cache.get(self.server_name, '/', IFACE_EXAMPLE)['methods']['Add'] \
+                    == ['qq', 'u']
+        cache.invalidate(self.server_name, '/')
+        self.proxy(cache)
+        assert self.handler.introspected == introspected + 2
+
+    def test_file_cache(self):
+        fd, filename = tempfile.mkstemp()
+        os.close(fd)
+        try:
+            introspected = self.handler.introspected
+            proxy = Proxy(self.client, SERVICE_EXAMPLE, '/',
+                          cache=SignatureCache(filename))
+            assert proxy.Add(1, 2) == 3
+            # Another process would load the signatures from the file.
+            proxy = Proxy(self.client, SERVICE_EXAMPLE, '/',
+                          cache=SignatureCache(filename))
+            assert proxy.Add(3, 4) == 7
+            assert self.handler.introspected == introspected + 1
+            # Objects behind unique names are not stored.
+            self.proxy(SignatureCache(filename))
+            assert SignatureCache(filename).get_object(self.server_name, '/') is None
+            proxy.cache.invalidate(SERVICE_EXAMPLE, '/')
+            assert SignatureCache(filename).get_object(SERVICE_EXAMPLE, '/') is None
+        finally:
+            os.unlink(filename)
+            os.unlink(filename + '.lock')
+
+    def test_file_cache_processes(self):
+        fd, filename = tempfile.mkstemp()
+        os.close(fd)
+        interfaces = {IFACE_EXAMPLE: {'methods': {}, 'signals': {},
+                                      'properties': {}}}
+        try:
+            pids = []
+            for i in range(8):
+                pid = os.fork()
+                if pid == 0:
+                    cache = SignatureCache(filename)
+                    for j in range(10):
+                        cache.put_object('com.example.N%d' % i, '/%d' % j,
+                                         interfaces)
+                    os._exit(0)
+                pids.append(pid)
+            for pid in pids:
+                assert os.waitpid(pid, 0)[1] == 0
+            # No process lost the updates of another.
+            cache = SignatureCache(filename)
+            for i in range(8):
+                for j in range(10):
+                    assert cache.get_object('com.example.N%d' % i, '/%d' % j) \
+                                == interfaces
+        finally:
+            os.unlink(filename)
+            os.unlink(filename + '.lock')
+
+    def test_stale(self):
+        cache = SignatureCache()
+        proxy = self.proxy(cache)
+        interfaces = cache.get_object(self.server_name, '/')
+        interfaces[IFACE_EXAMPLE]['methods']['Removed'] = ['', '']
+        assert proxy.Add(1, 2) == 3
+        introspected = self.handler.introspected
+        assert_raises(DBusError, proxy.Removed)
+        assert cache.get_object(self.server_name, '/') is None
+        assert 'Removed' not in proxy.__dict__
+        assert 'Add' not in proxy.__dict__
+        # The next lookup introspects the object again.
+        assert_raises(AttributeError, getattr, proxy, 'Removed')
+        assert self.handler.introspected == introspected + 1
+        assert proxy.Add(1, 2) == 3
+        assert cache.get_object(self.server_name, '/') is not None
+
+    def test_property(self):
+        proxy = self.proxy()
+        proxy.set_property('Level', 5)
+        assert self.handler.level == 5
+        assert proxy.get_property('Level') == 5
+        assert_raises(DBusError, proxy.set_property, 'Level', 256)
+
+    def test_bus(self):
+        proxy = Proxy(self.client, _tdbus.DBUS_SERVICE_DBUS, _tdbus.DBUS_PATH_DBUS,
+                      interface=_tdbus.DBUS_INTERFACE_DBUS)
+        assert self.server_name in proxy.ListNames()
+        assert proxy.GetNameOwner(self.server_name) == self.server_name
+        assert proxy.NameHasOwner(self.server_name) is True
@@ -0,0 +1,201 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+import sys
+from threading import Thread
+
+from tdbus import *
+from tdbus import _tdbus
+from nose.tools import assert_raises
+
+IFACE_EXAMPLE = 'com.example'
+
+
+class PingHandler(DBusHandler):
+
+    def __init__(self):
+        super(PingHandler, self).__init__()
+        self.data = 0
+
+    @method(interface=IFACE_EXAMPLE)
+    def Ping(self, message):
+        self.set_response('s', ('pong',))
+
+    @signal_handler(interface=IFACE_EXAMPLE)
+    def Data(self, message):
+        self.data += 1
+
+
+class ConnectionCounter(SimpleDBusServer):
+
+    def __init__(self, address):
+        super(ConnectionCounter, self).__init__(address)
+        self.accepted = 0
+
+    def new_connection(self, connection):
+        self.accepted += 1
+
+
+class NullLoop(object):
+
+    def add_watch(self, watch): pass
+    def remove_watch(self, watch): pass
+    def watch_toggled(self, watch): pass
+    def add_timeout(self, timeout): pass
+    def remove_timeout(self, timeout): pass
+    def timeout_toggled(self, timeout): pass
+
+
+class WritableCounter(SimpleDBusConnection):
+
+    writable = 0
+
+    def writable_again(self):
+        self.writable += 1
+
+
+class TestSimpleDBusServer(object):
+
+    def setup(self):
+        self.server = ConnectionCounter('unix:tmpdir=/tmp')
+        self.handler = PingHandler()
+        self.server.add_handler(self.handler)
+        self.start_server()
+
+    def teardown(self):
+        self.stop_server()
+        self.server.close()
+
+    def start_server(self):
+        self.thread = Thread(target=self.server.dispatch)
+        self.thread.start()
+
+    def stop_server(self):
+        self.server.stop()
+        # Wake up the server loop.
+        client = SimpleDBusConnection(self.server.get_address(), register=False)
+        client.close()
+        self.thread.join()
+
+    def ping(self, client):
+        reply = client.call_method('/', 'Ping', IFACE_EXAMPLE, timeout=10)
+        return reply.get_args()
+
+    def test_get_address(self):
+        assert self.server.get_address().startswith('unix:')
+        assert 'guid=' in self.server.get_address()
+
+    def test_call_method(self):
+        client = SimpleDBusConnection(self.server.get_address(), register=False)
+        assert self.ping(client) == ('pong',)
+        assert self.ping(client) == ('pong',)
+        client.close()
+
+    def test_multiple_clients(self):
+        clients = [ SimpleDBusConnection(self.server.get_address(), register=False)
+                    for i in range(3) ]
+        for client in clients:
+            assert self.ping(client) == ('pong',)
+        assert self.server.accepted == 3
+        for client in clients:
+            client.close()
+
+    def test_no_unique_name(self):
+        client = SimpleDBusConnection(self.server.get_address(), register=False)
+        assert_raises(DBusError, client.get_unique_name)
+        client.close()
+
+    def test_disconnect(self):
+        client = SimpleDBusConnection(self.server.get_address(), register=False)
+        assert self.ping(client) == ('pong',)
+        assert client.get_is_connected()
+        client.close()
+        assert not client.get_is_connected()
+        # A new call forces the server loop to run at least once more.
+        client = SimpleDBusConnection(self.server.get_address(), register=False)
+        assert self.ping(client) == ('pong',)
+        assert len(self.server.connections) == 1
+        client.close()
+
+
+    def test_outgoing_limits(self):
+        client = WritableCounter(self.server.get_address(), register=False)
+        assert self.ping(client) == ('pong',)
+        client.set_outgoing_limits(262144)
+        # Without a loop on the other side, the queue only grows.
+        self.stop_server()
+        for i in range(1000):
+            message = _tdbus.Message(_tdbus.DBUS_MESSAGE_TYPE_SIGNAL, path='/',
+                                     member='Data', interface=IFACE_EXAMPLE)
+            message.set_args('ay', ('x' * 65536,))
+            try:
+                client._connection.send(message)
+            except WouldBlock:
+                break
+        else:
+            raise AssertionError('send did not block')
+        stats = client.get_stats()
+        assert stats['would_block'] == 1
+        # The refused message would have taken the queue past the limit.
+        assert stats['outgoing_size'] > 131072
+        assert stats['peak_outgoing_size'] <= 262144
+        assert not client._connection.check_writable()
+        # A blocking connection waits until the server reads again.
+        self.start_server()
+        client.send_signal('/', 'Data', IFACE_EXAMPLE)
+        assert client.writable == 1
+        assert self.ping(client) == ('pong',)
+        assert self.handler.data == i + 1
+        client.close()
+
+    def test_writable_callback(self):
+        client = WritableCounter(self.server.get_address(), register=False)
+        assert self.ping(client) == ('pong',)
+        client.set_outgoing_limits(262144)
+        self.stop_server()
+        message = _tdbus.Message(_tdbus.DBUS_MESSAGE_TYPE_SIGNAL, path='/',
+                                 member='Data', interface=IFACE_EXAMPLE)
+        message.set_args('ay', ('x' * 65536,))
+        for i in range(1000):
+            try:
+                client._connection.send(message)
+            except WouldBlock:
+                break
+        self.start_server()
+        client._connection.flush()
+        # Sending does not unblock the connection or call the callback,
+        # even when the queue has drained. Only check_writable() does.
+        assert_raises(WouldBlock, client._connection.send, message)
+        assert client.writable == 0
+        assert client._connection.check_writable()
+        assert client.writable == 1
+        client._connection.send(message)
+        assert client.writable == 1
+        client.close()
+
+    def test_invalid_limits(self):
+        client = SimpleDBusConnection(self.server.get_address(), register=False)
+        assert_raises(DBusError, client.set_outgoing_limits, 100, 200)
+        assert_raises(DBusError, client.set_outgoing_limits, -1, 0)
+        client.close()
+
+
+class TestServer(object):
+
+    def test_listen_error(self):
+        assert_raises(DBusError, _tdbus.Server, 'foo:bar=baz')
+
+    def test_set_loop_replace(self):
+        server = _tdbus.Server('unix:tmpdir=/tmp')
+        first, second = NullLoop(), NullLoop()
+        refs = sys.getrefcount(first)
+        server.set_loop(first)
+        server.set_loop(second)
+        assert server.get_loop() is second
+        assert sys.getrefcount(first) == refs
+        server.disconnect()
@@ -0,0 +1,147 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+import os
+import tempfile
+from threading import Thread, Event
+
+from tdbus import *
+from tdbus import _tdbus
+from tdbus.shm import RingBuffer, SharedMemorySender, SharedMemoryHandler
+from tdbus.test.base import BaseTest
+from nose.tools import assert_raises
+
+
+class TestRingBuffer(object):
+
+    def test_write_read(self):
+        ring = RingBuffer.create(1024)
+        position = ring.write('foo')
+        assert position == 0
+        assert str(ring.read(position, 3)) == 'foo'
+        position = ring.write('bar')
+        assert position == 3
+        assert str(ring.read(position, 3)) == 'bar'
+        ring.close()
+
+    def test_shared(self):
+        ring = RingBuffer.create(1024)
+        other = RingBuffer(ring.fd, 1024)
+        position = ring.write('foo')
+        assert str(other.read(position, 3)) == 'foo'
+        other.release(position, 3)
+        assert ring.get_free() == 1024
+        other.close()
+        ring.close()
+
+    def test_full(self):
+        ring = RingBuffer.create(16)
+        assert ring.write('x' * 10) == 0
+        assert ring.write('y' * 10) is None
+        ring.release(0, 10)
+        assert ring.get_free() == 16
+
+    def test_wrap(self):
+        ring = RingBuffer.create(16)
+        ring.release(ring.write('x' * 10), 10)
+        # Does not fit before the end: starts at the beginning again.
+        position = ring.write('y' * 8)
+        assert position == 16
+        assert str(ring.read(position, 8)) == 'y' * 8
+        assert ring.get_free() == 2
+
+    def test_too_large(self):
+        ring = RingBuffer.create(16)
+        assert_raises(ValueError, ring.write, 'x' * 17)
+
+    def test_release_out_of_order(self):
+        ring = RingBuffer.create(16)
+        first = ring.write('x' * 4)
+        second = ring.write('y' * 4)
+        ring.release(second, 4)
+        assert ring.get_free() == 8
+        ring.release(first, 4)
+        assert ring.get_free() == 16
+
+    def test_release_out_of_order_wrap(self):
+        ring = RingBuffer.create(16)
+        ring.release(ring.write('x' * 10), 10)
+        first = ring.write('y' * 4)
+        second = ring.write('z' * 4)
+        assert second == 16
+        ring.release(second, 4)
+        assert ring.get_free() == 6
+        ring.release(first, 4)
+        assert ring.get_free() == 16
+
+    def test_open(self):
+        ring = RingBuffer.create(1024)
+        other = RingBuffer.open(ring.fd, 1024)
+        assert_raises(OSError, os.ftruncate, ring.fd.fileno(), 0)
+        assert_raises(DBusError, RingBuffer.open, ring.fd, 512)
+        assert_raises(DBusError, RingBuffer.open, ring.fd, 0)
+        other.close()
+        ring.close()
+
+    def test_no_memfd(self):
+        # Only a memfd can be sealed, so there is no fallback.
+        memfd_create = _tdbus.memfd_create
+        def unavailable(name):
+            raise NotImplementedError('memfd_create() not available')
+        _tdbus.memfd_create = unavailable
+        try:
+            assert_raises(NotImplementedError, RingBuffer.create, 1024)
+        finally:
+            _tdbus.memfd_create = memfd_create
+
+    def test_open_unsealed(self):
+        with tempfile.TemporaryFile() as fout:
+            fout.truncate(1024)
+            assert_raises(DBusError, RingBuffer.open, _tdbus.UnixFd(fout), 896)
+
+
+class FrameCollector(SharedMemoryHandler):
+
+    def __init__(self, count):
+        super(FrameCollector, self).__init__()
+        self.count = count
+        self.frames = []
+        self.done = Event()
+
+    def frame_received(self, channel, data):
+        self.frames.append(str(data))
+        if len(self.frames) == self.count:
+            self.done.set()
+
+
+class TestSharedMemory(BaseTest):
+
+    def test_send_frames(self):
+        receiver = SimpleDBusConnection(DBUS_BUS_SESSION)
+        handler = FrameCollector(100)
+        receiver.add_handler(handler)
+        thread = Thread(target=receiver.dispatch)
+        thread.start()
+        sender = SimpleDBusConnection(DBUS_BUS_SESSION)
+        try:
+            channel = SharedMemorySender(sender, receiver.get_unique_name(), 4096)
+            frames = [ chr(ord('a') + i % 26) * (i * 10) for i in range(100) ]
+            for frame in frames:
+                while not channel.send(frame):
+                    handler.done.wait(0.01)
+            assert handler.done.wait(10)
+            assert handler.frames == frames
+            channel.close()
+            assert handler.channels == {}
+        finally:
+            receiver.stop()
+            sender.send_signal('/', 'Wakeup', 'com.example',
+                               destination=receiver.get_unique_name())
+            thread.join()
+            sender.close()
+            receiver.close()
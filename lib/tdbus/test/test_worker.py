@@ -0,0 +1,128 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+import os
+from threading import Thread
+
+from tdbus import *
+from tdbus import _tdbus
+from tdbus.test.base import BaseTest
+from nose.tools import assert_raises
+
+
+class WorkerHandler(DBusHandler):
+
+    def __init__(self):
+        super(WorkerHandler, self).__init__()
+        self.signals = 0
+
+    @method(path='/test', interface='com.example.Worker')
+    def GetPid(self, message):
+        self.set_response('i', (os.getpid(),))
+
+    @method(path='/test', interface='com.example.Worker')
+    def Sum(self, message):
+        self.set_response('x', (sum(range(message.get_args()[0])),))
+
+    @method(path='/test', interface='com.example.Worker')
+    def Fail(self, message):
+        raise DBusError('com.example.Error')
+
+    @method(path='/test', interface='com.example.Worker')
+    def Exit(self, message):
+        os._exit(1)
+
+    @method(path='/test', interface='com.example.Worker')
+    def GetSignals(self, message):
+        self.set_response('i', (self.signals,))
+
+    @signal_handler(path='/test', interface='com.example.Worker')
+    def Ping(self, message):
+        self.signals += 1
+        self.connection.send_signal('/test', 'Pong', 'com.example.Worker')
+
+
+class PongHandler(DBusHandler):
+
+    def __init__(self, count):
+        super(PongHandler, self).__init__()
+        self.count = count
+        self.pongs = 0
+
+    @signal_handler(interface='com.example.Worker')
+    def Pong(self, message):
+        self.pongs += 1
+        if self.pongs == self.count:
+            self.connection.stop()
+
+
+class TestWorkerPool(BaseTest):
+
+    def setup(self):
+        self.pool = WorkerPool([WorkerHandler()], 2)
+        self.server = SimpleDBusConnection(DBUS_BUS_SESSION)
+        self.server.add_handler(self.pool)
+        self.thread = Thread(target=self.server.dispatch)
+        self.thread.start()
+        self.client = SimpleDBusConnection(DBUS_BUS_SESSION)
+
+    def teardown(self):
+        self.server.stop()
+        self.client.send_signal('/', 'Wakeup', 'com.example',
+                                destination=self.server.get_unique_name())
+        self.thread.join()
+        self.pool.close()
+        self.client.close()
+        self.server.close()
+
+    def call(self, member, format=None, args=None):
+        reply = self.client.call_method('/test', member, 'com.example.Worker',
+                                        format, args,
+                                        destination=self.server.get_unique_name())
+        return reply.get_args()[0]
+
+    def test_workers(self):
+        pids = set(self.call('GetPid') for i in range(10))
+        assert pids == set(worker.pid for worker in self.pool.workers)
+        assert os.getpid() not in pids
+        assert self.pool.get_pending() == [0, 0]
+
+    def test_reply(self):
+        assert self.call('Sum', 'i', (1000,)) == sum(range(1000))
+
+    def test_error(self):
+        assert_raises(DBusError, self.call, 'Fail')
+        assert self.pool.get_pending() == [0, 0]
+
+    def test_signals(self):
+        handler = PongHandler(6)
+        self.client.add_handler(handler)
+        self.client.call_method(_tdbus.DBUS_PATH_DBUS, 'AddMatch',
+                                _tdbus.DBUS_INTERFACE_DBUS, 's',
+                                ("type='signal',member='Pong'",),
+                                destination=_tdbus.DBUS_SERVICE_DBUS)
+        for i in range(3):
+            self.client.send_signal('/test', 'Ping', 'com.example.Worker',
+                                    destination=self.server.get_unique_name())
+        self.client.dispatch()
+        assert handler.pongs == 6
+        assert set(self.call('GetSignals') for i in range(10)) == set([3])
+
+    def test_worker_exit(self):
+        assert_raises(DBusError, self.call, 'Exit')
+        assert len(self.pool.workers) == 1
+        assert self.pool.get_pending() == [0]
+        pids = set(self.call('GetPid') for i in range(4))
+        assert pids == set([self.pool.workers[0].pid])
+        assert_raises(DBusError, self.call, 'Exit')
+        assert self.pool.workers == []
+        # Without workers, calls are handled in this process.
+        assert self.call('GetPid') == os.getpid()
+
+    def test_illegal_workers(self):
+        assert_raises(ValueError, WorkerPool, [], 0)
@@ -0,0 +1,308 @@
+#
+# This file is part of python-tdbus. Python-tdbus is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
+# complete list.
+
+# Multiprocess dispatch.
+#
+# A WorkerPool forks a number of worker processes that each have a copy of
+# a set of handlers. Method calls for these handlers are marshalled and
+# passed to the least busy worker over a socket pair. Everything a handler
+# sends in a worker (the reply, but also signals) is passed back to the
+# connection process and sent from there. Replies keep the serial of the
+# method call, so to peers this looks like a single connection.
+#
+# A frame on a worker socket is a header with a token and a length,
+# followed by a marshalled message. The token identifies the method call
+# that a message belongs to. It is 0 for signals.
+
+from __future__ import division, absolute_import
+
+import os
+import errno
+import socket
+import struct
+import logging
+import itertools
+import threading
+
+from tdbus import _tdbus
+from tdbus.connection import DBusConnection, DBusError
+
+_header = struct.Struct('!QI')
+
+
+def _send_frame(sock, token, data):
+    sock.sendall(_header.pack(token, len(data)) + data)
+
+def _recv_exactly(sock, size):
+    chunks = []
+    while size > 0:
+        try:
+            chunk = sock.recv(size)
+        except socket.error as e:
+            if e.errno == errno.EINTR:
+                continue
+            return None
+        if not chunk:
+            return None
+        chunks.append(chunk)
+        size -= len(chunk)
+    return ''.join(chunks)
+
+def _recv_frame(sock):
+    """Return a (token, data) tuple, or None at end of file."""
+    header = _recv_exactly(sock, _header.size)
+    if header is None:
+        return None
+    token, size = _header.unpack(header)
+    data = _recv_exactly(sock, size)
+    if data is None:
+        return None
+    return token, data
+
+
+class _WorkerChannel(object):
+    """Takes the place of a _tdbus.Connection in a worker process."""
+
+    def __init__(self, sock):
+        self._socket = sock
+        self.token = 0
+
+    def send(self, message, request=None):
+        _send_frame(self._socket, self.token, message.marshal())
+
+    def send_with_reply(self, message, timeout):
+        raise DBusError('cannot wait for a reply in a worker process')
+
+
+class WorkerConnection(DBusConnection):
+    """The connection that handlers see in a worker process.
+
+    Replies, errors, signals and method calls without a callback are passed
+    to the connection process and sent from there. Method calls with a
+    callback are not supported.
+    """
+
+    Local = type('Object', (object,), {})
+
+    def __init__(self, sock):
+        self._connection = _WorkerChannel(sock)
+        self.handlers = []
+        self.logger = logging.getLogger('tdbus')
+        self._server = None
+        self._peers = None
+        self._names = None
+        self._credentials = None
+        self._batcher = None
+
+
+class _Worker(object):
+
+    def __init__(self, pid, sock):
+        self.pid = pid
+        self.socket = sock
+        self.lock = threading.Lock()
+        self.pending = 0
+        self.thread = None
+
+
+class WorkerPool(object):
+    """Dispatch method calls to a pool of worker processes.
+
+    The `handlers` are DBusHandler instances. The pool is added to a
+    connection with add_handler(), instead of the handlers themselves.
+    Method calls for the handlers are passed to one of `workers` processes,
+    so that CPU bound handlers can use more than one core. Each worker has
+    its own copy of the handlers, created when the pool is created, and
+    state is not shared between them. Signals are passed to all workers.
+
+    Messages with Unix file descriptors cannot be passed to a worker. They
+    are dispatched by the handlers in the connection process.
+
+    Replies are read and sent by a thread per worker. Override
+    start_reader() to use something else. The workers are forked when the
+    pool is created, which should be done before other threads are started.
+    For that reason a worker that exits is not replaced. The method calls
+    it was handling get an error reply, and new calls go to the remaining
+    workers. Without workers, method calls are dispatched by the handlers
+    in the connection process.
+    """
+
+    def __init__(self, handlers, workers=None):
+        if workers is None:
+            workers = os.sysconf('SC_NPROCESSORS_ONLN')
+        if workers < 1:
+            raise ValueError('workers must be at least 1')
+        self.handlers = handlers
+        self.logger = logging.getLogger('tdbus')
+        self.workers = []
+        self._requests = {}
+        self._tokens = itertools.count(1)
+        self._lock = threading.Lock()
+        for i in range(workers):
+            self.workers.append(self._fork())
+        for worker in self.workers:
+            self.start_reader(worker)
+
+    def _fork(self):
+        parent, child = socket.socketpair()
+        pid = os.fork()
+        if pid == 0:
+            status = 0
+            try:
+                parent.close()
+                for worker in self.workers:
+                    worker.socket.close()
+                self._run_worker(child)
+            except:
+                status = 1
+            finally:
+                os._exit(status)
+        child.close()
+        return _Worker(pid, parent)
+
+    def _run_worker(self, sock):
+        connection = WorkerConnection(sock)
+        while True:
+            frame = _recv_frame(sock)
+            if frame is None:
+                break
+            connection._connection.token, data = frame
+            message = _tdbus.demarshal(data)
+            for handler in self.handlers:
+                if message.get_type() == _tdbus.DBUS_MESSAGE_TYPE_METHOD_CALL \
+                        and handler.get_method(message) is None:
+                    continue
+                connection.spawn(handler.dispatch, connection, message)
+
+    def start_reader(self, worker):
+        """Start reading messages from `worker`, by calling
+        read_worker(worker) in a new thread."""
+        worker.thread = threading.Thread(target=self.read_worker, args=(worker,))
+        worker.thread.daemon = True
+        worker.thread.start()
+
+    def read_worker(self, worker):
+        """Send the messages from `worker`, until the worker exits."""
+        while True:
+            frame = _recv_frame(worker.socket)
+            if frame is None:
+                break
+            token, data = frame
+            message = _tdbus.demarshal(data)
+            with self._lock:
+                connection, request, owner = \
+                        self._requests.get(token, (None, None, None))
+                if request is not None and \
+                        message.get_reply_serial() == request.get_serial():
+                    del self._requests[token]
+                    worker.pending -= 1
+                else:
+                    request = None
+            if connection is None:
+                self.logger.error('message from worker %d without a connection'
+                                  % worker.pid)
+                continue
+            try:
+                if request is None:
+                    connection._connection.send(message.copy())
+                else:
+                    connection._connection.send(message.copy(), request)
+                connection._connection.flush()
+            except DBusError as e:
+                self.logger.error('could not send message from worker: %s' % e)
+        self._worker_exited(worker)
+
+    def _worker_exited(self, worker):
+        """Remove `worker` from the pool and fail the method calls that it
+        was handling. Nothing is done if the pool is being closed."""
+        with self._lock:
+            if worker not in self.workers:
+                return
+            self.workers.remove(worker)
+            failed = [ (token, request) for token, request in self._requests.items()
+                       if request[2] is worker ]
+            for token, request in failed:
+                del self._requests[token]
+            worker.pending = 0
+        self.logger.error('worker %d exited, %d method calls failed'
+                          % (worker.pid, len(failed)))
+        os.waitpid(worker.pid, 0)
+        with worker.lock:
+            worker.socket.close()
+        for token, (connection, message, owner) in failed:
+            try:
+                connection.send_error(message, 'org.freedesktop.DBus.Error.Failed',
+                                      's', ('worker process exited',))
+            except DBusError as e:
+                self.logger.error('could not send error reply: %s' % e)
+
+    def _forward(self, worker, token, message):
+        data = message.marshal()
+        try:
+            with worker.lock:
+                _send_frame(worker.socket, token, data)
+        except socket.error as e:
+            # The reader of the worker fails the method call.
+            self.logger.error('could not pass message to worker %d: %s'
+                              % (worker.pid, e))
+
+    def dispatch(self, connection, message):
+        """Dispatch a message. This is called by the connection."""
+        mtype = message.get_type()
+        if mtype == _tdbus.DBUS_MESSAGE_TYPE_METHOD_CALL:
+            if not any(handler.get_method(message) for handler in self.handlers):
+                return False
+            if 'h' in message.get_signature():
+                for handler in self.handlers:
+                    handler.dispatch(connection, message)
+                return True
+            token = next(self._tokens)
+            with self._lock:
+                if self.workers:
+                    # Least busy worker, in turn if there is a tie.
+                    start = token % len(self.workers)
+                    workers = self.workers[start:] + self.workers[:start]
+                    worker = min(workers, key=lambda worker: worker.pending)
+                    worker.pending += 1
+                    self._requests[token] = (connection, message, worker)
+                else:
+                    worker = None
+            if worker is None:
+                for handler in self.handlers:
+                    handler.dispatch(connection, message)
+                return True
+            self._forward(worker, token, message)
+        elif mtype == _tdbus.DBUS_MESSAGE_TYPE_SIGNAL:
+            if 'h' in message.get_signature():
+                for handler in self.handlers:
+                    handler.dispatch(connection, message)
+                return True
+            with self._lock:
+                self._requests[0] = (connection, None, None)
+                workers = list(self.workers)
+            for worker in workers:
+                self._forward(worker, 0, message)
+        else:
+            return False
+        return True
+
+    def get_pending(self):
+        """Return the number of method calls that each worker is handling."""
+        return [ worker.pending for worker in self.workers ]
+
+    def close(self):
+        """Stop the workers and wait for them to exit."""
+        with self._lock:
+            workers, self.workers = self.workers, []
+        for worker in workers:
+            worker.socket.shutdown(socket.SHUT_RDWR)
+        for worker in workers:
+            os.waitpid(worker.pid, 0)
+            if worker.thread is not None:
+                worker.thread.join()
+            worker.socket.close()
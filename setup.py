@@ -6,8 +6,15 @@
 # Copyright (c) 2012 the python-tdbus authors. See the file "AUTHORS" for a
 # complete list.
 
+import os
+import sys
+import shutil
+import tempfile
 import subprocess
-from setuptools import setup, Extension
+from setuptools import setup, Extension, Command
+from distutils.ccompiler import new_compiler
+from distutils.sysconfig import customize_compiler
+from distutils.errors import CompileError
 
 
 version_info = {
@@ -34,11 +41,71 @@ def pkgconfig(*args):
     return output.strip().split() + ['-O0']
 
 
+def have_header(name):
+    """Return whether the C header `name` can be included."""
+    tmpdir = tempfile.mkdtemp()
+    try:
+        fname = os.path.join(tmpdir, 'check.c')
+        with open(fname, 'w') as fout:
+            fout.write('#include <%s>\n' % name)
+        compiler = new_compiler()
+        customize_compiler(compiler)
+        # Silence the compiler: a missing header is not an error.
+        stderr = os.dup(2)
+        devnull = os.open(os.devnull, os.O_WRONLY)
+        os.dup2(devnull, 2)
+        try:
+            compiler.compile([fname], output_dir=tmpdir)
+        except CompileError:
+            return False
+        finally:
+            os.dup2(stderr, 2)
+            os.close(stderr)
+            os.close(devnull)
+        return True
+    finally:
+        shutil.rmtree(tmpdir)
+
+
+# USDT probes are compiled in when systemtap's sys/sdt.h is available.
+define_macros = []
+if have_header('sys/sdt.h'):
+    define_macros.append(('HAVE_SYS_SDT_H', '1'))
+
+
+class bench(Command):
+    """Run the benchmark suite."""
+
+    description = 'run the benchmark suite'
+    user_options = [
+        ('output=', 'o', 'write results as JSON lines to this file'),
+        ('filter=', 'f', 'only run benchmarks matching this glob pattern'),
+        ('repeat=', 'r', 'number of timing runs per benchmark (default: 3)')
+    ]
+
+    def initialize_options(self):
+        self.output = None
+        self.filter = None
+        self.repeat = 3
+
+    def finalize_options(self):
+        self.repeat = int(self.repeat)
+
+    def run(self):
+        self.reinitialize_command('build_ext', inplace=1)
+        self.run_command('build_ext')
+        sys.path.insert(0, 'lib')
+        from tdbus.bench.base import run_benchmarks
+        run_benchmarks(self.output, self.filter, self.repeat)
+
+
 setup(
     package_dir = { '': 'lib' },
-    packages = ['tdbus', 'tdbus.test'],
+    packages = ['tdbus', 'tdbus.test', 'tdbus.bench'],
     ext_modules = [Extension('tdbus._tdbus', ['lib/tdbus/_tdbus.c'],
+              define_macros = define_macros,
               extra_compile_args = pkgconfig('--cflags', 'dbus-1'),
               extra_link_args =  pkgconfig('--libs', 'dbus-1'))],
+    cmdclass = { 'bench': bench },
     **version_info
 )